@@ -0,0 +1,90 @@
+#!/bin/bash
+# Compares the packet rate of pfifo, the sch_dscd module and bpf_dscd, see README.md.
+# bpf_dscd is experimental and has not been built or run yet.
+# pktgen sends through the root qdisc of a dummy device (xmit_mode queue_xmit), which
+# frees every packet at once, so the rate is bound by the enqueue and dequeue path.
+# One pktgen thread sends ABE packets (skb->priority 6), a second one as many BE packets.
+#
+# Run as root in a checkout, after make in dscd_bpf/ and dscd_scheduler/ and
+# ./build.sh in dscd_tc/.
+#
+# COUNT       packets per pktgen thread, defaults to 2000000
+# PKT_SIZE    defaults to 1000
+# QDISC_OPTS  options of both dscd and dscd_loader load, e.g. "B_max 3125000 T_d 2ms"
+
+set -o errexit
+set -o nounset
+
+COUNT="${COUNT:-2000000}"
+PKT_SIZE="${PKT_SIZE:-1000}"
+QDISC_OPTS="${QDISC_OPTS:-}"
+
+bpf_dir="$(cd "$(dirname "$0")" && pwd)"
+module="$bpf_dir/../dscd_scheduler/sch_dscd.ko"
+export TC_LIB_DIR="$bpf_dir/../dscd_tc/tc_lib"
+pg=/proc/net/pktgen
+dev=dscdbench0
+
+if [ "$(nproc)" -lt 2 ]; then
+	echo "bench.sh: needs two CPUs for the pktgen threads" >&2
+	exit 1
+fi
+
+loaded_module=0
+loaded_bpf=0
+cleanup() {
+	[ -e $pg/pgctrl ] && echo reset > $pg/pgctrl
+	ip link del "$dev" 2>/dev/null || true
+	[ $loaded_bpf = 1 ] && "$bpf_dir/dscd_loader" unload
+	[ $loaded_module = 1 ] && rmmod sch_dscd
+	return 0
+}
+trap cleanup EXIT
+
+modprobe pktgen
+modprobe dummy
+if ! grep -q "^sch_dscd " /proc/modules; then
+	insmod "$module"
+	loaded_module=1
+fi
+# shellcheck disable=SC2086
+"$bpf_dir/dscd_loader" load $QDISC_OPTS
+loaded_bpf=1
+
+ip link add "$dev" type dummy
+ip link set dev "$dev" txqueuelen 1000 up
+
+# pg_thread CPU PRIORITY: the pktgen thread of CPU sends COUNT packets with skb->priority PRIORITY
+pg_thread() {
+	local thread=$pg/kpktgend_$1 pgdev=$pg/$dev@$1
+
+	echo rem_device_all > "$thread"
+	echo "add_device $dev@$1" > "$thread"
+	echo "xmit_mode queue_xmit" > "$pgdev"
+	echo "count $COUNT" > "$pgdev"
+	echo "pkt_size $PKT_SIZE" > "$pgdev"
+	echo "skb_priority $2" > "$pgdev"
+	echo "dst 198.51.100.1" > "$pgdev"
+	echo "dst_mac 02:00:00:00:00:01" > "$pgdev"
+}
+
+for qdisc in pfifo dscd bpf_dscd; do
+	case $qdisc in
+	dscd)	opts=$QDISC_OPTS ;;
+	*)	opts= ;;
+	esac
+	# shellcheck disable=SC2086
+	tc qdisc replace dev "$dev" root $qdisc $opts
+
+	pg_thread 0 6
+	pg_thread 1 0
+	# returns when both threads are done
+	echo start > $pg/pgctrl
+
+	abe=$(grep -o "[0-9]*pps" $pg/$dev@0)
+	be=$(grep -o "[0-9]*pps" $pg/$dev@1)
+	echo "$qdisc: ABE ${abe%pps} pps, BE ${be%pps} pps, total $((${abe%pps} + ${be%pps})) pps"
+	tc -s qdisc show dev "$dev" | grep -E "^ Sent|dropped"
+
+	tc qdisc del dev "$dev" root
+done
@@ -0,0 +1,797 @@
+// SPDX-License-Identifier: GPL-2.0
+/*
+ * DSCD as a BPF qdisc (struct_ops Qdisc_ops, Linux 6.16+)
+ *
+ * Port of the enqueue, dequeue and credit logic of net/sched/sch_dscd.c
+ * for kernels, which can't load the module. The state is global, so only
+ * one qdisc instance can exist at a time. See README.md for the options,
+ * which sch_dscd has, but this variant doesn't.
+ *
+ * Experimental: not yet built or run against a kernel, and it deviates
+ * from sch_dscd, see "BPF Qdisc (experimental)" in README.md.
+ */
+
+#include "vmlinux.h"
+#include <bpf/bpf_helpers.h>
+#include <bpf/bpf_tracing.h>
+#include <bpf/bpf_core_read.h>
+#include <bpf/bpf_endian.h>
+
+// vmlinux.h already has the types of linux/pkt_sched.h
+#define __LINUX_PKT_SCHED_H
+#include <uapi/linux/pkt_sched_dscd.h>
+
+#include "dscd_bpf.h"
+
+char _license[] SEC("license") = "GPL";
+
+#define NET_XMIT_SUCCESS	0x00
+#define NET_XMIT_DROP		0x01
+
+#define TC_PRIO_INTERACTIVE	6
+#define TC_PRIO_MAX			15
+
+#define ETH_P_IP	0x0800
+#define ETH_P_IPV6	0x86DD
+
+#define EBUSY		16
+
+#define NSEC_PER_SEC	1000000000ULL
+
+#define ABE_CREDIT_SHIFT DSCD_BPF_ABE_CREDIT_SHIFT
+#define SERVICE_RUN_MAX_COUNT ((1U << 30) - 1)
+#define DSCD_BPF_NONE	(DSCD_BPF_CLASSES)
+
+#ifndef __contains
+#define __contains(name, node) __attribute__((btf_decl_tag("contains:" #name ":" #node)))
+#endif
+
+#ifndef container_of
+#define container_of(ptr, type, member) \
+		((type *)((void *)(ptr) - __builtin_offsetof(type, member)))
+#endif
+
+#define private(name) SEC(".data." #name) __hidden __attribute__((aligned(8)))
+
+#define min(a, b) ((a) < (b) ? (a) : (b))
+
+extern void *bpf_obj_new_impl(__u64 local_type_id, void *meta) __ksym;
+extern void bpf_obj_drop_impl(void *kptr, void *meta) __ksym;
+extern int bpf_list_push_back_impl(struct bpf_list_head *head, struct bpf_list_node *node,
+				   void *meta, __u64 off) __ksym;
+extern struct bpf_list_node *bpf_list_pop_front(struct bpf_list_head *head) __ksym;
+extern struct bpf_list_node *bpf_list_front(struct bpf_list_head *head) __ksym;
+
+#define bpf_obj_new(type) ((type *)bpf_obj_new_impl(bpf_core_type_id_local(type), NULL))
+#define bpf_obj_drop(kptr) bpf_obj_drop_impl(kptr, NULL)
+#define bpf_list_push_back(head, node) bpf_list_push_back_impl(head, node, NULL, 0)
+
+extern int bpf_dynptr_from_skb(struct __sk_buff *s, __u64 flags, struct bpf_dynptr *ptr) __ksym;
+extern void bpf_kfree_skb(struct sk_buff *p) __ksym;
+extern void bpf_qdisc_skb_drop(struct sk_buff *p, struct bpf_sk_buff_ptr *to_free) __ksym;
+extern void bpf_qdisc_bstats_update(struct Qdisc *sch, const struct sk_buff *skb) __ksym;
+
+
+// tunables, set by the loader before the program is loaded
+const volatile struct dscd_bpf_config cfg = {
+	.credit_half_life	= 100 * 1000 * 1000,	// 100 ms
+	.rate_memory		= 100 * 1000 * 1000,	// 100 ms
+	.T_d				= 10 * 1000 * 1000,		// 10 ms
+	.T_q				= 1,
+	.abe_prio			= 1 << TC_PRIO_INTERACTIVE,
+	.est_batch			= 1,
+};
+
+// read by the loader, see dscd_loader.c
+struct dscd_bpf_state dscd;
+struct tc_dscd_xstats dscd_xstats;
+
+struct service_run {
+	u32 pkt_len;
+	u32 count:30,
+	    cls:2;
+};
+
+struct service_run service_runs[DSCD_BPF_SERVICE_RUNS];
+
+// a queued packet, length and enqueue time are kept next to the skb,
+// so the head of a class can be read under the lock
+struct skb_node {
+	struct sk_buff __kptr *skb;
+	struct bpf_list_node node;
+	u64 q_time;
+	u32 len;
+};
+
+private(Q) struct bpf_spin_lock dscd_lock;
+private(Q) struct bpf_list_head abe_queue __contains(skb_node, node);
+private(Q) struct bpf_list_head be_queue __contains(skb_node, node);
+
+
+static __always_inline unsigned int qdisc_pkt_len(const struct sk_buff *skb)
+{
+	return ((struct qdisc_skb_cb *)skb->cb)->pkt_len;
+}
+
+static __always_inline struct dscd_bpf_class *dscd_class(u32 idx)
+{
+	return &dscd.classes[idx & 1];
+}
+
+static __always_inline struct tc_dscd_class_stats *dscd_class_stats(u32 idx)
+{
+	return idx == DSCD_BPF_ABE ? &dscd_xstats.abe_stats : &dscd_xstats.be_stats;
+}
+
+static __always_inline u32 dscd_class_limit(u32 idx)
+{
+	return idx == DSCD_BPF_ABE ? cfg.abe_limit : cfg.be_limit;
+}
+
+
+/* ********** Classification ********** */
+
+// DSCP of an IPv4 or IPv6 packet, 0 for other packets
+static u8 dscd_get_dscp(struct sk_buff *skb)
+{
+	struct bpf_dynptr ptr;
+	u8 hdr[2];
+	u32 off;
+
+	if (bpf_dynptr_from_skb((struct __sk_buff *)skb, 0, &ptr))
+		return 0;
+
+	// network header offset from skb->data
+	off = skb->network_header - (u32)((u64)skb->data - (u64)skb->head);
+	if (bpf_dynptr_read(hdr, sizeof(hdr), &ptr, off, 0))
+		return 0;
+
+	switch (skb->protocol) {
+	case bpf_htons(ETH_P_IP):
+		return hdr[1] >> 2;
+	case bpf_htons(ETH_P_IPV6):
+		return (((u32)hdr[0] << 8 | hdr[1]) >> 6) & 0x3f;
+	}
+	return 0;
+}
+
+// ABE if the priority is in abe_prio or the DSCP in abe_dscp
+static __always_inline u32 dscd_map_class(struct sk_buff *skb)
+{
+	u32 prio = skb->priority;
+
+	if (prio <= TC_PRIO_MAX && (cfg.abe_prio & (1U << prio)))
+		return DSCD_BPF_ABE;
+	if (cfg.abe_dscp && (cfg.abe_dscp & (1ULL << dscd_get_dscp(skb))))
+		return DSCD_BPF_ABE;
+	return DSCD_BPF_BE;
+}
+
+// bucket of the queueing delay histogram, see struct tc_dscd_delay_hist
+static __always_inline u32 dscd_hist_bucket(u64 delay_ns)
+{
+	u64 v = delay_ns >> TC_DSCD_HIST_UNIT_SHIFT;
+	u32 msb = 0, bucket;
+
+	if (v < (1 << TC_DSCD_HIST_SUB_BITS))
+		return v;
+
+	// no fls64() in BPF
+	if (v >> 32) { v >>= 32; msb += 32; }
+	if (v >> 16) { v >>= 16; msb += 16; }
+	if (v >> 8) { v >>= 8; msb += 8; }
+	if (v >> 4) { v >>= 4; msb += 4; }
+	if (v >> 2) { v >>= 2; msb += 2; }
+	if (v >> 1) msb += 1;
+
+	v = delay_ns >> TC_DSCD_HIST_UNIT_SHIFT;
+	bucket = ((msb - TC_DSCD_HIST_SUB_BITS + 1) << TC_DSCD_HIST_SUB_BITS) +
+		 ((v >> (msb - TC_DSCD_HIST_SUB_BITS)) & ((1 << TC_DSCD_HIST_SUB_BITS) - 1));
+
+	return bucket < TC_DSCD_HIST_BUCKETS ? bucket : TC_DSCD_HIST_BUCKETS - 1;
+}
+
+
+/* ********** Class Helpers ********** */
+
+static __always_inline void class_enqueue(u32 idx, struct skb_node *skbn, u32 len, u64 q_time)
+{
+	struct dscd_bpf_class *cls = dscd_class(idx);
+
+	if (cls->len == 0) {
+		cls->head_len = len;
+		cls->head_q_time = q_time;
+	}
+	cls->len++;
+	cls->size += len;
+
+	bpf_spin_lock(&dscd_lock);
+	if (idx == DSCD_BPF_ABE)
+		bpf_list_push_back(&abe_queue, &skbn->node);
+	else
+		bpf_list_push_back(&be_queue, &skbn->node);
+	bpf_spin_unlock(&dscd_lock);
+}
+
+// remove the head packet of a class, its successor becomes the cached head
+static __always_inline struct sk_buff *class_dequeue(u32 idx)
+{
+	struct dscd_bpf_class *cls = dscd_class(idx);
+	struct bpf_list_node *node, *next;
+	struct skb_node *skbn;
+	struct sk_buff *skb;
+
+	bpf_spin_lock(&dscd_lock);
+	if (idx == DSCD_BPF_ABE) {
+		node = bpf_list_pop_front(&abe_queue);
+		next = bpf_list_front(&abe_queue);
+	} else {
+		node = bpf_list_pop_front(&be_queue);
+		next = bpf_list_front(&be_queue);
+	}
+	if (next) {
+		skbn = container_of(next, struct skb_node, node);
+		cls->head_len = skbn->len;
+		cls->head_q_time = skbn->q_time;
+	}
+	bpf_spin_unlock(&dscd_lock);
+
+	if (!node)
+		return NULL;
+
+	skbn = container_of(node, struct skb_node, node);
+	cls->len--;
+	cls->size -= skbn->len;
+
+	skb = bpf_kptr_xchg(&skbn->skb, NULL);
+	bpf_obj_drop(skbn);
+	return skb;
+}
+
+static __always_inline u64 class_credit_bytes(u32 idx)
+{
+	struct dscd_bpf_class *cls = dscd_class(idx);
+
+	return idx == DSCD_BPF_ABE ? cls->CC >> ABE_CREDIT_SHIFT : cls->CC;
+}
+
+static __always_inline void incr_class_credit(u32 idx, u64 credit)
+{
+	dscd_class(idx)->CC += idx == DSCD_BPF_ABE ? credit << ABE_CREDIT_SHIFT : credit;
+}
+
+static __always_inline void decr_class_credit(u32 idx, u64 credit)
+{
+	struct dscd_bpf_class *cls = dscd_class(idx);
+
+	// Dont underflow, a packet sent without credit leaves zero
+	if (idx != DSCD_BPF_ABE)
+		cls->CC -= min(cls->CC, credit);
+	else if ((credit + 1) << ABE_CREDIT_SHIFT > cls->CC)
+		cls->CC = 0;
+	else
+		cls->CC -= credit << ABE_CREDIT_SHIFT;
+}
+
+static __always_inline u64 dscd_credit_bytes(void)
+{
+	return dscd.CC_cq + class_credit_bytes(DSCD_BPF_ABE) + class_credit_bytes(DSCD_BPF_BE);
+}
+
+static __always_inline bool dscd_classes_empty(void)
+{
+	return dscd.classes[DSCD_BPF_ABE].len == 0 && dscd.classes[DSCD_BPF_BE].len == 0;
+}
+
+static __always_inline bool class_credited(u32 idx)
+{
+	struct dscd_bpf_class *cls = dscd_class(idx);
+
+	return cls->len && class_credit_bytes(idx) >= cls->head_len;
+}
+
+
+/* ********** Service Queue Helpers ********** */
+
+// Like sch_dscd, consecutive entries of the same class and length are merged
+// into a run. The runs are kept in a fixed ring instead of allocated chunks.
+
+static __always_inline struct service_run *service_run(u32 i)
+{
+	return &service_runs[i & (DSCD_BPF_SERVICE_RUNS - 1)];
+}
+
+// append service entry, returns false if the ring is full
+static bool service_enqueue(u32 len, u32 idx)
+{
+	struct service_run *run;
+
+	if (dscd.service_tail != dscd.service_head) {
+		run = service_run(dscd.service_tail - 1);
+
+		if (run->pkt_len == len && run->cls == idx && run->count < SERVICE_RUN_MAX_COUNT) {
+			run->count++;
+			goto end;
+		}
+	}
+
+	if (dscd.service_tail - dscd.service_head == DSCD_BPF_SERVICE_RUNS) {
+		dscd.service_alloc_fails++;
+		return false;
+	}
+
+	run = service_run(dscd.service_tail++);
+	run->pkt_len = len;
+	run->count = 1;
+	run->cls = idx;
+
+end:
+	dscd.service_len++;
+	dscd.CC_cq += len;
+	dscd_class(idx)->service_bytes += len;
+	return true;
+}
+
+// Move the credit of service entries at the head of the service queue to
+// their class, see service_transfer() of sch_dscd. Service queue must not be empty.
+static void service_transfer(void)
+{
+	struct service_run *run = service_run(dscd.service_head);
+	u32 idx = run->cls & 1;
+	struct dscd_bpf_class *cls = dscd_class(idx);
+	u32 len = run->pkt_len;
+	u32 count = run->count;
+	u64 credit, need, bytes;
+
+	if (cls->len && len != 0) {
+		credit = class_credit_bytes(idx);
+		need = cls->head_len - min(credit, (u64)cls->head_len);
+		count = min((u64)count, (need + len - 1) / len);
+	}
+
+	bytes = (u64)len * count;
+	incr_class_credit(idx, bytes);
+	cls->service_bytes -= bytes;
+
+	run->count -= count;
+	if (run->count == 0)
+		dscd.service_head++;
+
+	dscd.service_len -= count;
+	dscd.CC_cq -= bytes;
+}
+
+// drop all service entries, the per-class totals are credited at once
+static __always_inline void empty_service_queue(void)
+{
+	u32 i;
+
+	if (dscd.service_len == 0)
+		return;
+
+	for (i = 0; i < DSCD_BPF_CLASSES; i++) {
+		incr_class_credit(i, dscd.classes[i].service_bytes);
+		dscd.classes[i].service_bytes = 0;
+	}
+
+	dscd.service_head = dscd.service_tail;
+	dscd.service_len = 0;
+	dscd.CC_cq = 0;
+}
+
+
+/* ********** Devaluate Credit ********** */
+
+#define EXP2_TAB_BITS	8
+#define EXP2_TAB_SHIFT	31
+
+// 2^(-i / 2^EXP2_TAB_BITS) in Q31 for i = 0 .. 2^EXP2_TAB_BITS
+static const u32 exp2_tab[(1 << EXP2_TAB_BITS) + 1] = {
+	0x80000000, 0x7fa765ad, 0x7f4f08ae, 0x7ef6e8da, 0x7e9f0606, 0x7e476009,
+	0x7deff6b6, 0x7d98c9e6, 0x7d41d96e, 0x7ceb2523, 0x7c94acde, 0x7c3e7073,
+	0x7be86fba, 0x7b92aa88, 0x7b3d20b6, 0x7ae7d21a, 0x7a92be8b, 0x7a3de5df,
+	0x79e947ef, 0x7994e492, 0x7940bb9e, 0x78ecccec, 0x78991854, 0x78459dac,
+	0x77f25cce, 0x779f5590, 0x774c87cc, 0x76f9f359, 0x76a7980f, 0x765575c8,
+	0x76038c5b, 0x75b1dba2, 0x75606374, 0x750f23ab, 0x74be1c20, 0x746d4cac,
+	0x741cb528, 0x73cc556d, 0x737c2d55, 0x732c3cba, 0x72dc8374, 0x728d015d,
+	0x723db650, 0x71eea226, 0x719fc4b9, 0x71511de4, 0x7102ad80, 0x70b47368,
+	0x70666f76, 0x7018a185, 0x6fcb096f, 0x6f7da710, 0x6f307a41, 0x6ee382de,
+	0x6e96c0c3, 0x6e4a33c9, 0x6dfddbcc, 0x6db1b8a8, 0x6d65ca38, 0x6d1a1057,
+	0x6cce8ae1, 0x6c8339b2, 0x6c381ca6, 0x6bed3399, 0x6ba27e65, 0x6b57fce9,
+	0x6b0daeff, 0x6ac39485, 0x6a79ad56, 0x6a2ff94f, 0x69e6784d, 0x699d2a2c,
+	0x69540ec9, 0x690b2601, 0x68c26fb1, 0x6879ebb6, 0x683199ed, 0x67e97a34,
+	0x67a18c68, 0x6759d065, 0x6712460b, 0x66caed35, 0x6683c5c3, 0x663ccf92,
+	0x65f60a7f, 0x65af766a, 0x6569132f, 0x6522e0ad, 0x64dcdec3, 0x64970d4f,
+	0x64516c2e, 0x640bfb41, 0x63c6ba64, 0x6381a978, 0x633cc85b, 0x62f816eb,
+	0x62b39509, 0x626f4292, 0x622b1f66, 0x61e72b65, 0x61a3666d, 0x615fd05e,
+	0x611c6919, 0x60d9307b, 0x60962665, 0x60534ab7, 0x60109d51, 0x5fce1e12,
+	0x5f8bccdb, 0x5f49a98c, 0x5f07b405, 0x5ec5ec26, 0x5e8451d0, 0x5e42e4e3,
+	0x5e01a53f, 0x5dc092c7, 0x5d7fad59, 0x5d3ef4d7, 0x5cfe6923, 0x5cbe0a1c,
+	0x5c7dd7a4, 0x5c3dd19c, 0x5bfdf7e5, 0x5bbe4a61, 0x5b7ec8f2, 0x5b3f7377,
+	0x5b0049d4, 0x5ac14bea, 0x5a82799a, 0x5a43d2c6, 0x5a055751, 0x59c7071c,
+	0x5988e209, 0x594ae7fb, 0x590d18d3, 0x58cf7474, 0x5891fac1, 0x5854ab9b,
+	0x581786e6, 0x57da8c83, 0x579dbc57, 0x57611642, 0x57249a29, 0x56e847ef,
+	0x56ac1f75, 0x567020a0, 0x56344b52, 0x55f89f70, 0x55bd1cdb, 0x5581c378,
+	0x55469329, 0x550b8bd4, 0x54d0ad5a, 0x5495f7a1, 0x545b6a8b, 0x542105fd,
+	0x53e6c9da, 0x53acb607, 0x5372ca68, 0x533906e0, 0x52ff6b55, 0x52c5f7aa,
+	0x528cabc3, 0x52538786, 0x521a8ad7, 0x51e1b59a, 0x51a907b4, 0x5170810b,
+	0x51382182, 0x50ffe8fe, 0x50c7d765, 0x508fec9c, 0x50582888, 0x50208b0e,
+	0x4fe91413, 0x4fb1c37c, 0x4f7a9930, 0x4f439514, 0x4f0cb70c, 0x4ed5ff00,
+	0x4e9f6cd4, 0x4e69006e, 0x4e32b9b4, 0x4dfc988c, 0x4dc69cdd, 0x4d90c68b,
+	0x4d5b157e, 0x4d25899c, 0x4cf022ca, 0x4cbae0ef, 0x4c85c3f1, 0x4c50cbb8,
+	0x4c1bf829, 0x4be7492b, 0x4bb2bea5, 0x4b7e587e, 0x4b4a169c, 0x4b15f8e6,
+	0x4ae1ff43, 0x4aae299b, 0x4a7a77d4, 0x4a46e9d6, 0x4a137f88, 0x49e038d0,
+	0x49ad1598, 0x497a15c4, 0x4947393f, 0x49147fee, 0x48e1e9ba, 0x48af768a,
+	0x487d2646, 0x484af8d6, 0x4818ee22, 0x47e70611, 0x47b5408c, 0x47839d7b,
+	0x47521cc6, 0x4720be55, 0x46ef8210, 0x46be67e0, 0x468d6fae, 0x465c9961,
+	0x462be4e2, 0x45fb521a, 0x45cae0f2, 0x459a9152, 0x456a6323, 0x453a564d,
+	0x450a6abb, 0x44daa054, 0x44aaf702, 0x447b6ead, 0x444c0740, 0x441cc0a3,
+	0x43ed9ac0, 0x43be957f, 0x438fb0cb, 0x4360ec8d, 0x433248ae, 0x4303c518,
+	0x42d561b4, 0x42a71e6c, 0x4278fb2b, 0x424af7da, 0x421d1462, 0x41ef50ae,
+	0x41c1aca7, 0x41942839, 0x4166c34c, 0x41397dcc, 0x410c57a2, 0x40df50b8,
+	0x40b268fa, 0x4085a051, 0x4058f6a8, 0x402c6be9, 0x40000000,
+};
+
+// a * mul >> shift with the full 96 bit product, the kernel helper isn't available
+static __always_inline u64 mul_u64_u32_shr(u64 a, u32 mul, u32 shift)
+{
+	u64 hi = (a >> 32) * mul, lo = (a & 0xffffffff) * mul;
+
+	if (shift >= 32)
+		return (hi + (lo >> 32)) >> (shift - 32);
+	return (hi << (32 - shift)) + (lo >> shift);
+}
+
+// calculate  n * 2^(-y / 2^s) for s >= EXP2_TAB_BITS, see n_pow2() of sch_dscd
+static u64 n_pow2(u64 n, u64 y, u64 s)
+{
+	u64 y_unscaled = y >> s;
+	u32 frac_shift = s - EXP2_TAB_BITS;
+	u32 idx, weight, hi, lo, factor;
+
+	if (y_unscaled >= 64 - EXP2_TAB_SHIFT)
+		return 0;
+
+	idx = (y >> frac_shift) & ((1 << EXP2_TAB_BITS) - 1);
+	weight = y & ((1ULL << frac_shift) - 1);
+	hi = exp2_tab[idx];
+	lo = exp2_tab[idx + 1];
+	factor = hi - (u32)(((u64)(hi - lo) * weight) >> frac_shift);
+
+	return mul_u64_u32_shr(n, factor, EXP2_TAB_SHIFT + y_unscaled);
+}
+
+// bytes sent at rate C within diff ns, divides like sch_dscd built with DSCD_DIVIDE=1
+static __always_inline u64 rate_bytes(u64 diff)
+{
+	if (cfg.C == 0 && dscd.S_t != 0)
+		return diff * dscd.S_b / dscd.S_t;
+	return diff * cfg.C / NSEC_PER_SEC;
+}
+
+// exponential decay part of DevaluateCredit
+static __always_inline void exp_decay(u64 now)
+{
+	struct dscd_bpf_class *abe = dscd_class(DSCD_BPF_ABE);
+	u64 old_abe_credit, y;
+
+	if (dscd.last_exp_devaluation == 0) {
+		dscd.last_exp_devaluation = now;
+		return;
+	}
+
+	// y = diff / credit_half_life * 2^20
+	y = ((now - dscd.last_exp_devaluation) << 20) / cfg.credit_half_life;
+
+	old_abe_credit = abe->CC;
+	abe->CC = n_pow2(abe->CC, y, 20);
+
+	// If credit is existent, but didn't change, then dont modify
+	// last_exp_devaluation until it does
+	if (abe->CC == 0 || old_abe_credit != abe->CC)
+		dscd.last_exp_devaluation = now;
+}
+
+static __always_inline void devaluate_credit(u64 now)
+{
+	if (dscd_classes_empty()) {
+		empty_service_queue();
+		// linear decay part of DevaluateCredit
+		if (dscd.last_devaluation != 0)
+			decr_class_credit(DSCD_BPF_ABE, rate_bytes(now - dscd.last_devaluation));
+	} else {
+		exp_decay(now);
+	}
+	dscd.last_devaluation = now;
+}
+
+
+/* ********** Bandwidth Estimation ********** */
+
+// fold the current sample into S_b / S_t, EWMA only
+static void dscd_rate_update(u64 now)
+{
+	// y = diff / memory / ln(2) * 2^20, 5909 << 8 ~= 2^20 / ln(2)
+	u64 y = ((now - dscd.last_rate_update) * 5909 << 8) / cfg.rate_memory;
+
+	dscd.S_b = n_pow2(dscd.S_b, y, 20) + dscd.sample_bytes;
+	dscd.S_t = n_pow2(dscd.S_t, y, 20) + dscd.sample_time;
+
+	dscd.last_rate_update = now;
+	dscd.rate_updates++;
+	dscd.sample_pkts = 0;
+	dscd.sample_bytes = 0;
+	dscd.sample_time = 0;
+}
+
+// samples are the dequeue times of back-to-back packets
+static __always_inline void dscd_estimate_rate(struct Qdisc *sch, u32 len, u64 now)
+{
+	if (dscd.backlogged) {
+		dscd.sample_pkts++;
+		dscd.sample_bytes += dscd.last_packet_size;
+		dscd.sample_time += now - dscd.last_packet_dequeue;
+
+		if (cfg.est_interval ? now - dscd.last_rate_update >= cfg.est_interval :
+				       dscd.sample_pkts >= cfg.est_batch)
+			dscd_rate_update(now);
+	}
+
+	dscd.last_packet_dequeue = now;
+	// "> 1" instead of "> 0", because sch->q.qlen isn't decremented yet
+	dscd.backlogged = sch->q.qlen > 1;
+	dscd.last_packet_size = len;
+}
+
+
+/* ********** Enqueue ********** */
+
+SEC("struct_ops/dscd_enqueue")
+int BPF_PROG(dscd_enqueue, struct sk_buff *skb, struct Qdisc *sch,
+	     struct bpf_sk_buff_ptr *to_free)
+{
+	u32 len = qdisc_pkt_len(skb);
+	u64 now = bpf_ktime_get_ns();
+	struct tc_dscd_class_stats *stats;
+	struct skb_node *skbn;
+	u32 idx, limit;
+
+	devaluate_credit(now);
+
+	idx = dscd_map_class(skb);
+	stats = dscd_class_stats(idx);
+
+	if (len + dscd_credit_bytes() > sch->limit)
+		goto drop;
+
+	// optional limits, a burst in one class must not take the buffer of the other
+	limit = dscd_class_limit(idx);
+	if ((cfg.packet_limit && sch->q.qlen >= cfg.packet_limit) ||
+	    (limit && dscd_class(idx)->size + len > limit)) {
+		dscd.limit_drops++;
+		goto drop;
+	}
+
+	skbn = bpf_obj_new(typeof(*skbn));
+	if (!skbn)
+		goto drop;
+
+	if (!service_enqueue(len, idx)) {
+		bpf_obj_drop(skbn);
+		goto drop;
+	}
+
+	skbn->len = len;
+	skbn->q_time = now;
+	skb = bpf_kptr_xchg(&skbn->skb, skb);
+	// the node is new, there is no old skb
+	if (skb)
+		bpf_qdisc_skb_drop(skb, to_free);
+	class_enqueue(idx, skbn, len, now);
+
+	// Adjust general Qdisc stats
+	sch->qstats.backlog += len;
+	sch->q.qlen++;
+
+	stats->received_packets++;
+	return NET_XMIT_SUCCESS;
+
+drop:
+	stats->enqueue_drops++;
+	sch->qstats.drops++;
+	bpf_qdisc_skb_drop(skb, to_free);
+	return NET_XMIT_DROP;
+}
+
+
+/* ********** Dequeue ********** */
+
+// Drop the ABE packets, that have been waiting longer than T_d
+static __always_inline void dscd_drop_expired(struct Qdisc *sch, u64 now)
+{
+	struct dscd_bpf_class *abe = dscd_class(DSCD_BPF_ABE);
+	u32 drop_pkts = 0, drop_bytes = 0, len;
+	struct sk_buff *skb;
+	int i;
+
+	bpf_for(i, 0, abe->len) {
+		if (abe->len <= cfg.T_q || abe->head_q_time + cfg.T_d >= now)
+			break;
+
+		skb = class_dequeue(DSCD_BPF_ABE);
+		if (!skb)
+			break;
+
+		len = qdisc_pkt_len(skb);
+		drop_pkts++;
+		drop_bytes += len;
+		bpf_kfree_skb(skb);
+	}
+
+	if (drop_pkts) {
+		dscd_xstats.abe_stats.dequeue_drops += drop_pkts;
+		sch->qstats.drops += drop_pkts;
+		sch->qstats.backlog -= drop_bytes;
+		sch->q.qlen -= drop_pkts;
+	}
+}
+
+// class to send from, ABE before BE, DSCD_BPF_NONE if no class is credited
+static __always_inline u32 dscd_credited_class(void)
+{
+	if (class_credited(DSCD_BPF_ABE))
+		return DSCD_BPF_ABE;
+	if (class_credited(DSCD_BPF_BE))
+		return DSCD_BPF_BE;
+	return DSCD_BPF_NONE;
+}
+
+SEC("struct_ops/dscd_dequeue")
+struct sk_buff *BPF_PROG(dscd_dequeue, struct Qdisc *sch)
+{
+	u64 now = bpf_ktime_get_ns();
+	struct tc_dscd_delay_hist *hist;
+	struct tc_dscd_class_stats *stats;
+	u32 idx = DSCD_BPF_NONE, len;
+	struct sk_buff *skb;
+	u64 q_delay, q_time;
+	int i;
+
+	devaluate_credit(now);
+
+	// Drop packets, that have been waiting longer than T_d
+	dscd_drop_expired(sch, now);
+
+	if (dscd_classes_empty())
+		return NULL;
+
+	// Determine next packet, transfer service credit until a class is credited.
+	// Every transfer consumes a run or credits a class, the bound is for the verifier.
+	bpf_for(i, 0, DSCD_BPF_SERVICE_RUNS + 1) {
+		idx = dscd_credited_class();
+		if (idx != DSCD_BPF_NONE)
+			break;
+		// decayed ABE credit can't be refilled, send without credit rather than stall,
+		// unlike sch_dscd, see README.md
+		if (dscd.service_head == dscd.service_tail) {
+			idx = dscd.classes[DSCD_BPF_ABE].len ? DSCD_BPF_ABE : DSCD_BPF_BE;
+			break;
+		}
+		service_transfer();
+	}
+	if (idx == DSCD_BPF_NONE)
+		return NULL;
+
+	q_time = dscd_class(idx)->head_q_time;
+	skb = class_dequeue(idx);
+	if (!skb)
+		return NULL;
+
+	len = qdisc_pkt_len(skb);
+	decr_class_credit(idx, len);
+
+	// Estimate rate
+	if (cfg.C == 0)
+		dscd_estimate_rate(sch, len, now);
+
+	// Adjust general QDisc Stats
+	sch->qstats.backlog -= len;
+	bpf_qdisc_bstats_update(sch, skb);
+	sch->q.qlen--;
+
+	// Adjust DSCD Stats
+	q_delay = now - q_time;
+	stats = dscd_class_stats(idx);
+	stats->sent_packets++;
+	stats->sum_delay += q_delay;
+	hist = idx == DSCD_BPF_ABE ? &dscd_xstats.abe_hist : &dscd_xstats.be_hist;
+	hist->buckets[dscd_hist_bucket(q_delay)]++;
+
+	return skb;
+}
+
+
+/* ********** Init/Reset/Destroy ********** */
+
+// identifies a qdisc by its device and handle, which no other qdisc has at the same time,
+// never 0 as the ifindex isn't
+static __always_inline u64 dscd_owner(struct Qdisc *sch)
+{
+	return (u64)sch->dev_queue->dev->ifindex << 32 | sch->handle;
+}
+
+SEC("struct_ops/dscd_init")
+int BPF_PROG(dscd_init, struct Qdisc *sch, struct nlattr *opt,
+	     struct netlink_ext_ack *extack)
+{
+	struct net_device *dev = sch->dev_queue->dev;
+
+	// the state is global, a second qdisc fails, but still gets reset and destroy
+	if (dscd.owner)
+		return -EBUSY;
+	__builtin_memset(&dscd, 0, sizeof(dscd));
+	__builtin_memset(&dscd_xstats, 0, sizeof(dscd_xstats));
+	dscd.owner = dscd_owner(sch);
+	dscd.C = cfg.C;
+
+	sch->limit = cfg.B_max ? cfg.B_max :
+		     dev->tx_queue_len * (dev->mtu + dev->hard_header_len);
+	return 0;
+}
+
+static __always_inline void dscd_class_purge(u32 idx)
+{
+	struct sk_buff *skb;
+	int i;
+
+	bpf_for(i, 0, dscd_class(idx)->len) {
+		skb = class_dequeue(idx);
+		if (!skb)
+			break;
+		bpf_kfree_skb(skb);
+	}
+}
+
+SEC("struct_ops/dscd_reset")
+void BPF_PROG(dscd_reset, struct Qdisc *sch)
+{
+	u32 i;
+
+	if (dscd.owner != dscd_owner(sch))
+		return;
+
+	dscd_class_purge(DSCD_BPF_ABE);
+	dscd_class_purge(DSCD_BPF_BE);
+
+	for (i = 0; i < DSCD_BPF_CLASSES; i++) {
+		dscd.classes[i].CC = 0;
+		dscd.classes[i].service_bytes = 0;
+	}
+	dscd.service_head = dscd.service_tail;
+	dscd.service_len = 0;
+	dscd.CC_cq = 0;
+
+	sch->qstats.backlog = 0;
+	sch->q.qlen = 0;
+}
+
+SEC("struct_ops/dscd_destroy")
+void BPF_PROG(dscd_destroy, struct Qdisc *sch)
+{
+	if (dscd.owner != dscd_owner(sch))
+		return;
+
+	dscd_class_purge(DSCD_BPF_ABE);
+	dscd_class_purge(DSCD_BPF_BE);
+	dscd.owner = 0;
+}
+
+SEC(".struct_ops.link")
+struct Qdisc_ops dscd_ops = {
+	.enqueue	= (void *)dscd_enqueue,
+	.dequeue	= (void *)dscd_dequeue,
+	.init		= (void *)dscd_init,
+	.reset		= (void *)dscd_reset,
+	.destroy	= (void *)dscd_destroy,
+	.id			= "bpf_dscd",
+};
@@ -0,0 +1,74 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+#ifndef __DSCD_BPF_H
+#define __DSCD_BPF_H
+
+// shared by the BPF qdisc (dscd.bpf.c) and its loader (dscd_loader.c), experimental, see README.md
+
+// service runs of the ring, a power of two
+#define DSCD_BPF_SERVICE_RUNS	(1 << 14)
+
+#define DSCD_BPF_ABE	(0)
+#define DSCD_BPF_BE		(1)
+#define DSCD_BPF_CLASSES	(2)
+
+// ABE credit is kept << DSCD_BPF_ABE_CREDIT_SHIFT, like in sch_dscd
+#define DSCD_BPF_ABE_CREDIT_SHIFT	(10)
+
+// tunables, same meaning and units as the options of sch_dscd
+struct dscd_bpf_config {
+	__u32 B_max;			// bytes, 0 = tx_queue_len * MTU
+	__u32 packet_limit;		// 0 = off
+	__u32 abe_limit;		// bytes, 0 = off
+	__u32 be_limit;			// bytes, 0 = off
+	__u64 C;				// B/s, 0 = bandwidth estimation
+	__u64 credit_half_life;	// ns
+	__u64 rate_memory;		// ns
+	__u64 T_d;				// ns
+	__u64 T_q;				// packets
+	__u64 abe_dscp;			// bitmap of DSCP values
+	__u32 abe_prio;			// bitmap of skb->priority values
+	__u32 est_batch;		// packets
+	__u64 est_interval;		// ns, 0 = est_batch
+};
+
+struct dscd_bpf_class {
+	__u64 CC;				// ABE: << ABE_CREDIT_SHIFT
+	__u64 service_bytes;	// credit of the service entries of this class
+	__u64 head_q_time;		// enqueue time of the head packet, valid if len != 0
+	__u32 head_len;			// length of the head packet, valid if len != 0
+	__u32 len;
+	__u32 size;
+};
+
+// scheduler state, a single qdisc instance at a time
+struct dscd_bpf_state {
+	struct dscd_bpf_class classes[DSCD_BPF_CLASSES];
+
+	// service queue, a ring of runs of equal entries
+	__u64 CC_cq;
+	__u32 service_head;
+	__u32 service_tail;
+	__u64 service_len;
+	__u64 service_alloc_fails;
+
+	__u64 last_devaluation;
+	__u64 last_exp_devaluation;
+
+	// EWMA bandwidth estimation
+	__u64 S_b;
+	__u64 S_t;
+	__u64 last_rate_update;
+	__u64 last_packet_dequeue;
+	__u64 rate_updates;
+	__u64 sample_pkts;
+	__u64 sample_bytes;
+	__u64 sample_time;
+	__u32 last_packet_size;
+	__u32 backlogged;
+
+	__u64 C;				// configured rate, copied at init
+	__u64 limit_drops;
+	__u64 owner;			// the qdisc using the state, see dscd_owner(), 0 = none
+};
+
+#endif
@@ -0,0 +1,462 @@
+// SPDX-License-Identifier: GPL-2.0
+// Loader of the DSCD BPF qdisc, registers the qdisc "bpf_dscd" and prints its stats.
+// Experimental like dscd.bpf.c, see README.md.
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <linux/types.h>
+#include <uapi/linux/pkt_sched_dscd.h>
+#include <bpf/bpf.h>
+#include <bpf/libbpf.h>
+
+#include "dscd_bpf.h"
+#include "dscd.skel.h"
+
+#define PIN_DIR		"/sys/fs/bpf/dscd_bpf"
+#define PIN_LINK	PIN_DIR "/link"
+#define PIN_BSS		PIN_DIR "/bss"
+
+#define TC_PRIO_MAX	15
+#define NSEC_PER_SEC	1000000000ULL
+
+
+static void explain(void)
+{
+	fprintf(stderr,
+		"Usage: dscd_loader load [ B_max SIZE ] [ C RATE ]\n"
+		"                        [ credit_half_life TIME ] [ rate_memory TIME ]\n"
+		"                        [ T_d TIME ] [ T_q NUM ]\n"
+		"                        [ abe_prio PRIO,... | none ] [ abe_dscp DSCP,... | none ]\n"
+		"                        [ est_batch PACKETS ] [ est_interval TIME ]\n"
+		"                        [ packet_limit PACKETS ]\n"
+		"                        [ abe_limit BYTES ] [ be_limit BYTES ]\n"
+		"       dscd_loader stats\n"
+		"       dscd_loader unload\n");
+}
+
+static void explain1(const char *arg, const char *val)
+{
+	fprintf(stderr, "dscd_loader: illegal value for \"%s\": \"%s\"\n", arg, val);
+}
+
+static int parse_u64(__u64 *val, const char *arg)
+{
+	char *end;
+
+	errno = 0;
+	*val = strtoull(arg, &end, 0);
+	return errno || end == arg || *end ? -1 : 0;
+}
+
+static int parse_u32(__u32 *val, const char *arg)
+{
+	__u64 v;
+
+	if (parse_u64(&v, arg) || v > UINT32_MAX)
+		return -1;
+	*val = v;
+	return 0;
+}
+
+// like tc: ns, us, ms or s, a bare number is in us
+static int parse_time(__u64 *ns, const char *arg)
+{
+	static const struct { const char *unit; __u64 mult; } units[] = {
+		{ "ns", 1 }, { "us", 1000 }, { "ms", 1000 * 1000 }, { "s", NSEC_PER_SEC }, { "", 1000 },
+	};
+	double t;
+	char *end;
+	int i;
+
+	t = strtod(arg, &end);
+	if (end == arg || t < 0)
+		return -1;
+	for (i = 0; i < sizeof(units) / sizeof(units[0]); i++) {
+		if (strcmp(end, units[i].unit) == 0) {
+			*ns = t * units[i].mult;
+			return 0;
+		}
+	}
+	return -1;
+}
+
+// like tc: bit, kbit, mbit, gbit or bps, a bare number is in bit/s, the result in B/s
+static int parse_rate(__u64 *rate, const char *arg)
+{
+	static const struct { const char *unit; double mult; } units[] = {
+		{ "bit", 1. / 8 }, { "kbit", 1e3 / 8 }, { "mbit", 1e6 / 8 }, { "gbit", 1e9 / 8 },
+		{ "bps", 1 }, { "", 1. / 8 },
+	};
+	double r;
+	char *end;
+	int i;
+
+	r = strtod(arg, &end);
+	if (end == arg || r < 0)
+		return -1;
+	for (i = 0; i < sizeof(units) / sizeof(units[0]); i++) {
+		if (strcasecmp(end, units[i].unit) == 0) {
+			*rate = r * units[i].mult;
+			return 0;
+		}
+	}
+	return -1;
+}
+
+// parse a comma separated list of values up to max into a bitmap, "none" is the empty map
+static int parse_map(char *arg, unsigned int max, __u64 *map)
+{
+	__u32 value;
+	char *tok;
+
+	*map = 0;
+	if (strcmp(arg, "none") == 0)
+		return 0;
+
+	for (tok = strtok(arg, ","); tok; tok = strtok(NULL, ",")) {
+		if (parse_u32(&value, tok) || value > max)
+			return -1;
+		*map |= 1ULL << value;
+	}
+
+	return 0;
+}
+
+static int dscd_parse_opt(int argc, char **argv, struct dscd_bpf_config *cfg)
+{
+	__u64 map;
+
+	while (argc > 0) {
+		if (argc < 2) {
+			explain();
+			return -1;
+		}
+
+		if (strcmp(*argv, "B_max") == 0) {
+			if (parse_u32(&cfg->B_max, argv[1])) {
+				explain1("B_max", argv[1]);
+				return -1;
+			}
+		} else if (strcmp(*argv, "C") == 0) {
+			if (parse_rate(&cfg->C, argv[1])) {
+				explain1("C", argv[1]);
+				return -1;
+			}
+		} else if (strcmp(*argv, "credit_half_life") == 0) {
+			if (parse_time(&cfg->credit_half_life, argv[1])) {
+				explain1("credit_half_life", argv[1]);
+				return -1;
+			}
+		} else if (strcmp(*argv, "rate_memory") == 0) {
+			if (parse_time(&cfg->rate_memory, argv[1])) {
+				explain1("rate_memory", argv[1]);
+				return -1;
+			}
+		} else if (strcmp(*argv, "T_d") == 0) {
+			if (parse_time(&cfg->T_d, argv[1])) {
+				explain1("T_d", argv[1]);
+				return -1;
+			}
+		} else if (strcmp(*argv, "T_q") == 0) {
+			if (parse_u64(&cfg->T_q, argv[1])) {
+				explain1("T_q", argv[1]);
+				return -1;
+			}
+		} else if (strcmp(*argv, "est_batch") == 0) {
+			if (parse_u32(&cfg->est_batch, argv[1])) {
+				explain1("est_batch", argv[1]);
+				return -1;
+			}
+		} else if (strcmp(*argv, "est_interval") == 0) {
+			if (parse_time(&cfg->est_interval, argv[1])) {
+				explain1("est_interval", argv[1]);
+				return -1;
+			}
+		} else if (strcmp(*argv, "packet_limit") == 0) {
+			if (parse_u32(&cfg->packet_limit, argv[1])) {
+				explain1("packet_limit", argv[1]);
+				return -1;
+			}
+		} else if (strcmp(*argv, "abe_limit") == 0) {
+			if (parse_u32(&cfg->abe_limit, argv[1])) {
+				explain1("abe_limit", argv[1]);
+				return -1;
+			}
+		} else if (strcmp(*argv, "be_limit") == 0) {
+			if (parse_u32(&cfg->be_limit, argv[1])) {
+				explain1("be_limit", argv[1]);
+				return -1;
+			}
+		} else if (strcmp(*argv, "abe_prio") == 0) {
+			if (parse_map(argv[1], TC_PRIO_MAX, &map)) {
+				explain1("abe_prio", argv[1]);
+				return -1;
+			}
+			cfg->abe_prio = map;
+		} else if (strcmp(*argv, "abe_dscp") == 0) {
+			if (parse_map(argv[1], 63, &cfg->abe_dscp)) {
+				explain1("abe_dscp", argv[1]);
+				return -1;
+			}
+		} else {
+			fprintf(stderr, "What is \"%s\"?\n", *argv);
+			explain();
+			return -1;
+		}
+
+		// all options take a value
+		argc -= 2;
+		argv += 2;
+	}
+
+	// the BPF program divides by these
+	if (!cfg->credit_half_life || !cfg->rate_memory || !cfg->est_batch) {
+		fprintf(stderr, "dscd_loader: credit_half_life, rate_memory and est_batch must not be 0\n");
+		return -1;
+	}
+
+	return 0;
+}
+
+static int dscd_load(int argc, char **argv)
+{
+	struct bpf_link *link = NULL;
+	struct dscd_bpf *skel;
+	int err;
+
+	skel = dscd_bpf__open();
+	if (!skel) {
+		fprintf(stderr, "dscd_loader: can't open the BPF object\n");
+		return 1;
+	}
+
+	// the defaults are in the rodata of the object
+	err = dscd_parse_opt(argc, argv, (struct dscd_bpf_config *)&skel->rodata->cfg);
+	if (err)
+		goto out;
+
+	err = dscd_bpf__load(skel);
+	if (err) {
+		fprintf(stderr, "dscd_loader: can't load the BPF qdisc: %s\n", strerror(-err));
+		goto out;
+	}
+
+	link = bpf_map__attach_struct_ops(skel->maps.dscd_ops);
+	if (!link) {
+		err = -errno;
+		fprintf(stderr, "dscd_loader: can't register bpf_dscd: %s\n", strerror(errno));
+		goto out;
+	}
+
+	// the qdisc stays registered after exit while the link is pinned
+	if (mkdir(PIN_DIR, 0700) && errno != EEXIST) {
+		err = -errno;
+		goto out_pin;
+	}
+	err = bpf_link__pin(link, PIN_LINK);
+	if (!err)
+		err = bpf_map__pin(skel->maps.bss, PIN_BSS);
+	if (err) {
+		unlink(PIN_LINK);
+		goto out_pin;
+	}
+
+	// keep the pinned link attached when the fd is closed
+	bpf_link__disconnect(link);
+	printf("bpf_dscd registered, e.g. tc qdisc add dev IFACE root bpf_dscd\n");
+	goto out;
+
+out_pin:
+	fprintf(stderr, "dscd_loader: can't pin to %s: %s\n", PIN_DIR, strerror(-err));
+out:
+	bpf_link__destroy(link);
+	dscd_bpf__destroy(skel);
+	return err ? 1 : 0;
+}
+
+static int dscd_unload(void)
+{
+	if (unlink(PIN_LINK) || unlink(PIN_BSS) || rmdir(PIN_DIR)) {
+		fprintf(stderr, "dscd_loader: can't unpin %s: %s\n", PIN_DIR, strerror(errno));
+		return 1;
+	}
+	return 0;
+}
+
+
+/* ********** Stats ********** */
+
+// lower bound of a delay histogram bucket in ns, see struct tc_dscd_delay_hist
+static __u64 dscd_hist_lower_bound(unsigned int bucket)
+{
+	const unsigned int sub = 1 << TC_DSCD_HIST_SUB_BITS;
+	unsigned int exp = bucket >> TC_DSCD_HIST_SUB_BITS;
+	__u64 units;
+
+	if (bucket < sub)
+		units = bucket;
+	else
+		units = (__u64)(sub + (bucket & (sub - 1))) << (exp - 1);
+
+	return units << TC_DSCD_HIST_UNIT_SHIFT;
+}
+
+// upper bound in ns of the bucket holding the given percentile (in 1/100 %)
+static __u64 dscd_hist_percentile(const struct tc_dscd_delay_hist *hist, unsigned int pct)
+{
+	__u64 total = 0, rank, count = 0;
+	unsigned int i;
+
+	for (i = 0; i < TC_DSCD_HIST_BUCKETS; i++)
+		total += hist->buckets[i];
+	if (total == 0)
+		return 0;
+
+	rank = (total * pct + 9999) / 10000;
+	for (i = 0; i < TC_DSCD_HIST_BUCKETS - 1; i++) {
+		count += hist->buckets[i];
+		if (count >= rank)
+			return dscd_hist_lower_bound(i + 1);
+	}
+	// everything above the range ends up in the last bucket
+	return dscd_hist_lower_bound(TC_DSCD_HIST_BUCKETS - 1);
+}
+
+// Fill the tc_dscd_xstats of sch_dscd from the state of the BPF qdisc.
+// The class rates and the memory usage aren't tracked.
+static void dscd_fill_xstats(const struct dscd_bpf__bss *bss, struct tc_dscd_xstats *st)
+{
+	const struct dscd_bpf_state *q = &bss->dscd;
+	unsigned int i;
+
+	*st = bss->dscd_xstats;
+
+	st->S_b = q->S_b;
+	st->S_t = q->S_t;
+	if (q->C)
+		st->C = q->C;
+	else if (q->S_t)
+		st->C = q->S_b * NSEC_PER_SEC / q->S_t;
+	st->est_stats = (struct tc_dscd_est_stats) {
+		.estimator		= TC_DSCD_EST_EWMA,
+		.updates		= q->rate_updates,
+		.sample_packets	= q->sample_pkts,
+		.sample_bytes	= q->sample_bytes,
+		.sample_time	= q->sample_time,
+	};
+	st->pool_stats = (struct tc_dscd_pool_stats) {
+		.allocated		= 1,
+		.alloc_fails	= q->service_alloc_fails,
+		.runs			= q->service_tail - q->service_head,
+		.chunk_size		= sizeof(bss->service_runs),
+	};
+	st->memory_stats.limit_drops = q->limit_drops;
+
+	// tc_dscd_class_stats only consists of __u64 counters
+	for (i = 0; i < sizeof(st->all_stats) / sizeof(__u64); i++)
+		((__u64 *)&st->all_stats)[i] = ((__u64 *)&st->abe_stats)[i] +
+					       ((__u64 *)&st->be_stats)[i];
+	for (i = 0; i < TC_DSCD_HIST_BUCKETS; i++)
+		st->all_hist.buckets[i] = st->abe_hist.buckets[i] + st->be_hist.buckets[i];
+
+	st->abe_q_stats.length = q->classes[DSCD_BPF_ABE].len;
+	st->abe_q_stats.credit = q->classes[DSCD_BPF_ABE].CC >> DSCD_BPF_ABE_CREDIT_SHIFT;
+	st->be_q_stats.length = q->classes[DSCD_BPF_BE].len;
+	st->be_q_stats.credit = q->classes[DSCD_BPF_BE].CC;
+	st->service_q_stats.length = q->service_len;
+	st->service_q_stats.credit = q->CC_cq;
+}
+
+static void dscd_print_xstats(const struct tc_dscd_xstats *st)
+{
+	const struct tc_dscd_class_stats *stats[] = { &st->abe_stats, &st->be_stats, &st->all_stats };
+	const struct tc_dscd_delay_hist *hist[] = { &st->abe_hist, &st->be_hist, &st->all_hist };
+	static const unsigned int pct[] = { 5000, 9000, 9900, 9990 };
+	static const char * const pct_name[] = { "p50", "p90", "p99", "p99.9" };
+	unsigned int i, j;
+
+	printf("rate %llu B/s\n", st->C);
+	printf("weighted rate sum %llu\n", st->S_b);
+	printf("weighted rate count %llu\n", st->S_t);
+	printf("estimator ewma updates %llu\n", st->est_stats.updates);
+	printf("service runs %llu alloc fails %llu\n", st->pool_stats.runs, st->pool_stats.alloc_fails);
+	printf("limit drops %llu\n\n", st->memory_stats.limit_drops);
+
+	printf("                            ABE           BE      Service\n");
+	printf("  length           %12llu %12llu %12llu\n", st->abe_q_stats.length,
+	       st->be_q_stats.length, st->service_q_stats.length);
+	printf("  credit           %12llu %12llu %12llu\n\n", st->abe_q_stats.credit,
+	       st->be_q_stats.credit, st->service_q_stats.credit);
+
+#define PRINT_CLASS_STAT(name, attr) do { \
+		printf("  %-16s", name); \
+		for (i = 0; i < 3; i++) \
+			printf(" %12llu", stats[i]->attr); \
+		printf("\n"); \
+	} while (0)
+
+	printf("                            ABE           BE          ALL\n");
+	PRINT_CLASS_STAT("recv packets", received_packets);
+	PRINT_CLASS_STAT("sent packets", sent_packets);
+	PRINT_CLASS_STAT("enqueue drops", enqueue_drops);
+	PRINT_CLASS_STAT("dequeue drops", dequeue_drops);
+
+#undef PRINT_CLASS_STAT
+
+	printf("  %-16s", "avg delay (us)");
+	for (i = 0; i < 3; i++)
+		printf(" %12llu", stats[i]->sent_packets ?
+		       stats[i]->sum_delay / stats[i]->sent_packets / 1000 : 0);
+	printf("\n");
+	for (j = 0; j < sizeof(pct) / sizeof(pct[0]); j++) {
+		printf("  %-5s delay (us)", pct_name[j]);
+		for (i = 0; i < 3; i++)
+			printf(" %12llu", dscd_hist_percentile(hist[i], pct[j]) / 1000);
+		printf("\n");
+	}
+}
+
+static int dscd_stats(void)
+{
+	// holds the service ring, too large for the stack
+	static struct dscd_bpf__bss bss;
+	struct tc_dscd_xstats st;
+	__u32 zero = 0;
+	int fd;
+
+	fd = bpf_obj_get(PIN_BSS);
+	if (fd < 0) {
+		fprintf(stderr, "dscd_loader: bpf_dscd isn't loaded: %s\n", strerror(errno));
+		return 1;
+	}
+	if (bpf_map_lookup_elem(fd, &zero, &bss)) {
+		fprintf(stderr, "dscd_loader: can't read the stats: %s\n", strerror(errno));
+		close(fd);
+		return 1;
+	}
+	close(fd);
+
+	dscd_fill_xstats(&bss, &st);
+	dscd_print_xstats(&st);
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	if (argc >= 2 && strcmp(argv[1], "load") == 0)
+		return dscd_load(argc - 2, argv + 2);
+	if (argc == 2 && strcmp(argv[1], "stats") == 0)
+		return dscd_stats();
+	if (argc == 2 && strcmp(argv[1], "unload") == 0)
+		return dscd_unload();
+
+	explain();
+	return 1;
+}
@@ -0,0 +1,233 @@
+/* SPDX-License-Identifier: GPL-2.0 */
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM dscd
+
+#if !defined(_TRACE_DSCD_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _TRACE_DSCD_H
+
+#include <linux/skbuff.h>
+#include <linux/netdevice.h>
+#include <linux/tracepoint.h>
+#include <net/sch_generic.h>
+
+// fields identifying the qdisc instance, e.g. a TX queue of dscd_mq
+#define DSCD_TRACE_QDISC_FIELDS \
+	__field(int, ifindex) \
+	__field(u32, handle) \
+	__field(u32, parent)
+
+#define DSCD_TRACE_QDISC_ASSIGN(sch) do { \
+	__entry->ifindex = qdisc_dev(sch)->ifindex; \
+	__entry->handle = (sch)->handle; \
+	__entry->parent = (sch)->parent; \
+} while (0)
+
+#define DSCD_TRACE_QDISC_FMT "dev=%d handle=0x%X parent=0x%X "
+#define DSCD_TRACE_QDISC_ARGS __entry->ifindex, __entry->handle, __entry->parent
+
+// classes are identified by their minor, 1 = ABE, 2 = BE, 3 and up = additional ABE classes
+
+// packet added to a class, credits in bytes after the enqueue
+TRACE_EVENT(dscd_enqueue,
+
+	TP_PROTO(struct Qdisc *sch, struct sk_buff *skb, u32 minor,
+		 u64 class_credit, u64 service_credit),
+
+	TP_ARGS(sch, skb, minor, class_credit, service_credit),
+
+	TP_STRUCT__entry(
+		DSCD_TRACE_QDISC_FIELDS
+		__field(const void *, skbaddr)
+		__field(unsigned int, len)
+		__field(u32, minor)
+		__field(u64, class_credit)
+		__field(u64, service_credit)
+	),
+
+	TP_fast_assign(
+		DSCD_TRACE_QDISC_ASSIGN(sch);
+		__entry->skbaddr = skb;
+		__entry->len = qdisc_pkt_len(skb);
+		__entry->minor = minor;
+		__entry->class_credit = class_credit;
+		__entry->service_credit = service_credit;
+	),
+
+	TP_printk(DSCD_TRACE_QDISC_FMT "skbaddr=%p class=%u len=%u class_credit=%llu service_credit=%llu",
+		  DSCD_TRACE_QDISC_ARGS, __entry->skbaddr, __entry->minor,
+		  __entry->len, __entry->class_credit, __entry->service_credit)
+);
+
+// packet sent, sojourn is the queueing delay in ns
+TRACE_EVENT(dscd_dequeue,
+
+	TP_PROTO(struct Qdisc *sch, struct sk_buff *skb, u32 minor, u64 sojourn),
+
+	TP_ARGS(sch, skb, minor, sojourn),
+
+	TP_STRUCT__entry(
+		DSCD_TRACE_QDISC_FIELDS
+		__field(const void *, skbaddr)
+		__field(unsigned int, len)
+		__field(u32, minor)
+		__field(u64, sojourn)
+	),
+
+	TP_fast_assign(
+		DSCD_TRACE_QDISC_ASSIGN(sch);
+		__entry->skbaddr = skb;
+		__entry->len = qdisc_pkt_len(skb);
+		__entry->minor = minor;
+		__entry->sojourn = sojourn;
+	),
+
+	TP_printk(DSCD_TRACE_QDISC_FMT "skbaddr=%p class=%u len=%u sojourn=%llu",
+		  DSCD_TRACE_QDISC_ARGS, __entry->skbaddr, __entry->minor,
+		  __entry->len, __entry->sojourn)
+);
+
+// packet dropped at enqueue, the backlog or the service queue is full
+TRACE_EVENT(dscd_enqueue_drop,
+
+	TP_PROTO(struct Qdisc *sch, struct sk_buff *skb, u32 minor),
+
+	TP_ARGS(sch, skb, minor),
+
+	TP_STRUCT__entry(
+		DSCD_TRACE_QDISC_FIELDS
+		__field(const void *, skbaddr)
+		__field(unsigned int, len)
+		__field(u32, minor)
+	),
+
+	TP_fast_assign(
+		DSCD_TRACE_QDISC_ASSIGN(sch);
+		__entry->skbaddr = skb;
+		__entry->len = qdisc_pkt_len(skb);
+		__entry->minor = minor;
+	),
+
+	TP_printk(DSCD_TRACE_QDISC_FMT "skbaddr=%p class=%u len=%u",
+		  DSCD_TRACE_QDISC_ARGS, __entry->skbaddr, __entry->minor,
+		  __entry->len)
+);
+
+// queued packet dropped by the overflow policy to make room for an arriving packet
+TRACE_EVENT(dscd_pushout,
+
+	TP_PROTO(struct Qdisc *sch, struct sk_buff *skb, u32 minor),
+
+	TP_ARGS(sch, skb, minor),
+
+	TP_STRUCT__entry(
+		DSCD_TRACE_QDISC_FIELDS
+		__field(const void *, skbaddr)
+		__field(unsigned int, len)
+		__field(u32, minor)
+	),
+
+	TP_fast_assign(
+		DSCD_TRACE_QDISC_ASSIGN(sch);
+		__entry->skbaddr = skb;
+		__entry->len = qdisc_pkt_len(skb);
+		__entry->minor = minor;
+	),
+
+	TP_printk(DSCD_TRACE_QDISC_FMT "skbaddr=%p class=%u len=%u",
+		  DSCD_TRACE_QDISC_ARGS, __entry->skbaddr, __entry->minor,
+		  __entry->len)
+);
+
+// head packet of an ABE class waited longer than its T_d, it is dropped or CE marked in ecn mode
+TRACE_EVENT(dscd_td_drop,
+
+	TP_PROTO(struct Qdisc *sch, struct sk_buff *skb, u32 minor, u64 sojourn, bool ce_marked),
+
+	TP_ARGS(sch, skb, minor, sojourn, ce_marked),
+
+	TP_STRUCT__entry(
+		DSCD_TRACE_QDISC_FIELDS
+		__field(const void *, skbaddr)
+		__field(unsigned int, len)
+		__field(u32, minor)
+		__field(u64, sojourn)
+		__field(bool, ce_marked)
+	),
+
+	TP_fast_assign(
+		DSCD_TRACE_QDISC_ASSIGN(sch);
+		__entry->skbaddr = skb;
+		__entry->len = qdisc_pkt_len(skb);
+		__entry->minor = minor;
+		__entry->sojourn = sojourn;
+		__entry->ce_marked = ce_marked;
+	),
+
+	TP_printk(DSCD_TRACE_QDISC_FMT "skbaddr=%p class=%u len=%u sojourn=%llu action=%s",
+		  DSCD_TRACE_QDISC_ARGS, __entry->skbaddr, __entry->minor, __entry->len,
+		  __entry->sojourn, __entry->ce_marked ? "mark" : "drop")
+);
+
+// service entries moved from the service queue to the credit of a class
+TRACE_EVENT(dscd_credit_transfer,
+
+	TP_PROTO(struct Qdisc *sch, u32 minor, u32 count, u64 bytes,
+		 u64 class_credit, u64 service_credit),
+
+	TP_ARGS(sch, minor, count, bytes, class_credit, service_credit),
+
+	TP_STRUCT__entry(
+		DSCD_TRACE_QDISC_FIELDS
+		__field(u32, minor)
+		__field(u32, count)
+		__field(u64, bytes)
+		__field(u64, class_credit)
+		__field(u64, service_credit)
+	),
+
+	TP_fast_assign(
+		DSCD_TRACE_QDISC_ASSIGN(sch);
+		__entry->minor = minor;
+		__entry->count = count;
+		__entry->bytes = bytes;
+		__entry->class_credit = class_credit;
+		__entry->service_credit = service_credit;
+	),
+
+	TP_printk(DSCD_TRACE_QDISC_FMT "class=%u entries=%u bytes=%llu class_credit=%llu service_credit=%llu",
+		  DSCD_TRACE_QDISC_ARGS, __entry->minor, __entry->count,
+		  __entry->bytes, __entry->class_credit, __entry->service_credit)
+);
+
+// rate estimate updated, C in B/s
+TRACE_EVENT(dscd_rate_update,
+
+	TP_PROTO(struct Qdisc *sch, u8 estimator, u64 C, u64 S_b, u64 S_t),
+
+	TP_ARGS(sch, estimator, C, S_b, S_t),
+
+	TP_STRUCT__entry(
+		DSCD_TRACE_QDISC_FIELDS
+		__field(u8, estimator)
+		__field(u64, C)
+		__field(u64, S_b)
+		__field(u64, S_t)
+	),
+
+	TP_fast_assign(
+		DSCD_TRACE_QDISC_ASSIGN(sch);
+		__entry->estimator = estimator;
+		__entry->C = C;
+		__entry->S_b = S_b;
+		__entry->S_t = S_t;
+	),
+
+	TP_printk(DSCD_TRACE_QDISC_FMT "estimator=%u C=%llu S_b=%llu S_t=%llu",
+		  DSCD_TRACE_QDISC_ARGS, __entry->estimator, __entry->C,
+		  __entry->S_b, __entry->S_t)
+);
+
+#endif /* _TRACE_DSCD_H */
+
+// define_trace.h includes <trace/events/dscd.h> again, found through the include path of the module
+#include <trace/define_trace.h>
@@ -14,10 +14,74 @@ enum {
 	TCA_DSCD_RATE_MEMORY,
 	TCA_DSCD_T_D,
 	TCA_DSCD_T_Q,
+	TCA_DSCD_LOCKLESS,
+	TCA_DSCD_FLOWS,
+	TCA_DSCD_QUANTUM,
+	TCA_DSCD_ABE_DSCP,
+	TCA_DSCD_ABE_PRIO,
+	TCA_DSCD_SHAPING,
+	TCA_DSCD_SPLIT_GSO,
+	TCA_DSCD_TIME_GRANULARITY,
+	TCA_DSCD_ECN,
+	TCA_DSCD_ESTIMATOR,
+	TCA_DSCD_EST_BATCH,
+	TCA_DSCD_EST_INTERVAL,
+	TCA_DSCD_MEMORY_LIMIT,
+	TCA_DSCD_PACKET_LIMIT,
+	TCA_DSCD_ABE_LIMIT,
+	TCA_DSCD_BE_LIMIT,
+	TCA_DSCD_OVERFLOW,
+	TCA_DSCD_ABE_CLASSES,	/* nested TCA_DSCD_ABE_CLASS entries */
 	__TCA_DSCD_MAX
 };
 #define TCA_DSCD_MAX   (__TCA_DSCD_MAX - 1)
 
+/* Additional ABE classes with minor 3 and up, in the order of their minors.
+ * The ABE class with minor 1 is configured by TCA_DSCD_T_D, TCA_DSCD_T_Q,
+ * TCA_DSCD_ABE_DSCP, TCA_DSCD_ABE_PRIO and TCA_DSCD_ABE_LIMIT.
+ * An empty TCA_DSCD_ABE_CLASSES removes all additional classes.
+ * Every class takes per CPU counters and a delay histogram in every instance,
+ * so their number is bounded, 8 classes in total.
+ */
+#define TC_DSCD_MAX_ABE_CLASSES	6
+
+enum {
+	TCA_DSCD_ABE_CLASSES_UNSPEC,
+	TCA_DSCD_ABE_CLASS,		/* nested TCA_DSCD_ABE_CLASS_* */
+	__TCA_DSCD_ABE_CLASSES_MAX
+};
+#define TCA_DSCD_ABE_CLASSES_MAX   (__TCA_DSCD_ABE_CLASSES_MAX - 1)
+
+enum {
+	TCA_DSCD_ABE_CLASS_UNSPEC,
+	TCA_DSCD_ABE_CLASS_PAD,
+	TCA_DSCD_ABE_CLASS_T_D,		/* u64, ns */
+	TCA_DSCD_ABE_CLASS_T_Q,		/* u64, packets */
+	TCA_DSCD_ABE_CLASS_DSCP,	/* u64, bitmap of DSCP values */
+	TCA_DSCD_ABE_CLASS_PRIO,	/* u16, bitmap of skb->priority values */
+	TCA_DSCD_ABE_CLASS_LIMIT,	/* u32, bytes */
+	__TCA_DSCD_ABE_CLASS_MAX
+};
+#define TCA_DSCD_ABE_CLASS_MAX   (__TCA_DSCD_ABE_CLASS_MAX - 1)
+
+/* Bandwidth estimators, used if the rate C isn't configured */
+enum {
+	TC_DSCD_EST_EWMA,	/* S_b / S_t of the dequeue times of back-to-back packets */
+	TC_DSCD_EST_WINMAX,	/* max. sample rate within rate_memory */
+	TC_DSCD_EST_BQL,	/* S_b / S_t of the TX completions while backlogged */
+	__TC_DSCD_EST_MAX
+};
+#define TC_DSCD_EST_MAX   (__TC_DSCD_EST_MAX - 1)
+
+/* Packet dropped if an enqueue limit is hit */
+enum {
+	TC_DSCD_OVERFLOW_TAIL,		/* the arriving packet */
+	TC_DSCD_OVERFLOW_ABE_HEAD,	/* the oldest ABE packets */
+	TC_DSCD_OVERFLOW_LARGER,	/* the head packets of the class with the larger backlog */
+	__TC_DSCD_OVERFLOW_MAX
+};
+#define TC_DSCD_OVERFLOW_MAX   (__TC_DSCD_OVERFLOW_MAX - 1)
+
 /* DSCD Stats */
 
 struct tc_dscd_class_stats {
@@ -26,6 +90,8 @@ struct tc_dscd_class_stats {
 	__u64 sent_packets;
 	__u64 enqueue_drops;
 	__u64 dequeue_drops;
+	__u64 ecn_marks;
+	__u64 pushout_drops;	/* queued packets dropped by the overflow policy */
 };
 
 struct tc_dscd_q_stats {
@@ -33,16 +99,84 @@ struct tc_dscd_q_stats {
 	__u64 credit;
 };
 
+/* Log-linear histogram of the queueing delay. The delay is counted in units
+ * of 2^TC_DSCD_HIST_UNIT_SHIFT ns. Values below 2^TC_DSCD_HIST_SUB_BITS units
+ * get a bucket each, above that every power of two is split into
+ * 2^TC_DSCD_HIST_SUB_BITS buckets. The last bucket collects everything above.
+ */
+#define TC_DSCD_HIST_UNIT_SHIFT	10
+#define TC_DSCD_HIST_SUB_BITS	2
+#define TC_DSCD_HIST_BUCKETS	96
+
+struct tc_dscd_delay_hist {
+	__u64 buckets[TC_DSCD_HIST_BUCKETS];
+};
+
+/* Rates of the class rate estimators, B/s and packets/s */
+struct tc_dscd_rate_est {
+	__u64 bps;
+	__u64 pps;
+};
+
+struct tc_dscd_class_rates {
+	struct tc_dscd_rate_est received;
+	struct tc_dscd_rate_est sent;
+	struct tc_dscd_rate_est dropped;	/* enqueue and dequeue drops */
+};
+
+struct tc_dscd_pool_stats {
+	__u64 allocated;	/* service chunks */
+	__u64 alloc_fails;
+	__u64 runs;			/* runs of equal service entries */
+	__u64 chunk_size;	/* bytes per service chunk */
+	__u64 spare;		/* allocated, but unused service chunks */
+};
+
+struct tc_dscd_est_stats {
+	__u64 estimator;	/* TC_DSCD_EST_* in use */
+	__u64 updates;		/* updates of S_b / S_t */
+	__u64 sample_packets;	/* current sample, not yet in S_b / S_t */
+	__u64 sample_bytes;
+	__u64 sample_time;
+	__u64 window_max;	/* TC_DSCD_EST_WINMAX: B/s */
+};
+
+struct tc_dscd_memory_stats {
+	__u64 used;			/* truesize of the queued packets and service chunks */
+	__u64 limit_drops;	/* memory, packet and per class limits */
+};
+
+/* Stats of all ABE classes are summed up in the abe_* fields */
 struct tc_dscd_xstats {
 	__u64 C;
 	__u64 S_b;
 	__u64 S_t;
+	struct tc_dscd_est_stats est_stats;
 	struct tc_dscd_class_stats abe_stats;
 	struct tc_dscd_class_stats be_stats;
 	struct tc_dscd_class_stats all_stats;
 	struct tc_dscd_q_stats abe_q_stats;
 	struct tc_dscd_q_stats be_q_stats;
 	struct tc_dscd_q_stats service_q_stats;
+	struct tc_dscd_pool_stats pool_stats;
+	struct tc_dscd_delay_hist abe_hist;
+	struct tc_dscd_delay_hist be_hist;
+	struct tc_dscd_delay_hist all_hist;
+	struct tc_dscd_class_rates abe_rates;
+	struct tc_dscd_class_rates be_rates;
+	struct tc_dscd_class_rates all_rates;
+	struct tc_dscd_memory_stats memory_stats;
+};
+
+/* Class xstats of the ABE and BE classes */
+struct tc_dscd_class_xstats {
+	__u64 abe;			/* 1 for an ABE class */
+	__u64 T_d;			/* ABE: ns */
+	__u64 T_q;
+	struct tc_dscd_class_stats stats;
+	struct tc_dscd_q_stats q_stats;
+	struct tc_dscd_class_rates rates;
+	struct tc_dscd_delay_hist hist;
 };
 
 #endif
@@ -0,0 +1,57 @@
+#!/bin/bash
+# Runs the KUnit tests and microbenchmarks of sch_dscd on a 32-bit ARM guest in QEMU,
+# once for the default build and once for DSCD_DIVIDE=1, see README.md.
+#
+# KDIR     kernel tree built for ARCH=arm, e.g. multi_v7_defconfig with
+#          CONFIG_KUNIT=y, CONFIG_NET_SCHED=y, CONFIG_BLK_DEV_INITRD=y, CONFIG_MODULES=y
+# BUSYBOX  statically linked busybox for ARM, runs the guest init
+# CROSS_COMPILE  defaults to arm-linux-gnueabihf-
+
+set -o errexit
+set -o nounset
+
+: "${KDIR:?KDIR must point to the ARM kernel tree}"
+: "${BUSYBOX:?BUSYBOX must point to a static ARM busybox}"
+CROSS_COMPILE="${CROSS_COMPILE:-arm-linux-gnueabihf-}"
+QEMU="${QEMU:-qemu-system-arm}"
+
+sched_dir="$(cd "$(dirname "$0")" && pwd)"
+work_dir="$(mktemp -d)"
+trap 'rm -rf "$work_dir"' EXIT
+
+root="$work_dir/root"
+mkdir -p "$root/bin" "$root/proc" "$root/sys"
+cp "$BUSYBOX" "$root/bin/busybox"
+ln -s busybox "$root/bin/sh"
+
+# build both variants with the tests
+for divide in 0 1; do
+	make -C "$sched_dir" KDIR="$KDIR" ARCH=arm CROSS_COMPILE="$CROSS_COMPILE" clean >/dev/null
+	make -C "$sched_dir" KDIR="$KDIR" ARCH=arm CROSS_COMPILE="$CROSS_COMPILE" \
+		DSCD_KUNIT=1 DSCD_DIVIDE=$divide
+	cp "$sched_dir/sch_dscd.ko" "$root/sch_dscd_divide$divide.ko"
+done
+make -C "$sched_dir" KDIR="$KDIR" ARCH=arm CROSS_COMPILE="$CROSS_COMPILE" clean >/dev/null
+
+# the suite runs on insmod, only its output goes to the console
+cat > "$root/init" <<'EOF'
+#!/bin/sh
+/bin/busybox mount -t proc proc /proc
+/bin/busybox mount -t sysfs sysfs /sys
+for divide in 0 1; do
+	echo "=== DSCD_DIVIDE=$divide"
+	/bin/busybox dmesg -c >/dev/null
+	/bin/busybox insmod /sch_dscd_divide$divide.ko
+	/bin/busybox dmesg -c
+	/bin/busybox rmmod sch_dscd
+done
+/bin/busybox poweroff -f
+EOF
+chmod +x "$root/init"
+
+(cd "$root" && find . | cpio -o -H newc --quiet | gzip) > "$work_dir/initramfs.gz"
+
+"$QEMU" -M virt -cpu cortex-a15 -m 512 -nographic -no-reboot \
+	-kernel "$KDIR/arch/arm/boot/zImage" -initrd "$work_dir/initramfs.gz" \
+	-append "console=ttyAMA0 quiet" |
+	grep --line-buffered -E "^=== |ok |cycles per call|ppb|variant"
@@ -7,29 +7,136 @@
 #include <linux/skbuff.h>
 #include <net/pkt_sched.h>
 #include <net/pkt_cls.h>
+#include <net/gen_stats.h>
 #include <linux/ip.h>
 #include <linux/in.h>
+#include <linux/ipv6.h>
+#include <net/dsfield.h>
+#include <net/inet_ecn.h>
 #include <linux/smp.h>
 #include <linux/skb_array.h>
 #include <linux/vmalloc.h>
+#include <linux/percpu.h>
+#include <linux/u64_stats_sync.h>
+#include <linux/win_minmax.h>
+
+#define CREATE_TRACE_POINTS
+#include <trace/events/dscd.h>
 
 
 #define ABE_CREDIT_SHIFT (10)
 
+// number of runs per service chunk, keeps struct service_chunk at 512 bytes
+#define SERVICE_CHUNK_RUNS (61)
+// bits of the class index in struct service_run, the rest counts its entries
+#define SERVICE_RUN_CLASS_BITS (4)
+#define SERVICE_RUN_MAX_COUNT ((1U << (32 - SERVICE_RUN_CLASS_BITS)) - 1)
+// number of unused service chunks kept per qdisc for reuse
+#define SERVICE_SPARE_CHUNKS (16)
+// max. number of staged packets moved into the flows per dequeue in lockless mode
+#define STAGING_BATCH (64)
+// fixed point shift of the precomputed reciprocals, see dscd_update_reciprocals()
+#define RECIP_SHIFT (40)
+// fixed point shift of the configured rate in B/ns
+#define RATE_NS_SHIFT (32)
+// TC_DSCD_EST_WINMAX: rates in the u32 minmax filter are counted in 2^EST_WINMAX_SHIFT B/s
+#define EST_WINMAX_SHIFT (4)
+// TC_DSCD_EST_WINMAX: min. packets per sample without est_interval, single packets are bursts
+#define EST_WINMAX_MIN_BATCH (16)
+// TC_DSCD_EST_BQL: rate updates without bytes queued to the driver, until it is taken as without BQL
+#define EST_BQL_MAX_IDLE_UPDATES (16)
+// shaping: max. time the send schedule may lag behind, caught up by sending back to back
+#define SHAPING_MAX_LAG_NS (NSEC_PER_MSEC)
+// dscd_mq: max. age of the cached rate of an idle TX queue, the other queues keep updating theirs
+#define MQ_RATE_REFRESH_NS (NSEC_PER_MSEC)
+
+// class minors of the ABE and BE class, additional ABE classes follow with minor 3 and up
+#define DSCD_ABE_MINOR (1)
+#define DSCD_BE_MINOR (2)
+
+// index of the ABE and BE class in dscd_sched_data.classes, the index of a class is its minor - 1
+#define DSCD_ABE (0)
+#define DSCD_BE (1)
+// max. number of classes, the BE class and up to DSCD_MAX_CLASSES - 1 ABE classes,
+// the class index must fit into struct service_run
+#define DSCD_MAX_CLASSES (2 + TC_DSCD_MAX_ABE_CLASSES)
+
+// flow queues per class, the flow index is part of the class minor, see dscd_fq_flow_find(),
+// the flows of the additional ABE classes share DSCD_XABE_FLOWS_MINOR
+#define DSCD_FLOWS_MAX (0x4000)
+#define DSCD_ABE_FLOWS_MINOR (0x4000)
+#define DSCD_BE_FLOWS_MINOR (0x8000)
+#define DSCD_XABE_FLOWS_MINOR (0xC000)
+
+
+// slab cache for service chunks shared by all DSCD instances, see sch_dscd_init()
+static struct kmem_cache *dscd_service_cache __read_mostly;
+
+static bool class_rate_est = true;
+module_param(class_rate_est, bool, 0640);
+MODULE_PARM_DESC(class_rate_est, "setup rate estimators (1sec 8sec) for the DSCD classes");
+
+// traffic of a class with a rate estimator
+enum {
+	DSCD_RATE_RECEIVED,
+	DSCD_RATE_SENT,
+	DSCD_RATE_DROPPED,
+	DSCD_RATES
+};
+
+// consecutive service entries of the same class and packet length
+struct service_run {
+	u32 pkt_len;
+	u32 count : 32 - SERVICE_RUN_CLASS_BITS;
+	u32 cls : SERVICE_RUN_CLASS_BITS;	// class index
+};
 
-struct service_element {
-	int pkt_len;
-	bool is_abe;
-	struct list_head servicechain;	// contains pointers to prev and next service element
+// contiguous segment of the service queue, runs[head..tail) are in use
+struct service_chunk {
+	struct list_head chunkchain;	// contains pointers to prev and next service chunk
+	u16 head;
+	u16 tail;
+	struct service_run runs[SERVICE_CHUNK_RUNS];
 };
 
+struct dscd_mq_shared;
+
 // stats per traffic class
 struct dscd_stats {
 	u64 sum_delay_ns;
 	u64 received_pkts;
 	u64 sent_pkts;
+	u64 sent_bytes;
 	u64 enqueue_drops;
 	u64 dequeue_drops;
+	u64 ecn_marks;
+	u64 pushout_drops;
+};
+
+// per CPU counterpart of struct dscd_stats
+struct dscd_pcpu_class_stats {
+	u64_stats_t sum_delay_ns;
+	u64_stats_t received_pkts;
+	u64_stats_t sent_pkts;
+	u64_stats_t sent_bytes;
+	u64_stats_t enqueue_drops;
+	u64_stats_t dequeue_drops;
+	u64_stats_t ecn_marks;
+	u64_stats_t pushout_drops;
+};
+
+// stats of one CPU by class index, stats of all packets are derived at dump time
+struct dscd_pcpu_stats {
+	struct u64_stats_sync syncp;
+	struct dscd_pcpu_class_stats cls_stats[DSCD_MAX_CLASSES];
+	u64_stats_t hist[DSCD_MAX_CLASSES][TC_DSCD_HIST_BUCKETS];
+};
+
+// Sums of the per CPU stats at the last reset. Lockless enqueuers update their
+// per CPU stats concurrently, so a reset doesn't clear them, the dumps subtract this.
+struct dscd_stats_base {
+	struct dscd_stats cls_stats[DSCD_MAX_CLASSES];
+	u64 hist[DSCD_MAX_CLASSES][TC_DSCD_HIST_BUCKETS];
 };
 
 // struct for saving packets in a ring buffer
@@ -40,53 +147,155 @@ struct dscd_flow {
 	u64 size;
 };
 
+// flow queue of a class in flow queuing mode
+struct dscd_fq_flow {
+	struct dscd_flow q;
+	struct list_head flowchain;	// in new_flows or old_flows of its class
+	int deficit;
+};
+
+// packets of one traffic class, either a single FIFO or flow queues scheduled by DRR
+struct dscd_class {
+	struct dscd_flow fifo;			// used if flows == NULL
+	struct dscd_fq_flow *flows;		// flows_cnt flow queues
+	struct list_head new_flows;		// sparse flows, served first
+	struct list_head old_flows;
+	u64 len;
+	u64 size;
+	u64 truesize;			// of the queued packets, part of skb_memory
+	u8 index;				// in dscd_sched_data.classes
+	bool abe;
+
+	// config parameters
+	u64 T_d;				// ns, ABE delay threshold
+	u64 T_q;				// 1, ABE drop threshold
+	u32 limit;				// B, backlog, 0 = only limited by B_max
+	u64 dscp;				// ABE: bitmap of DSCP values classified into this class
+	u16 prio;				// ABE: bitmap of skb->priority values <= TC_PRIO_MAX
+
+	// credit counter, ABE credit is kept << ABE_CREDIT_SHIFT
+	u64 CC;
+	u64 service_bytes;		// credit of the class in service_q
+
+	struct net_rate_estimator __rcu *rate_est[DSCD_RATES];
+};
+
 // main data structure for dscd qdisc
 // all time variables are counted in nanoseconds
 // all rate variables are counted in Bytes/sec
 struct dscd_sched_data {
-	// config parameters
-	u64 T_d;				// ns, ABE delay threshold
+	// config parameters, T_d, T_q and the class limits are kept in struct dscd_class
 	u64 credit_half_life;	// ns, used for ABE credit devaluation
 	u64 rate_memory;		// ns, used for bandwidth estimation
 	u64 rate_config;		// B/s, Configured rate, 0 = auto 
-	u64 T_q;				// 1, ABE drop threshold
+	u32 memory_limit;		// B, truesize of the packets and service chunks, 0 = unlimited
+	u32 packet_limit;		// packets, 0 = unlimited
+	u8 overflow;			// TC_DSCD_OVERFLOW_*, packet to drop if a limit is hit
 	
-	u64 C;		// B/s, rate estimate if rate_config == 0, else same value as rate_config
-
-	// ABE/BE packets
-	struct dscd_flow abe_flow;
-	struct dscd_flow be_flow;
+	u64 C;		// B/s, configured rate, the estimate is derived from S_b / S_t, see dscd_rate()
+
+	// reciprocals refreshed on configuration changes, keep divisions out of the hot path
+	u64 credit_half_life_recip;	// 2^(20 + RECIP_SHIFT) / credit_half_life
+	u64 rate_memory_recip;		// 2^(20 + RECIP_SHIFT) / (rate_memory * ln(2))
+	u64 C_ns;					// C in B/ns << RATE_NS_SHIFT, cache of the estimate without configured rate
+	u64 C_ns_expires;			// ns, refresh the cached estimate from then on, see rate_bytes()
+	u64 ns_per_byte;			// 1 / C in ns/B << RATE_NS_SHIFT, 0 if C == 0
+
+	// shaping: dequeue paces to C, the watchdog reschedules the qdisc
+	bool shaping;
+	u64 time_next;				// ns, earliest time to send the next packet
+	struct qdisc_watchdog watchdog;
+
+	// ABE/BE packets, classes[DSCD_ABE], classes[DSCD_BE], then the additional ABE classes
+	struct dscd_class classes[DSCD_MAX_CLASSES];
+	u8 num_classes;
+	u8 num_abe;				// num_classes - 1
+	u8 abe_order[DSCD_MAX_CLASSES - 1];	// ABE class indices by increasing T_d
+	u32 flows_cnt;			// flow queues per class, 0 = FIFO
+	u64 skb_memory;			// truesize of the queued packets
+	u64 limit_drops;		// enqueue drops by memory_limit, packet_limit and the class limits
+	u32 quantum;			// DRR quantum of a flow queue in bytes
+
+	// classification, used if no filter selects a class, the maps are kept in struct dscd_class
+	struct tcf_proto __rcu *filter_list;
+	struct tcf_block *block;
 
 	// service queue
-	struct list_head service_q;
-	u64 service_len;			// length of ring buffer service_q
-
-	// credit counter
+	struct list_head service_q;	// list of service chunks
+	u64 service_len;			// number of entries in service_q
+	u64 service_runs;			// number of runs in service_q
+	struct list_head service_spare;	// unused service chunks
+	u64 service_spare_chunks;	// number of chunks in service_spare
+	u64 service_chunks;			// number of allocated service chunks, including spare chunks
+	u64 service_alloc_fails;	// service chunks, which could not be allocated
+
+	// credit counter of the service queue, the class credit is kept in struct dscd_class
 	u64 CC_cq;
-	u64 CC_abe;
-	u64 CC_be;
 
 	// credit devaluation state
 	u64 last_devaluation;
 	u64 last_exp_devaluation;
 
-	// bandwidth estimation state
+	// bandwidth estimation state, see dscd_estimate_rate()
+	u8 estimator;				// TC_DSCD_EST_*
+	u32 est_batch;				// packets per estimate update
+	u64 est_interval;			// ns between estimate updates, 0 = every est_batch packets
 	u64 S_b;
 	u64 S_t;
 	u64 last_rate_update;
 	u64 last_packet_size;
 	u64 last_packet_dequeue;
 	bool backlogged;
+	u64 rate_updates;
+
+	// rate sample collected since the last estimate update
+	u32 sample_pkts;
+	u64 sample_bytes;
+	u64 sample_time;			// ns the qdisc was backlogged
+	u64 sample_start;			// TC_DSCD_EST_BQL: ns, backlogged since
+	u32 sample_completed;		// TC_DSCD_EST_BQL: dql.num_completed at sample_start
+	u32 bql_queued;				// TC_DSCD_EST_BQL: dql.num_queued at the last rate update
+	u32 bql_idle_updates;		// TC_DSCD_EST_BQL: rate updates since dql.num_queued moved
+	bool bql_fallback;			// TC_DSCD_EST_BQL: no BQL support, TC_DSCD_EST_EWMA in use
+	struct minmax rate_max;		// TC_DSCD_EST_WINMAX: max sample rate within rate_memory
+
+	// lockless mode: enqueue only stages packets, dequeue moves them into the flows
+	bool lockless;
+	struct skb_array staging;
+	atomic64_t staging_drops;	// lockless enqueue drops, not yet in sch->qstats
+	seqcount_spinlock_t state_seq;	// the queue state changes under sch->seqlock, see dscd_dequeue()
+
+	// GSO packets are split into segments at enqueue
+	bool split_gso;
+
+	// ABE packets older than T_d are CE marked instead of dropped if they are ECT
+	bool ecn;
+
+	// amortized timekeeping, see dscd_now()
+	u64 time_granularity;		// ns, 0 = read the clock for every packet
+	u64 clock;					// ns, last clock read
+	u64 clock_coarse;			// ns, coarse clock at the last clock read
+
+	// packet returned by dscd_peek(), dequeued next if no packet is enqueued before
+	struct sk_buff *peek_skb;
+	u64 peek_time;
+
+	// state shared with the other TX queues of a dscd_mq root, NULL if not used
+	struct dscd_mq_shared *shared;
+	unsigned int shared_slot;
 
 	// stats
-	struct dscd_stats abe_stats;
-	struct dscd_stats be_stats;
-	struct dscd_stats all_stats;
+	struct dscd_pcpu_stats __percpu *stats;
+	struct dscd_stats_base *stats_base;	// under the qdisc lock
+	// DSCD_RATES per CPU counters by class index, see dscd_rate_counters(). Read by the
+	// rate estimators, not reset by dscd_reset(), estimators can't go backwards.
+	struct gnet_stats_basic_sync __percpu *rates;
 };
 
 // additional data for every packet
 struct dscd_skb_cb {
 	u64 q_time;
+	bool ce_marked;		// marked for exceeding T_d, must not count against T_d again
 };
 
 
@@ -97,12 +306,145 @@ static inline struct dscd_skb_cb *dscd_skb_cb(struct sk_buff *skb)
 	return (struct dscd_skb_cb *)qdisc_skb_cb(skb)->data;
 }
 
-// decide if packet is ABE
-static inline bool is_abe_packet(struct sk_buff *skb)
+// DSCP of an IPv4/IPv6 packet, 0 for other packets
+static inline u8 dscd_get_dscp(struct sk_buff *skb)
+{
+	unsigned int wlen = skb_network_offset(skb);
+
+	switch (skb_protocol(skb, true)) {
+	case htons(ETH_P_IP):
+		wlen += sizeof(struct iphdr);
+		if (!pskb_may_pull(skb, wlen))
+			return 0;
+		return ipv4_get_dsfield(ip_hdr(skb)) >> 2;
+
+	case htons(ETH_P_IPV6):
+		wlen += sizeof(struct ipv6hdr);
+		if (!pskb_may_pull(skb, wlen))
+			return 0;
+		return ipv6_get_dsfield(ipv6_hdr(skb)) >> 2;
+
+	default:
+		return 0;
+	}
+}
+
+// iterate over the ABE classes by increasing T_d, see dscd_update_order()
+#define for_each_abe_class(q, cls, i) \
+	for (i = 0; i < (q)->num_abe && ((cls) = &(q)->classes[(q)->abe_order[i]], true); i++)
+
+// iterate over all classes by index
+#define for_each_class(q, cls) \
+	for (cls = (q)->classes; cls < (q)->classes + (q)->num_classes; cls++)
+
+// select the class of a packet by the priority and DSCP maps of the ABE classes,
+// the priority maps are checked first, BE if no map matches
+// Lockless enqueuers run this concurrently to dscd_configure(), which publishes the maps
+// and the order with WRITE_ONCE(). During a change, a packet may still get the old class.
+static inline struct dscd_class *dscd_map_class(struct dscd_sched_data *q, struct sk_buff *skb)
 {
-	// TC_PRIO_INTERACTIVE corresponds to TOS Bits, 
+	u8 i, num_abe = READ_ONCE(q->num_abe);
+	struct dscd_class *cls;
+	int dscp = -1;
+	u64 map;
+
+	// by default only TC_PRIO_INTERACTIVE of the ABE class, which corresponds to TOS Bits,
 	// which set minimize delay but not maximize throughput
-	return skb->priority == TC_PRIO_INTERACTIVE;
+	if (skb->priority <= TC_PRIO_MAX) {
+		for (i = 0; i < num_abe; i++) {
+			cls = &q->classes[READ_ONCE(q->abe_order[i])];
+			if (READ_ONCE(cls->prio) & BIT(skb->priority))
+				return cls;
+		}
+	}
+
+	for (i = 0; i < num_abe; i++) {
+		cls = &q->classes[READ_ONCE(q->abe_order[i])];
+		map = READ_ONCE(cls->dscp);
+		if (!map)
+			continue;
+		if (dscp < 0)
+			dscp = dscd_get_dscp(skb);
+		if (map & BIT_ULL(dscp))
+			return cls;
+	}
+
+	return &q->classes[DSCD_BE];
+}
+
+// select the class of a packet: skb->priority naming a class of this qdisc,
+// then tc filters, then the priority and DSCP maps
+// returns NULL if the packet is dropped or consumed by a filter action
+static struct dscd_class *dscd_classify(struct sk_buff *skb, struct Qdisc *sch, int *qerr)
+{
+	struct dscd_sched_data *q = qdisc_priv(sch);
+	u32 classid = skb->priority;
+	struct tcf_result res;
+	struct tcf_proto *fl;
+	int result;
+
+	*qerr = NET_XMIT_SUCCESS | __NET_XMIT_BYPASS;
+
+	if (TC_H_MAJ(classid) != sch->handle) {
+		classid = 0;
+
+		fl = rcu_dereference_bh(q->filter_list);
+		result = fl ? tcf_classify(skb, NULL, fl, &res, false) : TC_ACT_UNSPEC;
+		if (result >= 0) {
+#ifdef CONFIG_NET_CLS_ACT
+			switch (result) {
+			case TC_ACT_STOLEN:
+			case TC_ACT_QUEUED:
+			case TC_ACT_TRAP:
+				*qerr = NET_XMIT_SUCCESS | __NET_XMIT_STOLEN;
+				fallthrough;
+			case TC_ACT_SHOT:
+				return NULL;
+			}
+#endif
+			classid = res.classid;
+		}
+	}
+
+	if (TC_H_MIN(classid) && TC_H_MIN(classid) <= q->num_classes)
+		return &q->classes[TC_H_MIN(classid) - 1];
+	return dscd_map_class(q, skb);
+}
+
+
+// bucket of the queueing delay histogram, see struct tc_dscd_delay_hist
+static inline unsigned int dscd_hist_bucket(u64 delay_ns)
+{
+	u64 v = delay_ns >> TC_DSCD_HIST_UNIT_SHIFT;
+	unsigned int msb, bucket;
+
+	if (v < (1 << TC_DSCD_HIST_SUB_BITS))
+		return v;
+
+	msb = fls64(v) - 1;
+	bucket = ((msb - TC_DSCD_HIST_SUB_BITS + 1) << TC_DSCD_HIST_SUB_BITS) +
+		 ((v >> (msb - TC_DSCD_HIST_SUB_BITS)) & ((1 << TC_DSCD_HIST_SUB_BITS) - 1));
+
+	return min_t(unsigned int, bucket, TC_DSCD_HIST_BUCKETS - 1);
+}
+
+
+// Current time for the DSCD state. With time_granularity, the clock is read at most
+// once per time_granularity, checked against the coarse clock, which costs no hardware
+// access. So the effective granularity is at least one timer tick.
+static inline u64 dscd_now(struct dscd_sched_data *q)
+{
+	u64 coarse;
+
+	if (!q->time_granularity)
+		return ktime_get_ns();
+
+	coarse = ktime_get_coarse_ns();
+	if (unlikely(coarse - q->clock_coarse >= q->time_granularity)) {
+		q->clock_coarse = coarse;
+		q->clock = ktime_get_ns();
+	}
+	return q->clock;
 }
 
 
@@ -134,658 +476,3366 @@ static inline void flow_enqueue(struct dscd_flow *flow,
 }
 
 
-/* ********** Credit Helpers ********** */
+/* ********** Class Helpers for dscd_class struct ********** */
 
-static inline u64 abe_credit_bytes(struct dscd_sched_data *q)
+static inline u32 class_minor(struct dscd_class *cls)
 {
-	// Use ABE_CREDIT_SHIFT to increase precision
-	return q->CC_abe >> ABE_CREDIT_SHIFT;
+	return cls->index + 1;
 }
 
-static inline u64 be_credit_bytes(struct dscd_sched_data *q)
-{
-	return q->CC_be;
-}
+// DRR invariant: a flow at the head of new_flows/old_flows is never empty and has a
+// positive deficit, so class_head() does not need to modify the class
 
-static inline u64 service_credit_bytes(struct dscd_sched_data *q)
+static inline struct dscd_fq_flow *class_head_flow(struct dscd_class *cls)
 {
-	return q->CC_cq;
+	if (!list_empty(&cls->new_flows))
+		return list_first_entry(&cls->new_flows, struct dscd_fq_flow, flowchain);
+	if (!list_empty(&cls->old_flows))
+		return list_first_entry(&cls->old_flows, struct dscd_fq_flow, flowchain);
+	return NULL;
 }
 
-static inline void incr_abe_credit(struct dscd_sched_data *q, u64 credit)
+// next packet of the class
+static inline struct sk_buff *class_head(struct dscd_class *cls)
 {
-	// Use ABE_CREDIT_SHIFT to increase precision
-	q->CC_abe += credit << ABE_CREDIT_SHIFT;
+	struct dscd_fq_flow *flow;
+
+	if (!cls->flows)
+		return cls->fifo.head;
+
+	flow = class_head_flow(cls);
+	return flow ? flow->q.head : NULL;
 }
 
-static inline void incr_be_credit(struct dscd_sched_data *q, u64 credit)
+// restore the DRR invariant like fq_codel_dequeue() does
+static void class_rotate(struct dscd_sched_data *q, struct dscd_class *cls)
 {
-	q->CC_be += credit;
+	struct dscd_fq_flow *flow;
+
+	while ((flow = class_head_flow(cls)) != NULL) {
+		if (flow->deficit <= 0) {
+			flow->deficit += q->quantum;
+			list_move_tail(&flow->flowchain, &cls->old_flows);
+		} else if (!flow->q.head) {
+			// an emptied new flow waits one round on old_flows before it is sparse again
+			if (!list_empty(&cls->new_flows) && !list_empty(&cls->old_flows))
+				list_move_tail(&flow->flowchain, &cls->old_flows);
+			else
+				list_del_init(&flow->flowchain);
+		} else {
+			break;
+		}
+	}
 }
 
-static inline void decr_abe_credit(struct dscd_sched_data *q, u64 credit)
+static inline struct sk_buff *class_dequeue(struct dscd_sched_data *q, struct dscd_class *cls)
 {
-	// Dont underflow
-	if (unlikely((credit + 1) << ABE_CREDIT_SHIFT > q->CC_abe))
-		q->CC_abe = 0;
-	else
-		q->CC_abe -= credit << ABE_CREDIT_SHIFT;
+	struct dscd_fq_flow *flow;
+	struct sk_buff *skb;
+
+	if (!cls->flows) {
+		skb = flow_dequeue(&cls->fifo);
+	} else {
+		flow = class_head_flow(cls);
+		skb = flow_dequeue(&flow->q);
+		flow->deficit -= qdisc_pkt_len(skb);
+		class_rotate(q, cls);
+	}
+
+	cls->len--;
+	cls->size -= qdisc_pkt_len(skb);
+	cls->truesize -= skb->truesize;
+	q->skb_memory -= skb->truesize;
+	return skb;
 }
 
-static inline void decr_be_credit(struct dscd_sched_data *q, u64 credit)
+static inline void class_enqueue(struct dscd_sched_data *q, struct dscd_class *cls,
+				  struct sk_buff *skb)
 {
-	q->CC_be -= credit;
+	struct dscd_fq_flow *flow;
+
+	if (!cls->flows) {
+		flow_enqueue(&cls->fifo, skb);
+	} else {
+		flow = &cls->flows[reciprocal_scale(skb_get_hash(skb), q->flows_cnt)];
+		flow_enqueue(&flow->q, skb);
+
+		// a new flow at the head of new_flows has a positive deficit, the invariant holds
+		if (list_empty(&flow->flowchain)) {
+			list_add_tail(&flow->flowchain, &cls->new_flows);
+			flow->deficit = q->quantum;
+		}
+	}
+
+	cls->len++;
+	cls->size += qdisc_pkt_len(skb);
+	cls->truesize += skb->truesize;
+	q->skb_memory += skb->truesize;
 }
 
 
-/* ********** Service Queue Helpers ********** */
+/* ********** Credit Helpers ********** */
 
-static void service_element_free(struct service_element *e)
+// ABE credit decays and is kept << ABE_CREDIT_SHIFT, BE credit is exact
+
+static inline u64 class_credit_bytes(struct dscd_class *cls)
 {
-	kvfree(e);
+	// Use ABE_CREDIT_SHIFT to increase precision
+	return cls->abe ? cls->CC >> ABE_CREDIT_SHIFT : cls->CC;
 }
 
-// create new service element
-static inline struct service_element *service_element_new(struct dscd_sched_data *q, int len, bool is_abe)
+static inline u64 service_credit_bytes(struct dscd_sched_data *q)
 {
-	struct service_element *service_element = kzalloc(sizeof(struct service_element), GFP_ATOMIC);
-	if (unlikely(!service_element))
-		goto end;
+	return q->CC_cq;
+}
 
-	service_element->pkt_len = len;
-	service_element->is_abe = is_abe;
+// credit of the service queue and all classes, limited by B_max
+static inline u64 dscd_credit_bytes(struct dscd_sched_data *q)
+{
+	struct dscd_class *cls;
+	u64 credit = service_credit_bytes(q);
 
-	INIT_LIST_HEAD(&service_element->servicechain);
-	list_add_tail(&service_element->servicechain, &q->service_q);
+	for_each_class(q, cls)
+		credit += class_credit_bytes(cls);
+	return credit;
+}
 
-	q->service_len++;
-	q->CC_cq += len;
-end:
-	return service_element;
+static inline void incr_class_credit(struct dscd_class *cls, u64 credit)
+{
+	cls->CC += cls->abe ? credit << ABE_CREDIT_SHIFT : credit;
 }
 
-// get next service element
-static inline struct service_element *service_element_next(struct dscd_sched_data *q)
+static inline void decr_class_credit(struct dscd_class *cls, u64 credit)
 {
-	struct service_element *service_element = list_first_entry(&q->service_q, struct service_element, servicechain);
-	__list_del_entry(&service_element->servicechain);
+	if (!cls->abe)
+		cls->CC -= credit;
+	// Dont underflow
+	else if (unlikely((credit + 1) << ABE_CREDIT_SHIFT > cls->CC))
+		cls->CC = 0;
+	else
+		cls->CC -= credit << ABE_CREDIT_SHIFT;
+}
 
-	q->service_len--;
-	q->CC_cq -= service_element->pkt_len;
+// true if no class has queued packets
+static inline bool dscd_classes_empty(struct dscd_sched_data *q)
+{
+	struct dscd_class *cls;
 
-	return service_element;
+	for_each_class(q, cls)
+		if (cls->len)
+			return false;
+	return true;
 }
 
-// Drop all service elements
-static inline void empty_service_queue(struct dscd_sched_data *q)
-{
-	u64 tmp;
-	struct service_element *service_element = NULL, *service_next = NULL;
 
-	tmp = q->CC_abe;
-	list_for_each_entry_safe(service_element, service_next, &q->service_q, servicechain) {
-		__list_del_entry(&service_element->servicechain);
+/* ********** Service Queue Helpers ********** */
+
+// The service queue stores one entry per enqueued packet. Consecutive entries
+// of the same class and length are merged into a run, runs are kept in
+// chunks, which form a FIFO.
+
+static inline struct service_chunk *service_chunk_new(struct dscd_sched_data *q)
+{
+	struct service_chunk *chunk;
 
-		if (service_element->is_abe)
-			incr_abe_credit(q, service_element->pkt_len);
-		else
-			incr_be_credit(q, service_element->pkt_len);
+	if (!list_empty(&q->service_spare)) {
+		chunk = list_first_entry(&q->service_spare, struct service_chunk, chunkchain);
+		list_move_tail(&chunk->chunkchain, &q->service_q);
+		q->service_spare_chunks--;
+	} else {
+		chunk = kmem_cache_alloc(dscd_service_cache, GFP_ATOMIC | __GFP_NOWARN);
+		if (unlikely(!chunk)) {
+			q->service_alloc_fails++;
+			return NULL;
+		}
 
-		service_element_free(service_element);
+		list_add_tail(&chunk->chunkchain, &q->service_q);
+		q->service_chunks++;
 	}
 
-	q->service_len = 0;
-	q->CC_cq = 0;
+	chunk->head = 0;
+	chunk->tail = 0;
+
+	return chunk;
 }
 
+static inline void service_chunk_free(struct dscd_sched_data *q, struct service_chunk *chunk)
+{
+	list_del(&chunk->chunkchain);
+	kmem_cache_free(dscd_service_cache, chunk);
+	q->service_chunks--;
+}
 
-/* ********** Devaluate Credit ********** */
+// free the spare chunks above SERVICE_SPARE_CHUNKS
+static inline void service_spare_trim(struct dscd_sched_data *q)
+{
+	while (unlikely(q->service_spare_chunks > SERVICE_SPARE_CHUNKS)) {
+		service_chunk_free(q, list_first_entry(&q->service_spare, struct service_chunk, chunkchain));
+		q->service_spare_chunks--;
+	}
+}
 
-// calculate  n * 2^(-y / 2^s) for s >= 12
-static u64 n_pow2(u64 n, u64 y, u64 s)
+// move a drained chunk of service_q to the spare chunks
+static inline void service_chunk_release(struct dscd_sched_data *q, struct service_chunk *chunk)
 {
-	// z ~= 0.44 ~= 4096/9219
-	if (y * 9219 <= (u64)1 << (s + 12)) {
-		return n - (n * y >> (s - 12)) / 5909;
+	if (q->service_spare_chunks < SERVICE_SPARE_CHUNKS) {
+		list_move(&chunk->chunkchain, &q->service_spare);
+		q->service_spare_chunks++;
 	} else {
-		u64 y_unscaled = y >> s;
-
-		if (y_unscaled >= 20)
-		    return 0;
-
-		return 	(
-					n * (2 + y_unscaled) - ((n * y) >> s)
-				) / (
-					(u64)1 << (1 + y_unscaled)
-				);
+		service_chunk_free(q, chunk);
 	}
 }
 
-// exponential decay part of DevaluateCredit
-static inline void exp_decay(struct dscd_sched_data *q, u64 now)
+// append service entry, returns false if no chunk could be allocated
+static inline bool service_enqueue(struct dscd_sched_data *q, u32 len, struct dscd_class *cls)
 {
-	u64 diff, old_abe_credit, y;
-	if (unlikely(q->last_exp_devaluation == 0)) {
-		q->last_exp_devaluation = now;
-		return;
+	struct service_chunk *chunk = NULL;
+	struct service_run *run;
+
+	if (likely(!list_empty(&q->service_q))) {
+		chunk = list_last_entry(&q->service_q, struct service_chunk, chunkchain);
+
+		if (chunk->tail > chunk->head) {
+			run = &chunk->runs[chunk->tail - 1];
+
+			if (run->pkt_len == len && run->cls == cls->index &&
+				likely(run->count < SERVICE_RUN_MAX_COUNT)) {
+				run->count++;
+				goto end;
+			}
+		}
 	}
 
-	diff = now - q->last_exp_devaluation;
-	old_abe_credit = q->CC_abe;
-	// y = diff / credit_half_life * 2^20
-	// s = 20
-	y = (diff << 20) / q->credit_half_life;
+	if (unlikely(!chunk || chunk->tail == SERVICE_CHUNK_RUNS)) {
+		chunk = service_chunk_new(q);
+		if (unlikely(!chunk))
+			return false;
+	}
 
-	q->CC_abe = n_pow2(q->CC_abe, y, 20);
+	run = &chunk->runs[chunk->tail++];
+	run->pkt_len = len;
+	run->count = 1;
+	run->cls = cls->index;
+	q->service_runs++;
 
-	// If credit is existent, but didn't change, then dont modify
-	// last_exp_devaluation until it does
-	if (likely(q->CC_abe == 0 || old_abe_credit != q->CC_abe))
-		q->last_exp_devaluation = now;
+end:
+	q->service_len++;
+	q->CC_cq += len;
+	cls->service_bytes += len;
+	return true;
 }
 
-// linear decay part of DevaluateCredit
-static inline void lin_decay(struct dscd_sched_data *q, u64 now)
+// credit bytes missing to send the head packet of a class, U64_MAX if the class is empty
+static inline u64 class_need(struct dscd_class *cls, u64 credit)
 {
-	decr_abe_credit(q, (now - q->last_devaluation) * q->C / NSEC_PER_SEC);
+	struct sk_buff *head = class_head(cls);
+
+	if (!head)
+		return U64_MAX;
+	return qdisc_pkt_len(head) - min_t(u64, credit, qdisc_pkt_len(head));
 }
 
-static inline void devaluate_credit(struct dscd_sched_data *q, u64 now)
+// Move the credit of service entries at the head of the service queue to
+// their class. Entries of the head run are transferred in one step, stopping
+// at the first entry after which the class has enough credit for its head
+// packet. This is equivalent to transferring one entry at a time.
+// Service queue must not be empty.
+static inline void service_transfer(struct Qdisc *sch, struct dscd_sched_data *q)
 {
-	if (unlikely(!q->be_flow.head && !q->abe_flow.head)) {
-		empty_service_queue(q);
-		if (likely(q->last_devaluation != 0)) {
-			lin_decay(q, now);
+	struct service_chunk *chunk = list_first_entry(&q->service_q, struct service_chunk, chunkchain);
+	struct service_run *run = &chunk->runs[chunk->head];
+	struct dscd_class *cls = &q->classes[run->cls];
+	u64 need = class_need(cls, class_credit_bytes(cls));
+	u32 len = run->pkt_len;
+	u32 count = run->count;
+	u64 bytes;
+
+	if (need != U64_MAX && likely(len != 0))
+		count = min_t(u64, count, div_u64(need + len - 1, len));
+
+	bytes = (u64)len * count;
+	incr_class_credit(cls, bytes);
+	cls->service_bytes -= bytes;
+
+	run->count -= count;
+	if (run->count == 0) {
+		q->service_runs--;
+
+		if (++chunk->head == chunk->tail) {
+			// keep the last chunk, so a steady flow doesn't allocate per run
+			if (list_is_singular(&q->service_q)) {
+				chunk->head = 0;
+				chunk->tail = 0;
+			} else {
+				service_chunk_release(q, chunk);
+			}
 		}
-	} else {
-		exp_decay(q, now);
 	}
-	q->last_devaluation = now;
-}
 
+	q->service_len -= count;
+	q->CC_cq -= bytes;
 
-/* ********** Helper Macros ********** */
-
-// increment field in dscd_stats struct
-#define DSCD_STAT_INC(field, is_abe) do { \
-			if (is_abe) { \
-				q->abe_stats.field++; \
-			} else { \
-				q->be_stats.field++; \
-			} \
-			q->all_stats.field++; \
-		} while (0)
+	trace_dscd_credit_transfer(sch, class_minor(cls), count, bytes, class_credit_bytes(cls),
+				   service_credit_bytes(q));
+}
 
+// Take back the credit of a packet pushed out of its class, first from the
+// class credit, then from the oldest service entries of the class. Entries of
+// the other class keep their position. Emptied runs stay in place until
+// service_transfer() reaches them.
+static void service_revoke(struct dscd_sched_data *q, struct dscd_class *cls, u64 len)
+{
+	u64 credit = class_credit_bytes(cls);
+	struct service_chunk *chunk;
+	struct service_run *run;
+	u32 count;
+	u64 bytes;
+	u16 i;
+
+	list_for_each_entry(chunk, &q->service_q, chunkchain) {
+		for (i = chunk->head; i < chunk->tail && credit < len; i++) {
+			run = &chunk->runs[i];
+			if (run->cls != cls->index || run->count == 0)
+				continue;
+
+			count = run->count;
+			if (likely(run->pkt_len != 0))
+				count = min_t(u64, count, div_u64(len - credit + run->pkt_len - 1, run->pkt_len));
+
+			bytes = (u64)run->pkt_len * count;
+			run->count -= count;
+			q->service_len -= count;
+			q->CC_cq -= bytes;
+			cls->service_bytes -= bytes;
+			incr_class_credit(cls, bytes);
+			credit += bytes;
+		}
+		if (credit >= len)
+			break;
+	}
 
-/* ********** Enqueue ********** */
+	decr_class_credit(cls, min(len, class_credit_bytes(cls)));
+}
 
-static int dscd_enqueue(struct sk_buff *skb, struct Qdisc *sch,
-			 struct sk_buff **to_free)
+// free all service chunks, without credit accounting
+static void service_queue_purge(struct dscd_sched_data *q)
 {
-	bool is_abe = is_abe_packet(skb);
-	struct dscd_sched_data *q = qdisc_priv(sch);
-	struct dscd_skb_cb *cb = dscd_skb_cb(skb);
-	unsigned int pkt_skb_len = qdisc_pkt_len(skb);
-	struct service_element *service_element;
-	u64 now = ktime_get_ns();
+	struct service_chunk *chunk, *chunk_next;
+	struct dscd_class *cls;
 
+	list_for_each_entry_safe(chunk, chunk_next, &q->service_q, chunkchain)
+		service_chunk_free(q, chunk);
+	list_for_each_entry_safe(chunk, chunk_next, &q->service_spare, chunkchain)
+		service_chunk_free(q, chunk);
 
-	devaluate_credit(q, now);
+	q->service_len = 0;
+	q->service_runs = 0;
+	q->service_spare_chunks = 0;
+	q->CC_cq = 0;
+	for_each_class(q, cls)
+		cls->service_bytes = 0;
+}
 
+// Drop all service entries, the per-class totals are credited at
+// once and the chunks are handed to the spare list. Only the chunks above
+// SERVICE_SPARE_CHUNKS, which a burst left behind, are freed one by one.
+static inline void empty_service_queue(struct dscd_sched_data *q)
+{
+	struct dscd_class *cls;
 
-	if (unlikely(pkt_skb_len + service_credit_bytes(q) + abe_credit_bytes(q) + be_credit_bytes(q) > sch->limit)) {
-		goto drop;
+	if (likely(q->service_len == 0))
+		return;
+
+	for_each_class(q, cls) {
+		incr_class_credit(cls, cls->service_bytes);
+		cls->service_bytes = 0;
 	}
 
+	list_splice_init(&q->service_q, &q->service_spare);
+	q->service_spare_chunks = q->service_chunks;
+	service_spare_trim(q);
 
-	service_element = service_element_new(q, pkt_skb_len, is_abe);
-	if (unlikely(!service_element)) {
-		printk(KERN_WARNING "Service Element could not be allocated");
-		goto drop;
-	}
+	q->service_len = 0;
+	q->service_runs = 0;
+	q->CC_cq = 0;
+}
 
-	cb->q_time = now;
-	flow_enqueue(is_abe ? &q->abe_flow : &q->be_flow, skb);
 
-	// Adjust general Qdisc stats
-	sch->qstats.backlog += pkt_skb_len;
-	sch->q.qlen++;
+/* ********** Multiqueue Helpers ********** */
+
+// rate estimate of one TX queue instance, written only by its owner
+struct dscd_mq_slot {
+	struct dscd_sched_data *owner;	// instance of the TX queue, changed under RTNL
+	struct u64_stats_sync syncp;
+	u64_stats_t S_b;
+	u64_stats_t S_t;
+	u64_stats_t updated;		// ns, time of the last rate update
+} ____cacheline_aligned_in_smp;
+
+// state shared by the DSCD instances below one dscd_mq root,
+// freed when the root and all of its DSCD instances are gone
+struct dscd_mq_shared {
+	refcount_t refcnt;
+	unsigned int real_num_tx;	// active TX queues, which split a configured rate
+	unsigned int num_slots;
+	struct dscd_mq_slot slots[];
+};
 
-	// Adjust DSCD stats
-	DSCD_STAT_INC(received_pkts, is_abe);
+static struct dscd_mq_shared *dscd_mq_shared_new(unsigned int num_slots, unsigned int real_num_tx)
+{
+	struct dscd_mq_shared *shared = kzalloc(struct_size(shared, slots, num_slots), GFP_KERNEL);
+	unsigned int i;
 
-	return NET_XMIT_SUCCESS;
+	if (!shared)
+		return NULL;
 
-drop:
-	DSCD_STAT_INC(enqueue_drops, is_abe);
-	return qdisc_drop(skb, sch, to_free);
+	refcount_set(&shared->refcnt, 1);
+	shared->real_num_tx = real_num_tx;
+	shared->num_slots = num_slots;
+	for (i = 0; i < num_slots; i++)
+		u64_stats_init(&shared->slots[i].syncp);
+	return shared;
 }
 
+static void dscd_mq_shared_put(struct dscd_mq_shared *shared)
+{
+	if (refcount_dec_and_test(&shared->refcnt))
+		kfree(shared);
+}
 
-/* ********** Dequeue + Helper ********** */
-
-// get enqueue time of packet, which is located at the head of the ABE queue
-static inline u64 abe_head_q_time(struct dscd_sched_data *q)
+// configured rate of this instance, a dscd_mq instance gets its share of the link rate
+static inline u64 dscd_configured_rate(struct dscd_sched_data *q)
 {
-	return dscd_skb_cb(q->abe_flow.head)->q_time;
+	if (q->shared)
+		return div_u64(q->rate_config, max(READ_ONCE(q->shared->real_num_tx), 1U));
+	return q->rate_config;
 }
 
-static struct sk_buff *dscd_dequeue(struct Qdisc *sch)
+// current rate in B/s, the estimate is only valid after the first rate update
+static inline u64 dscd_rate(struct dscd_sched_data *q)
 {
-	struct dscd_sched_data *q = qdisc_priv(sch);
-	struct sk_buff *abe_head_skb = NULL, *skb = NULL;
-	struct service_element *service_element = NULL;
-	bool skb_is_abe;
-	unsigned int pkt_skb_len;
-	struct dscd_skb_cb *skb_cb;
-	u64 q_delay;
-	u64 now = ktime_get_ns();
+	if (q->rate_config == 0 && q->S_t != 0)
+		return div64_u64(q->S_b * NSEC_PER_SEC, q->S_t);
+	return q->C;
+}
 
+static inline void dscd_set_rate(struct dscd_sched_data *q, u64 C)
+{
+	q->C = C;
+	q->C_ns = mul_u64_u64_div_u64(C, 1ULL << RATE_NS_SHIFT, NSEC_PER_SEC);
+	q->C_ns_expires = 0;
+	q->ns_per_byte = C ? div64_u64(NSEC_PER_SEC << RATE_NS_SHIFT, C) : 0;
+}
 
-	devaluate_credit(q, now);
+// publish the rate estimate of this instance to the other TX queues
+static inline void dscd_mq_publish(struct dscd_sched_data *q)
+{
+	struct dscd_mq_slot *slot = &q->shared->slots[q->shared_slot];
 
+	// a grafted out instance must not overwrite the estimate of its successor
+	if (READ_ONCE(slot->owner) != q)
+		return;
 
-	// Drop packets, that have been waiting longer than T_d
-	while (q->abe_flow.len > q->T_q && abe_head_q_time(q) + q->T_d < now)
-	{
-		abe_head_skb = flow_dequeue(&q->abe_flow);
-		pkt_skb_len = qdisc_pkt_len(abe_head_skb);
+	u64_stats_update_begin(&slot->syncp);
+	u64_stats_set(&slot->S_b, q->S_b);
+	u64_stats_set(&slot->S_t, q->S_t);
+	u64_stats_set(&slot->updated, q->last_rate_update);
+	u64_stats_update_end(&slot->syncp);
+}
 
-		DSCD_STAT_INC(dequeue_drops, true);
-		qdisc_tree_reduce_backlog(sch, 1, pkt_skb_len);
-		qdisc_qstats_drop(sch);
-		sch->qstats.backlog -= pkt_skb_len;
-		sch->q.qlen--;
-		kfree_skb(abe_head_skb);
+// Rate of a dscd_mq instance without configured rate, B/s. The TX queues share the link,
+// so the link rate is the sum of the estimates of the queues updated within rate_memory.
+// This instance gets an even share with the other busy queues. Without recent estimates,
+// the last estimate of this instance is used.
+static u64 dscd_mq_rate(struct dscd_sched_data *q, u64 now)
+{
+	struct dscd_mq_shared *shared = q->shared;
+	u64 S_b, S_t, updated, rate = 0;
+	struct dscd_mq_slot *slot;
+	unsigned int i, start, busy = 0;
+	bool recent = false;
+
+	for (i = 0; i < shared->num_slots; i++) {
+		slot = &shared->slots[i];
+		do {
+			start = u64_stats_fetch_begin(&slot->syncp);
+			S_b = u64_stats_read(&slot->S_b);
+			S_t = u64_stats_read(&slot->S_t);
+			updated = u64_stats_read(&slot->updated);
+		} while (u64_stats_fetch_retry(&slot->syncp, start));
+
+		if (!S_t || updated + q->rate_memory < now)
+			continue;
+
+		rate += div64_u64(S_b * NSEC_PER_SEC, S_t);
+		recent = true;
+		if (i != q->shared_slot)
+			busy++;
 	}
 
+	if (!recent)
+		return dscd_rate(q);
+	// this instance takes its share once it is busy again
+	return div_u64(rate, busy + 1);
+}
 
-	// Determine next packet
-	if (likely(q->be_flow.head || q->abe_flow.head))
-	{
-		while (skb == NULL)
-		{
-			if (q->abe_flow.head && abe_credit_bytes(q) >= qdisc_pkt_len(q->abe_flow.head))
-			{
-				skb = flow_dequeue(&q->abe_flow);
-				skb_cb = dscd_skb_cb(skb);
-				skb_is_abe = true;
-
-				decr_abe_credit(q, qdisc_pkt_len(skb));
-			}
-			else if (q->be_flow.head && be_credit_bytes(q) >= qdisc_pkt_len(q->be_flow.head))
-			{
-				skb = flow_dequeue(&q->be_flow);
-				skb_cb = dscd_skb_cb(skb);
-				skb_is_abe = false;
-
-				decr_be_credit(q, qdisc_pkt_len(skb));
-			}
-			else
-			{
-				service_element = service_element_next(q);
-
-				if (service_element->is_abe) {
-					incr_abe_credit(q, service_element->pkt_len);
-				} else {
-					incr_be_credit(q, service_element->pkt_len);
-				}
+// rate of the linear credit decay without configured rate, B/s
+static inline u64 dscd_auto_rate(struct dscd_sched_data *q, u64 now)
+{
+	if (q->shared)
+		return dscd_mq_rate(q, now);
+	return dscd_rate(q);
+}
 
-				service_element_free(service_element);
-				service_element = NULL;
-			}
-		}
+static void dscd_mq_detach(struct dscd_sched_data *q)
+{
+	struct dscd_mq_slot *slot = &q->shared->slots[q->shared_slot];
+
+	// the slot may already belong to the instance, that replaced this one
+	if (slot->owner == q) {
+		WRITE_ONCE(slot->owner, NULL);
+		u64_stats_update_begin(&slot->syncp);
+		u64_stats_set(&slot->S_t, 0);
+		u64_stats_update_end(&slot->syncp);
 	}
 
+	dscd_mq_shared_put(q->shared);
+	q->shared = NULL;
+}
 
-	// Return if no packet can be dequeued
-	if (unlikely(!skb))
-		return NULL;
+static void dscd_mq_attach_instance(struct Qdisc *sch, struct dscd_mq_shared *shared, unsigned int slot)
+{
+	struct dscd_sched_data *q = qdisc_priv(sch);
 
+	sch_tree_lock(sch);
 
-	// Estimate rate
-	if (q->rate_config == 0) {
-		if (q->backlogged) {
-			u64 diff_rate_update = now - q->last_rate_update;
-			u64 diff_dequeue = now - q->last_packet_dequeue;
+	if (q->shared)
+		dscd_mq_detach(q);
 
-			// y = diff / memory / ln(2) * 2^20
-			// s = 20
-			u64 y = (diff_rate_update * 5909 << 8) / q->rate_memory;
+	refcount_inc(&shared->refcnt);
+	q->shared = shared;
+	q->shared_slot = slot;
+	WRITE_ONCE(shared->slots[slot].owner, q);
 
-			q->S_b = n_pow2(q->S_b, y, 20) + q->last_packet_size;
-			q->S_t = n_pow2(q->S_t, y, 20) + diff_dequeue;
-			q->C = (q->S_b * NSEC_PER_SEC) / q->S_t;
+	if (q->rate_config != 0)
+		dscd_set_rate(q, dscd_configured_rate(q));
 
-			q->last_rate_update = now;
-		}
-		q->last_packet_dequeue = now;
-		 // "> 1" instead of "> 0", because sch->q.qlen isn't decremented yet
-		q->backlogged = sch->q.qlen > 1;
-		q->last_packet_size = qdisc_pkt_len(skb);
-	}
+	dscd_mq_publish(q);
 
+	sch_tree_unlock(sch);
+}
 
-	// Adjust general QDisc Stats
-	qdisc_qstats_backlog_dec(sch, skb);
-	qdisc_bstats_update(sch, skb);
-	sch->q.qlen--;
 
+/* ********** Devaluate Credit ********** */
 
-	// Adjust DSCD Stats
-	DSCD_STAT_INC(sent_pkts, skb_is_abe);
-	q_delay = ktime_get_ns() - skb_cb->q_time;
-	(skb_is_abe ? &q->abe_stats : &q->be_stats)->sum_delay_ns += q_delay;
-	q->all_stats.sum_delay_ns += q_delay;
+#define EXP2_TAB_BITS	8
+#define EXP2_TAB_SHIFT	31
+
+// 2^(-i / 2^EXP2_TAB_BITS) in Q31 for i = 0 .. 2^EXP2_TAB_BITS - 1 in the upper 32 bits,
+// the difference to the next entry in the lower 32 bits, so one load serves the interpolation
+static const u64 exp2_tab[1 << EXP2_TAB_BITS] = {
+	0x8000000000589a53ULL, 0x7fa765ad00585cffULL, 0x7f4f08ae00581fd4ULL, 0x7ef6e8da0057e2d4ULL,
+	0x7e9f06060057a5fdULL, 0x7e47600900576953ULL, 0x7deff6b600572cd0ULL, 0x7d98c9e60056f078ULL,
+	0x7d41d96e0056b44bULL, 0x7ceb252300567845ULL, 0x7c94acde00563c6bULL, 0x7c3e7073005600b9ULL,
+	0x7be86fba0055c532ULL, 0x7b92aa88005589d2ULL, 0x7b3d20b600554e9cULL, 0x7ae7d21a0055138fULL,
+	0x7a92be8b0054d8acULL, 0x7a3de5df00549df0ULL, 0x79e947ef0054635dULL, 0x7994e492005428f4ULL,
+	0x7940bb9e0053eeb2ULL, 0x78ecccec0053b498ULL, 0x7899185400537aa8ULL, 0x78459dac005340deULL,
+	0x77f25cce0053073eULL, 0x779f55900052cdc4ULL, 0x774c87cc00529473ULL, 0x76f9f35900525b4aULL,
+	0x76a7980f00522247ULL, 0x765575c80051e96dULL, 0x76038c5b0051b0b9ULL, 0x75b1dba20051782eULL,
+	0x7560637400513fc9ULL, 0x750f23ab0051078bULL, 0x74be1c200050cf74ULL, 0x746d4cac00509784ULL,
+	0x741cb52800505fbbULL, 0x73cc556d00502818ULL, 0x737c2d55004ff09bULL, 0x732c3cba004fb946ULL,
+	0x72dc8374004f8217ULL, 0x728d015d004f4b0dULL, 0x723db650004f142aULL, 0x71eea226004edd6dULL,
+	0x719fc4b9004ea6d5ULL, 0x71511de4004e7064ULL, 0x7102ad80004e3a18ULL, 0x70b47368004e03f2ULL,
+	0x70666f76004dcdf1ULL, 0x7018a185004d9816ULL, 0x6fcb096f004d625fULL, 0x6f7da710004d2ccfULL,
+	0x6f307a41004cf763ULL, 0x6ee382de004cc21bULL, 0x6e96c0c3004c8cfaULL, 0x6e4a33c9004c57fdULL,
+	0x6dfddbcc004c2324ULL, 0x6db1b8a8004bee70ULL, 0x6d65ca38004bb9e1ULL, 0x6d1a1057004b8576ULL,
+	0x6cce8ae1004b512fULL, 0x6c8339b2004b1d0cULL, 0x6c381ca6004ae90dULL, 0x6bed3399004ab534ULL,
+	0x6ba27e65004a817cULL, 0x6b57fce9004a4deaULL, 0x6b0daeff004a1a7aULL, 0x6ac394850049e72fULL,
+	0x6a79ad560049b407ULL, 0x6a2ff94f00498102ULL, 0x69e6784d00494e21ULL, 0x699d2a2c00491b63ULL,
+	0x69540ec90048e8c8ULL, 0x690b26010048b650ULL, 0x68c26fb1004883fbULL, 0x6879ebb6004851c9ULL,
+	0x683199ed00481fb9ULL, 0x67e97a340047edccULL, 0x67a18c680047bc03ULL, 0x6759d06500478a5aULL,
+	0x6712460b004758d6ULL, 0x66caed3500472772ULL, 0x6683c5c30046f631ULL, 0x663ccf920046c513ULL,
+	0x65f60a7f00469415ULL, 0x65af766a0046633bULL, 0x6569132f00463282ULL, 0x6522e0ad004601eaULL,
+	0x64dcdec30045d174ULL, 0x64970d4f0045a121ULL, 0x64516c2e004570edULL, 0x640bfb41004540ddULL,
+	0x63c6ba64004510ecULL, 0x6381a9780044e11dULL, 0x633cc85b0044b170ULL, 0x62f816eb004481e2ULL,
+	0x62b3950900445277ULL, 0x626f42920044232cULL, 0x622b1f660043f401ULL, 0x61e72b650043c4f8ULL,
+	0x61a3666d0043960fULL, 0x615fd05e00436745ULL, 0x611c69190043389eULL, 0x60d9307b00430a16ULL,
+	0x609626650042dbaeULL, 0x60534ab70042ad66ULL, 0x60109d5100427f3fULL, 0x5fce1e1200425137ULL,
+	0x5f8bccdb0042234fULL, 0x5f49a98c0041f587ULL, 0x5f07b4050041c7dfULL, 0x5ec5ec2600419a56ULL,
+	0x5e8451d000416cedULL, 0x5e42e4e300413fa4ULL, 0x5e01a53f00411278ULL, 0x5dc092c70040e56eULL,
+	0x5d7fad590040b882ULL, 0x5d3ef4d700408bb4ULL, 0x5cfe692300405f07ULL, 0x5cbe0a1c00403278ULL,
+	0x5c7dd7a400400608ULL, 0x5c3dd19c003fd9b7ULL, 0x5bfdf7e5003fad84ULL, 0x5bbe4a61003f816fULL,
+	0x5b7ec8f2003f557bULL, 0x5b3f7377003f29a3ULL, 0x5b0049d4003efdeaULL, 0x5ac14bea003ed250ULL,
+	0x5a82799a003ea6d4ULL, 0x5a43d2c6003e7b75ULL, 0x5a055751003e5035ULL, 0x59c7071c003e2513ULL,
+	0x5988e209003dfa0eULL, 0x594ae7fb003dcf28ULL, 0x590d18d3003da45fULL, 0x58cf7474003d79b3ULL,
+	0x5891fac1003d4f26ULL, 0x5854ab9b003d24b5ULL, 0x581786e6003cfa63ULL, 0x57da8c83003cd02cULL,
+	0x579dbc57003ca615ULL, 0x57611642003c7c19ULL, 0x57249a29003c523aULL, 0x56e847ef003c287aULL,
+	0x56ac1f75003bfed5ULL, 0x567020a0003bd54eULL, 0x56344b52003babe2ULL, 0x55f89f70003b8295ULL,
+	0x55bd1cdb003b5963ULL, 0x5581c378003b304fULL, 0x55469329003b0755ULL, 0x550b8bd4003ade7aULL,
+	0x54d0ad5a003ab5b9ULL, 0x5495f7a1003a8d16ULL, 0x545b6a8b003a648eULL, 0x542105fd003a3c23ULL,
+	0x53e6c9da003a13d3ULL, 0x53acb6070039eb9fULL, 0x5372ca680039c388ULL, 0x533906e000399b8bULL,
+	0x52ff6b55003973abULL, 0x52c5f7aa00394be7ULL, 0x528cabc30039243dULL, 0x525387860038fcafULL,
+	0x521a8ad70038d53dULL, 0x51e1b59a0038ade6ULL, 0x51a907b4003886a9ULL, 0x5170810b00385f89ULL,
+	0x5138218200383884ULL, 0x50ffe8fe00381199ULL, 0x50c7d7650037eac9ULL, 0x508fec9c0037c414ULL,
+	0x5058288800379d7aULL, 0x50208b0e003776fbULL, 0x4fe9141300375097ULL, 0x4fb1c37c00372a4cULL,
+	0x4f7a99300037041cULL, 0x4f4395140036de08ULL, 0x4f0cb70c0036b80cULL, 0x4ed5ff000036922cULL,
+	0x4e9f6cd400366c66ULL, 0x4e69006e003646baULL, 0x4e32b9b400362128ULL, 0x4dfc988c0035fbafULL,
+	0x4dc69cdd0035d652ULL, 0x4d90c68b0035b10dULL, 0x4d5b157e00358be2ULL, 0x4d25899c003566d2ULL,
+	0x4cf022ca003541dbULL, 0x4cbae0ef00351cfeULL, 0x4c85c3f10034f839ULL, 0x4c50cbb80034d38fULL,
+	0x4c1bf8290034aefeULL, 0x4be7492b00348a86ULL, 0x4bb2bea500346627ULL, 0x4b7e587e003441e2ULL,
+	0x4b4a169c00341db6ULL, 0x4b15f8e60033f9a3ULL, 0x4ae1ff430033d5a8ULL, 0x4aae299b0033b1c7ULL,
+	0x4a7a77d400338dfeULL, 0x4a46e9d600336a4eULL, 0x4a137f88003346b8ULL, 0x49e038d000332338ULL,
+	0x49ad15980032ffd4ULL, 0x497a15c40032dc85ULL, 0x4947393f0032b951ULL, 0x49147fee00329634ULL,
+	0x48e1e9ba00327330ULL, 0x48af768a00325044ULL, 0x487d264600322d70ULL, 0x484af8d600320ab4ULL,
+	0x4818ee220031e811ULL, 0x47e706110031c585ULL, 0x47b5408c0031a311ULL, 0x47839d7b003180b5ULL,
+	0x47521cc600315e71ULL, 0x4720be5500313c45ULL, 0x46ef821000311a30ULL, 0x46be67e00030f832ULL,
+	0x468d6fae0030d64dULL, 0x465c99610030b47fULL, 0x462be4e2003092c8ULL, 0x45fb521a00307128ULL,
+	0x45cae0f200304fa0ULL, 0x459a915200302e2fULL, 0x456a632300300cd6ULL, 0x453a564d002feb92ULL,
+	0x450a6abb002fca67ULL, 0x44daa054002fa952ULL, 0x44aaf702002f8855ULL, 0x447b6ead002f676dULL,
+	0x444c0740002f469dULL, 0x441cc0a3002f25e3ULL, 0x43ed9ac0002f0541ULL, 0x43be957f002ee4b4ULL,
+	0x438fb0cb002ec43eULL, 0x4360ec8d002ea3dfULL, 0x433248ae002e8396ULL, 0x4303c518002e6364ULL,
+	0x42d561b4002e4348ULL, 0x42a71e6c002e2341ULL, 0x4278fb2b002e0351ULL, 0x424af7da002de378ULL,
+	0x421d1462002dc3b4ULL, 0x41ef50ae002da407ULL, 0x41c1aca7002d846eULL, 0x41942839002d64edULL,
+	0x4166c34c002d4580ULL, 0x41397dcc002d262aULL, 0x410c57a2002d06eaULL, 0x40df50b8002ce7beULL,
+	0x40b268fa002cc8a9ULL, 0x4085a051002ca9a9ULL, 0x4058f6a8002c8abfULL, 0x402c6be9002c6be9ULL,
+};
 
+// calculate  n * 2^(-y / 2^s) for s >= EXP2_TAB_BITS
+// the fractional part of the exponent is looked up in exp2_tab and linearly interpolated,
+// the relative error stays below 1e-6
+static inline u64 n_pow2(u64 n, u64 y, u64 s)
+{
+	u64 y_unscaled = y >> s;
+	u32 frac_shift = s - EXP2_TAB_BITS;
+	u32 idx, weight, factor;
+	u64 entry;
+
+	// the factor is below 2^-33, as with the piecewise linear version
+	if (y_unscaled >= 64 - EXP2_TAB_SHIFT)
+		return 0;
+
+	idx = (y >> frac_shift) & ((1 << EXP2_TAB_BITS) - 1);
+	weight = y & ((1ULL << frac_shift) - 1);
+	entry = exp2_tab[idx];
+	factor = (u32)(entry >> 32) - (u32)(((entry & U32_MAX) * weight) >> frac_shift);
+
+	// the integer part first, a constant shift of the product is cheaper than a variable one
+	return mul_u64_u32_shr(n >> y_unscaled, factor, EXP2_TAB_SHIFT);
+}
 
-	return skb;
+#ifdef DSCD_DIVIDE
+// reference variant dividing on every call, built with DSCD_DIVIDE=1 (see Makefile)
+static inline u64 credit_decay_exponent(struct dscd_sched_data *q, u64 diff)
+{
+	return div64_u64(diff << 20, q->credit_half_life);
 }
 
+static inline u64 rate_decay_exponent(struct dscd_sched_data *q, u64 diff)
+{
+	return div64_u64(diff * 5909 << 8, q->rate_memory);
+}
 
-/* ********** Init/Destroy/QDisc Stats ********** */
+static inline u64 rate_bytes(struct dscd_sched_data *q, u64 diff, u64 now)
+{
+	return mul_u64_u64_div_u64(diff, q->rate_config ? q->C : dscd_auto_rate(q, now), NSEC_PER_SEC);
+}
+#else
+static inline u64 credit_decay_exponent(struct dscd_sched_data *q, u64 diff)
+{
+	return mul_u64_u64_shr(diff, q->credit_half_life_recip, RECIP_SHIFT);
+}
 
-// struct for communicating DSCD parameters with userspace
-static const struct nla_policy dscd_policy[TCA_DSCD_MAX + 1] = {
-	[TCA_DSCD_LIMIT]				= {.type = NLA_U32},
-	[TCA_DSCD_RATE]					= {.type = NLA_U64},
-	[TCA_DSCD_CREDIT_HALF_LIFE]		= {.type = NLA_U64},
-	[TCA_DSCD_RATE_MEMORY]			= {.type = NLA_U64},
-	[TCA_DSCD_T_D]					= {.type = NLA_U64},
-	[TCA_DSCD_T_Q]					= {.type = NLA_U64},
+static inline u64 rate_decay_exponent(struct dscd_sched_data *q, u64 diff)
+{
+	return mul_u64_u64_shr(diff, q->rate_memory_recip, RECIP_SHIFT);
+}
+
+// bytes sent at rate C within diff ns
+static inline u64 rate_bytes(struct dscd_sched_data *q, u64 diff, u64 now)
+{
+	// the estimate only changes with rate updates, derive C_ns once while idle
+	if (q->rate_config == 0 && now >= q->C_ns_expires) {
+		q->C_ns = mul_u64_u64_div_u64(dscd_auto_rate(q, now), 1ULL << RATE_NS_SHIFT, NSEC_PER_SEC);
+		q->C_ns_expires = q->shared ? now + MQ_RATE_REFRESH_NS : U64_MAX;
+	}
+	return mul_u64_u64_shr(diff, q->C_ns, RATE_NS_SHIFT);
+}
+#endif
+
+// exponential decay part of DevaluateCredit, applied to every ABE class
+static inline void exp_decay(struct dscd_sched_data *q, u64 now)
+{
+	u64 diff, old_abe_credit, y;
+	struct dscd_class *cls;
+	bool decayed = true;
+	u8 i;
+
+	if (unlikely(q->last_exp_devaluation == 0)) {
+		q->last_exp_devaluation = now;
+		return;
+	}
+
+	diff = now - q->last_exp_devaluation;
+	// decays are exact for any diff, so they can be collected over time_granularity
+	if (diff < q->time_granularity)
+		return;
+
+	// y = diff / credit_half_life * 2^20
+	// s = 20
+	y = credit_decay_exponent(q, diff);
+
+	for_each_abe_class(q, cls, i) {
+		old_abe_credit = cls->CC;
+		cls->CC = n_pow2(cls->CC, y, 20);
+		decayed &= cls->CC == 0 || old_abe_credit != cls->CC;
+	}
+
+	// If credit is existent, but didn't change, then dont modify
+	// last_exp_devaluation until it does
+	if (likely(decayed))
+		q->last_exp_devaluation = now;
+}
+
+// linear decay part of DevaluateCredit
+static inline void lin_decay(struct dscd_sched_data *q, u64 now)
+{
+	u64 bytes = rate_bytes(q, now - q->last_devaluation, now);
+	struct dscd_class *cls;
+	u8 i;
+
+	for_each_abe_class(q, cls, i)
+		decr_class_credit(cls, bytes);
+}
+
+static inline void devaluate_credit(struct dscd_sched_data *q, u64 now)
+{
+	if (unlikely(dscd_classes_empty(q))) {
+		empty_service_queue(q);
+		if (likely(q->last_devaluation != 0)) {
+			lin_decay(q, now);
+		}
+	} else {
+		exp_decay(q, now);
+	}
+	q->last_devaluation = now;
+}
+
+
+/* ********** Bandwidth Estimation ********** */
+
+// bytes completed by the TX queue of this qdisc, wraps around
+static inline u32 dscd_tx_completed(struct Qdisc *sch)
+{
+#ifdef CONFIG_BQL
+	return READ_ONCE(sch->dev_queue->dql.num_completed);
+#else
+	return 0;
+#endif
+}
+
+// Drivers without BQL support never report queued bytes, the completions stay 0.
+// The rate updates of a backlogged qdisc follow dequeues, so num_queued must move.
+static bool dscd_bql_missing(struct Qdisc *sch, struct dscd_sched_data *q)
+{
+#ifdef CONFIG_BQL
+	u32 queued = READ_ONCE(sch->dev_queue->dql.num_queued);
+
+	if (queued != q->bql_queued) {
+		q->bql_queued = queued;
+		q->bql_idle_updates = 0;
+		return false;
+	}
+	return ++q->bql_idle_updates >= EST_BQL_MAX_IDLE_UPDATES;
+#else
+	return true;
+#endif
+}
+
+// the estimator in use, the configured one is kept for the dump
+static inline u8 dscd_estimator(struct dscd_sched_data *q)
+{
+	return q->bql_fallback ? TC_DSCD_EST_EWMA : q->estimator;
+}
+
+// start a new rate sample
+static inline void dscd_sample_reset(struct Qdisc *sch, struct dscd_sched_data *q, u64 now)
+{
+	q->sample_pkts = 0;
+	q->sample_bytes = 0;
+	q->sample_time = 0;
+	q->sample_start = now;
+	if (dscd_estimator(q) == TC_DSCD_EST_BQL)
+		q->sample_completed = dscd_tx_completed(sch);
+}
+
+static void dscd_reset_estimator(struct Qdisc *sch, struct dscd_sched_data *q)
+{
+	q->S_b = 0;
+	q->S_t = 0;
+	q->C_ns_expires = 0;
+	q->last_rate_update = 0;
+	q->last_packet_size = 0;
+	q->backlogged = false;
+	q->bql_idle_updates = 0;
+	q->bql_fallback = false;
+	minmax_reset(&q->rate_max, 0, 0);
+	dscd_sample_reset(sch, q, 0);
+}
+
+// fold the current sample into S_b / S_t
+static void dscd_rate_update(struct Qdisc *sch, struct dscd_sched_data *q, u64 now)
+{
+	u64 y, rate;
+
+	switch (dscd_estimator(q)) {
+	case TC_DSCD_EST_WINMAX:
+		// the max sample rate is kept as S_b B per S_t = 1 s
+		if (q->sample_time) {
+			rate = mul_u64_u64_div_u64(q->sample_bytes, NSEC_PER_SEC, q->sample_time);
+			minmax_running_max(&q->rate_max,
+					   min_t(u64, div_u64(q->rate_memory, NSEC_PER_USEC), U32_MAX),
+					   (u32)div_u64(now, NSEC_PER_USEC),
+					   min_t(u64, rate >> EST_WINMAX_SHIFT, U32_MAX));
+			q->S_b = (u64)minmax_get(&q->rate_max) << EST_WINMAX_SHIFT;
+			q->S_t = NSEC_PER_SEC;
+		}
+		break;
+	case TC_DSCD_EST_BQL:
+		if (unlikely(dscd_bql_missing(sch, q))) {
+			net_warn_ratelimited("%s: dscd: no BQL support, falling back to the ewma estimator\n",
+					     qdisc_dev(sch)->name);
+			dscd_reset_estimator(sch, q);
+			q->bql_fallback = true;
+			return;
+		}
+		// the NIC is busy while the qdisc is backlogged, completions are the link rate
+		q->sample_bytes = (u32)(dscd_tx_completed(sch) - q->sample_completed);
+		q->sample_time = now - q->sample_start;
+		fallthrough;
+	default:
+		// y = diff / memory / ln(2) * 2^20
+		// s = 20
+		y = rate_decay_exponent(q, now - q->last_rate_update);
+
+		// C = S_b / S_t is only derived when needed, see dscd_rate()
+		q->S_b = n_pow2(q->S_b, y, 20) + q->sample_bytes;
+		q->S_t = n_pow2(q->S_t, y, 20) + q->sample_time;
+	}
+
+	q->last_rate_update = now;
+	q->rate_updates++;
+	q->C_ns_expires = 0;
+	dscd_sample_reset(sch, q, now);
+
+	// dscd_rate() divides, only derive C for the trace if it is enabled
+	if (trace_dscd_rate_update_enabled())
+		trace_dscd_rate_update(sch, dscd_estimator(q), dscd_rate(q), q->S_b, q->S_t);
+
+	if (q->shared)
+		dscd_mq_publish(q);
+}
+
+// called for every dequeued packet if the rate isn't configured. Samples are
+// the dequeue times of back-to-back packets, or the TX completions in BQL mode,
+// collected for est_batch packets or est_interval before the estimate is updated.
+static inline void dscd_estimate_rate(struct Qdisc *sch, struct dscd_sched_data *q,
+				      struct sk_buff *skb, u64 now)
+{
+	if (q->backlogged) {
+		q->sample_pkts++;
+		q->sample_bytes += q->last_packet_size;
+		q->sample_time += now - q->last_packet_dequeue;
+
+		if (q->est_interval ? now - q->last_rate_update >= q->est_interval :
+				      q->sample_pkts >= q->est_batch)
+			dscd_rate_update(sch, q, now);
+	} else if (dscd_estimator(q) == TC_DSCD_EST_BQL) {
+		// the queue was idle, completions until now don't show the link rate
+		dscd_sample_reset(sch, q, now);
+	}
+
+	q->last_packet_dequeue = now;
+	// "> 1" instead of "> 0", because sch->q.qlen isn't decremented yet
+	q->backlogged = sch->q.qlen > 1;
+	q->last_packet_size = qdisc_pkt_len(skb);
+}
+
+
+/* ********** Helper Macros ********** */
+
+// the DSCD_RATES per CPU counters of class index idx
+static inline struct gnet_stats_basic_sync __percpu *dscd_rate_counters(struct dscd_sched_data *q,
+									 u8 idx)
+{
+	return q->rates + idx * DSCD_RATES;
+}
+
+// add to field in the dscd_stats of class index idx of the local CPU
+#define DSCD_STAT_ADD(field, idx, val) do { \
+			struct dscd_pcpu_stats *__st = this_cpu_ptr(q->stats); \
+			u64_stats_update_begin(&__st->syncp); \
+			u64_stats_add(&__st->cls_stats[idx].field, val); \
+			u64_stats_update_end(&__st->syncp); \
+		} while (0)
+
+// count packets for a rate estimator of their class
+#define DSCD_RATE_ADD(rate, idx, bytes, packets) do { \
+			_bstats_update(this_cpu_ptr(dscd_rate_counters(q, idx) + (rate)), bytes, packets); \
+		} while (0)
+
+// count a packet for a rate estimator of its class
+#define DSCD_RATE_INC(rate, idx, len) DSCD_RATE_ADD(rate, idx, len, 1)
+
+// kernel memory held by the queued packets and the service queue
+static inline u64 dscd_memory_usage(struct dscd_sched_data *q)
+{
+	return q->skb_memory + q->service_chunks * sizeof(struct service_chunk);
+}
+
+// increment field in the dscd_stats of the local CPU
+#define DSCD_STAT_INC(field, idx) DSCD_STAT_ADD(field, idx, 1)
+
+
+/* ********** Enqueue ********** */
+
+// limit an arriving packet would exceed
+enum dscd_limit {
+	DSCD_LIMIT_NONE,
+	DSCD_LIMIT_B_MAX,		// sch->limit
+	DSCD_LIMIT_SHARED,		// memory_limit or packet_limit
+	DSCD_LIMIT_CLASS,		// limit of the class of the packet
 };
 
-static int dscd_change(struct Qdisc *sch, struct nlattr *opt,
-			 struct netlink_ext_ack *extack)
+static enum dscd_limit dscd_over_limit(struct Qdisc *sch, struct dscd_sched_data *q,
+				       struct dscd_class *cls, struct sk_buff *skb)
+{
+	unsigned int pkt_skb_len = qdisc_pkt_len(skb);
+
+	if (unlikely(pkt_skb_len + dscd_credit_bytes(q) > sch->limit))
+		return DSCD_LIMIT_B_MAX;
+
+	// optional limits, a burst in one class must not take the buffer of the other
+	if (unlikely((q->packet_limit && sch->q.qlen >= q->packet_limit) ||
+		     (q->memory_limit && dscd_memory_usage(q) + skb->truesize > q->memory_limit)))
+		return DSCD_LIMIT_SHARED;
+	if (unlikely(cls->limit && cls->size + pkt_skb_len > cls->limit))
+		return DSCD_LIMIT_CLASS;
+
+	return DSCD_LIMIT_NONE;
+}
+
+// class to push out the head packet of, NULL to drop the arriving packet instead
+static struct dscd_class *dscd_overflow_victim(struct dscd_sched_data *q, struct dscd_class *cls,
+					       enum dscd_limit limit)
+{
+	struct dscd_class *victim = NULL, *c;
+	u8 i;
+
+	switch (q->overflow) {
+	case TC_DSCD_OVERFLOW_ABE_HEAD:
+		// below its own limit, only the class of the packet can make room
+		if (limit == DSCD_LIMIT_CLASS) {
+			victim = cls->abe ? cls : NULL;
+			break;
+		}
+		// the ABE class with the oldest head packet
+		for_each_abe_class(q, c, i) {
+			if (c->len && (!victim || dscd_skb_cb(class_head(c))->q_time <
+					       dscd_skb_cb(class_head(victim))->q_time))
+				victim = c;
+		}
+		break;
+	case TC_DSCD_OVERFLOW_LARGER:
+		// below its own limit, the class of the packet is the larger one
+		if (limit == DSCD_LIMIT_CLASS) {
+			victim = cls;
+			break;
+		}
+		for_each_class(q, c) {
+			if (!victim || c->size > victim->size)
+				victim = c;
+		}
+		break;
+	default:
+		return NULL;
+	}
+
+	if (!victim || !victim->len)
+		return NULL;
+	return victim;
+}
+
+// Push outs only help, if the classes the overflow policy takes from can free enough room
+// for every exceeded limit. Otherwise they would be dropped for nothing, before the
+// arriving packet is dropped anyway. Credit granted to a class can't be taken back.
+static bool dscd_pushout_feasible(struct Qdisc *sch, struct dscd_sched_data *q,
+				  struct dscd_class *cls, struct sk_buff *skb)
+{
+	unsigned int pkt_skb_len = qdisc_pkt_len(skb);
+	u64 credit = 0, len = 0, truesize = 0;
+	struct dscd_class *c;
+
+	if (q->overflow == TC_DSCD_OVERFLOW_TAIL)
+		return false;
+
+	for_each_class(q, c) {
+		if (q->overflow == TC_DSCD_OVERFLOW_ABE_HEAD && !c->abe)
+			continue;
+		credit += min_t(u64, c->size, class_credit_bytes(c) + c->service_bytes);
+		len += c->len;
+		truesize += c->truesize;
+	}
+
+	if (pkt_skb_len + dscd_credit_bytes(q) > sch->limit + credit)
+		return false;
+	if (q->packet_limit && sch->q.qlen >= q->packet_limit + len)
+		return false;
+	if (q->memory_limit && dscd_memory_usage(q) + skb->truesize > q->memory_limit + truesize)
+		return false;
+	// only the class of the packet makes room below its own limit, see dscd_overflow_victim()
+	if (cls->limit && cls->size + pkt_skb_len > cls->limit &&
+	    (pkt_skb_len > cls->limit || (q->overflow == TC_DSCD_OVERFLOW_ABE_HEAD && !cls->abe)))
+		return false;
+	return true;
+}
+
+// drop the head packet of victim to make room, the caller reduces the backlog of the parents
+static void dscd_push_out(struct Qdisc *sch, struct dscd_sched_data *q,
+			  struct dscd_class *victim, struct sk_buff **to_free)
+{
+	struct sk_buff *skb = class_dequeue(q, victim);
+	unsigned int len = qdisc_pkt_len(skb);
+
+	service_revoke(q, victim, len);
+
+	sch->qstats.backlog -= len;
+	sch->q.qlen--;
+
+	DSCD_STAT_INC(pushout_drops, victim->index);
+	DSCD_RATE_INC(DSCD_RATE_DROPPED, victim->index, len);
+	trace_dscd_pushout(sch, skb, class_minor(victim));
+	qdisc_qstats_drop(sch);
+	__qdisc_drop(skb, to_free);
+}
+
+// add packet to its flow, credit must already be devaluated
+// and dscd_skb_cb(skb)->q_time must be set
+static int dscd_enqueue_skb(struct sk_buff *skb, struct Qdisc *sch,
+			 struct sk_buff **to_free)
+{
+	struct dscd_sched_data *q = qdisc_priv(sch);
+	unsigned int pkt_skb_len = qdisc_pkt_len(skb);
+	unsigned int pushed_pkts = 0, pushed_bytes = 0;
+	struct dscd_class *cls, *victim;
+	enum dscd_limit limit;
+	int ret;
+
+	cls = dscd_classify(skb, sch, &ret);
+	if (unlikely(!cls)) {
+		if (ret & __NET_XMIT_BYPASS)
+			qdisc_qstats_drop(sch);
+		__qdisc_drop(skb, to_free);
+		return ret;
+	}
+
+
+	// push out queued packets by the overflow policy, or drop the arriving one
+	limit = dscd_over_limit(sch, q, cls, skb);
+	if (unlikely(limit != DSCD_LIMIT_NONE && !dscd_pushout_feasible(sch, q, cls, skb)))
+		goto limit_drop;
+	while (unlikely(limit != DSCD_LIMIT_NONE)) {
+		victim = dscd_overflow_victim(q, cls, limit);
+		if (!victim)
+			goto limit_drop;
+
+		pushed_pkts++;
+		pushed_bytes += qdisc_pkt_len(class_head(victim));
+		dscd_push_out(sch, q, victim, to_free);
+		limit = dscd_over_limit(sch, q, cls, skb);
+	}
+
+
+	if (unlikely(!service_enqueue(q, pkt_skb_len, cls))) {
+		net_warn_ratelimited("dscd: Service Chunk could not be allocated\n");
+		goto drop;
+	}
+
+	dscd_skb_cb(skb)->ce_marked = false;
+	class_enqueue(q, cls, skb);
+
+	// Adjust general Qdisc stats
+	sch->qstats.backlog += pkt_skb_len;
+	sch->q.qlen++;
+
+	// Adjust DSCD stats
+	DSCD_STAT_INC(received_pkts, cls->index);
+	DSCD_RATE_INC(DSCD_RATE_RECEIVED, cls->index, pkt_skb_len);
+	trace_dscd_enqueue(sch, skb, class_minor(cls), class_credit_bytes(cls),
+			   service_credit_bytes(q));
+
+	if (unlikely(pushed_pkts))
+		qdisc_tree_reduce_backlog(sch, pushed_pkts, pushed_bytes);
+	return NET_XMIT_SUCCESS;
+
+limit_drop:
+	if (limit != DSCD_LIMIT_B_MAX)
+		q->limit_drops++;
+drop:
+	DSCD_STAT_INC(enqueue_drops, cls->index);
+	DSCD_RATE_INC(DSCD_RATE_DROPPED, cls->index, pkt_skb_len);
+	trace_dscd_enqueue_drop(sch, skb, class_minor(cls));
+	if (unlikely(pushed_pkts))
+		qdisc_tree_reduce_backlog(sch, pushed_pkts, pushed_bytes);
+	return qdisc_drop(skb, sch, to_free);
+}
+
+// lockless mode: drop skb before it was staged. sch->qstats is only written on the
+// dequeue side, which adds staging_drops to it, see dscd_drain_staging().
+static int dscd_drop_lockless(struct sk_buff *skb, struct Qdisc *sch,
+			      struct sk_buff **to_free)
+{
+	struct dscd_sched_data *q = qdisc_priv(sch);
+	struct dscd_class *cls;
+
+	// filters only run on the dequeue side, count the drop by the maps
+	cls = dscd_map_class(q, skb);
+	DSCD_STAT_INC(enqueue_drops, cls->index);
+	DSCD_RATE_INC(DSCD_RATE_DROPPED, cls->index, qdisc_pkt_len(skb));
+	trace_dscd_enqueue_drop(sch, skb, class_minor(cls));
+	atomic64_inc(&q->staging_drops);
+	__qdisc_drop(skb, to_free);
+	return NET_XMIT_DROP;
+}
+
+// lockless mode: runs concurrently on all CPUs without the qdisc lock,
+// so only the staging ring and the atomic overflow counters are touched
+static int dscd_enqueue_lockless(struct sk_buff *skb, struct Qdisc *sch,
+			 struct sk_buff **to_free)
+{
+	struct dscd_sched_data *q = qdisc_priv(sch);
+
+	dscd_skb_cb(skb)->q_time = ktime_get_ns();
+
+	if (unlikely(skb_array_produce(&q->staging, skb)))
+		return dscd_drop_lockless(skb, sch, to_free);
+
+	return NET_XMIT_SUCCESS;
+}
+
+// split_gso: enqueue the segments of a GSO packet one by one like sch_cake, so that
+// every segment gets its own service entry, timestamp and T_d decision
+static int dscd_enqueue_gso(struct sk_buff *skb, struct Qdisc *sch,
+			 struct sk_buff **to_free)
+{
+	struct dscd_sched_data *q = qdisc_priv(sch);
+	unsigned int len = qdisc_pkt_len(skb), slen = 0;
+	netdev_features_t features = netif_skb_features(skb);
+	struct sk_buff *segs, *nskb;
+	int numsegs = 0, ret;
+	u64 now = 0;
+
+	segs = skb_gso_segment(skb, features & ~NETIF_F_GSO_MASK);
+	if (IS_ERR_OR_NULL(segs)) {
+		if (q->lockless)
+			return dscd_drop_lockless(skb, sch, to_free);
+		return qdisc_drop(skb, sch, to_free);
+	}
+
+	if (!q->lockless) {
+		now = dscd_now(q);
+		q->peek_skb = NULL;
+		devaluate_credit(q, now);
+	}
+
+	skb_list_walk_safe(segs, segs, nskb) {
+		skb_mark_not_on_list(segs);
+		qdisc_skb_cb(segs)->pkt_len = segs->len;
+
+		if (q->lockless) {
+			ret = dscd_enqueue_lockless(segs, sch, to_free);
+		} else {
+			dscd_skb_cb(segs)->q_time = now;
+			ret = dscd_enqueue_skb(segs, sch, to_free);
+		}
+
+		if (ret == NET_XMIT_SUCCESS) {
+			numsegs++;
+			slen += segs->len;
+		}
+	}
+
+	consume_skb(skb);
+
+	if (!numsegs)
+		return NET_XMIT_DROP;
+
+	// the parents account one packet of len bytes for a successful enqueue
+	qdisc_tree_reduce_backlog(sch, 1 - numsegs, len - slen);
+	return NET_XMIT_SUCCESS;
+}
+
+static int dscd_enqueue(struct sk_buff *skb, struct Qdisc *sch,
+			 struct sk_buff **to_free)
+{
+	struct dscd_sched_data *q = qdisc_priv(sch);
+	u64 now;
+
+	if (q->split_gso && skb_is_gso(skb))
+		return dscd_enqueue_gso(skb, sch, to_free);
+
+	if (q->lockless)
+		return dscd_enqueue_lockless(skb, sch, to_free);
+
+	now = dscd_now(q);
+
+	// credit is devaluated past the time of a previous peek
+	q->peek_skb = NULL;
+	devaluate_credit(q, now);
+
+	dscd_skb_cb(skb)->q_time = now;
+	return dscd_enqueue_skb(skb, sch, to_free);
+}
+
+// lockless mode: move staged packets into the flows, runs on the dequeue side
+static void dscd_drain_staging(struct Qdisc *sch, struct dscd_sched_data *q, u64 now)
+{
+	struct sk_buff *skb, *to_free = NULL;
+	u64 drops;
+	int i;
+
+	drops = atomic64_xchg(&q->staging_drops, 0);
+	if (unlikely(drops))
+		sch->qstats.drops += drops;
+
+	if (__skb_array_empty(&q->staging))
+		return;
+
+	// staged packets keep their q_time, but credit is devaluated once for the batch
+	devaluate_credit(q, now);
+
+	for (i = 0; i < STAGING_BATCH; i++) {
+		skb = __skb_array_consume(&q->staging);
+		if (!skb)
+			break;
+
+		dscd_enqueue_skb(skb, sch, &to_free);
+	}
+
+	if (unlikely(to_free))
+		kfree_skb_list(to_free);
+}
+
+static void dscd_staging_purge(struct dscd_sched_data *q)
+{
+	struct sk_buff *skb;
+
+	while ((skb = __skb_array_consume(&q->staging)) != NULL)
+		kfree_skb(skb);
+
+	atomic64_set(&q->staging_drops, 0);
+}
+
+
+/* ********** Dequeue + Helper ********** */
+
+// get enqueue time of packet, which is located at the head of an ABE class
+static inline u64 abe_head_q_time(struct dscd_class *cls)
+{
+	return dscd_skb_cb(class_head(cls))->q_time;
+}
+
+// true if the head packet of an ABE class has been waiting longer than its T_d and must
+// be dropped, or CE marked in ecn mode. A marked head stays queued and is not pending anymore.
+static inline bool abe_drop_pending(struct dscd_class *cls, u64 now)
+{
+	return cls->len > cls->T_q && abe_head_q_time(cls) + cls->T_d < now &&
+	       !dscd_skb_cb(class_head(cls))->ce_marked;
+}
+
+// true if the head packet of any ABE class is pending, see abe_drop_pending()
+static inline bool dscd_drop_pending(struct dscd_sched_data *q, u64 now)
+{
+	struct dscd_class *cls;
+	u8 i;
+
+	for_each_abe_class(q, cls, i)
+		if (abe_drop_pending(cls, now))
+			return true;
+	return false;
+}
+
+// Account a batch of T_d drops of one class at once, instead of walking up the qdisc tree
+// per packet. The skbs are freed by net_tx_action() after the qdisc lock is released.
+static void dscd_drop_batch(struct Qdisc *sch, struct dscd_sched_data *q, struct dscd_class *cls,
+			    struct sk_buff *to_free, unsigned int pkts, unsigned int bytes)
+{
+	struct sk_buff *next;
+
+	DSCD_STAT_ADD(dequeue_drops, cls->index, pkts);
+	DSCD_RATE_ADD(DSCD_RATE_DROPPED, cls->index, bytes, pkts);
+	qdisc_tree_reduce_backlog(sch, pkts, bytes);
+	__qdisc_qstats_drop(sch, pkts);
+	sch->qstats.backlog -= bytes;
+	sch->q.qlen -= pkts;
+
+	for (; to_free; to_free = next) {
+		next = to_free->next;
+		skb_mark_not_on_list(to_free);
+		dev_kfree_skb_irq_reason(to_free, SKB_DROP_REASON_QDISC_DROP);
+	}
+}
+
+// Drop the packets of an ABE class, that have been waiting longer than its T_d,
+// see dscd_drop_batch()
+static void dscd_drop_expired(struct Qdisc *sch, struct dscd_sched_data *q,
+			      struct dscd_class *cls, u64 now)
+{
+	struct sk_buff *abe_head_skb, *to_free = NULL;
+	unsigned int drop_pkts = 0, drop_bytes = 0;
+
+	while (abe_drop_pending(cls, now))
+	{
+		// ecn: mark instead of dropping, the following packets are checked once they are the head
+		abe_head_skb = class_head(cls);
+		if (q->ecn && INET_ECN_set_ce(abe_head_skb)) {
+			dscd_skb_cb(abe_head_skb)->ce_marked = true;
+			DSCD_STAT_INC(ecn_marks, cls->index);
+			trace_dscd_td_drop(sch, abe_head_skb, class_minor(cls),
+					   now - dscd_skb_cb(abe_head_skb)->q_time, true);
+			break;
+		}
+
+		abe_head_skb = class_dequeue(q, cls);
+		trace_dscd_td_drop(sch, abe_head_skb, class_minor(cls),
+				   now - dscd_skb_cb(abe_head_skb)->q_time, false);
+
+		drop_pkts++;
+		drop_bytes += qdisc_pkt_len(abe_head_skb);
+		abe_head_skb->next = to_free;
+		to_free = abe_head_skb;
+	}
+	if (unlikely(drop_pkts))
+		dscd_drop_batch(sch, q, cls, to_free, drop_pkts, drop_bytes);
+}
+
+// true if cls has enough credit to send its head packet
+static inline bool class_credited(struct dscd_class *cls)
+{
+	struct sk_buff *head = class_head(cls);
+
+	return head && class_credit_bytes(cls) >= qdisc_pkt_len(head);
+}
+
+// class to send from, the first credited ABE class by T_d, then BE, NULL if no class is credited
+static inline struct dscd_class *dscd_credited_class(struct dscd_sched_data *q)
+{
+	struct dscd_class *cls;
+	u8 i;
+
+	for_each_abe_class(q, cls, i)
+		if (class_credited(cls))
+			return cls;
+
+	cls = &q->classes[DSCD_BE];
+	return class_credited(cls) ? cls : NULL;
+}
+
+static struct sk_buff *__dscd_dequeue(struct Qdisc *sch)
+{
+	struct dscd_sched_data *q = qdisc_priv(sch);
+	struct sk_buff *skb = NULL;
+	struct dscd_class *cls, *skb_cls;
+	struct dscd_skb_cb *skb_cb;
+	u8 i;
+	u64 q_delay;
+	u64 now = dscd_now(q);
+	// after dscd_peek(), select at the time of the peek, so that the peeked packet is dequeued
+	struct sk_buff *peeked = q->peek_skb;
+	u64 select_time = peeked ? q->peek_time : now;
+
+	// shaping: not before the send time of the next packet
+	if (q->shaping && now < q->time_next) {
+		qdisc_qstats_overlimit(sch);
+		qdisc_watchdog_schedule_ns(&q->watchdog, q->time_next);
+		return NULL;
+	}
+
+	q->peek_skb = NULL;
+
+
+	if (q->lockless)
+		dscd_drain_staging(sch, q, now);
+
+	devaluate_credit(q, select_time);
+
+
+	// Drop packets, that have been waiting longer than the T_d of their class
+	for_each_abe_class(q, cls, i)
+		dscd_drop_expired(sch, q, cls, select_time);
+
+
+	// Determine next packet, transfer service credit until a class is credited
+	if (likely(!dscd_classes_empty(q)))
+	{
+		while (skb == NULL)
+		{
+			skb_cls = dscd_credited_class(q);
+			if (!skb_cls) {
+				service_transfer(sch, q);
+				continue;
+			}
+
+			skb = class_dequeue(q, skb_cls);
+			skb_cb = dscd_skb_cb(skb);
+
+			decr_class_credit(skb_cls, qdisc_pkt_len(skb));
+		}
+	}
+
+
+	// Return if no packet can be dequeued
+	if (unlikely(!skb))
+		return NULL;
+
+	WARN_ON_ONCE(peeked && skb != peeked);
+
+	if (q->shaping) {
+		q->time_next = max(q->time_next, now - min_t(u64, now, SHAPING_MAX_LAG_NS)) +
+			       mul_u64_u64_shr(qdisc_pkt_len(skb), q->ns_per_byte, RATE_NS_SHIFT);
+	}
+
+
+	// Estimate rate
+	if (q->rate_config == 0)
+		dscd_estimate_rate(sch, q, skb, now);
+
+
+	// Adjust general QDisc Stats
+	qdisc_qstats_backlog_dec(sch, skb);
+	qdisc_bstats_update(sch, skb);
+	sch->q.qlen--;
+
+
+	// Adjust DSCD Stats
+	// with time_granularity, this is usually the cached now
+	q_delay = dscd_now(q) - skb_cb->q_time;
+	{
+		struct dscd_pcpu_stats *st = this_cpu_ptr(q->stats);
+		struct dscd_pcpu_class_stats *cl = &st->cls_stats[skb_cls->index];
+
+		u64_stats_update_begin(&st->syncp);
+		u64_stats_inc(&cl->sent_pkts);
+		u64_stats_add(&cl->sent_bytes, qdisc_pkt_len(skb));
+		u64_stats_add(&cl->sum_delay_ns, q_delay);
+		u64_stats_inc(&st->hist[skb_cls->index][dscd_hist_bucket(q_delay)]);
+		u64_stats_update_end(&st->syncp);
+	}
+	DSCD_RATE_INC(DSCD_RATE_SENT, skb_cls->index, qdisc_pkt_len(skb));
+	trace_dscd_dequeue(sch, skb, class_minor(skb_cls), q_delay);
+
+
+	return skb;
+}
+
+// In lockless mode, the stats dumps only hold the qdisc lock, while the dequeue side runs
+// under sch->seqlock. They retry reading the queue state while a dequeue changes it.
+static struct sk_buff *dscd_dequeue(struct Qdisc *sch)
+{
+	struct dscd_sched_data *q = qdisc_priv(sch);
+	struct sk_buff *skb;
+
+	if (!q->lockless)
+		return __dscd_dequeue(sch);
+
+	write_seqcount_begin(&q->state_seq);
+	skb = __dscd_dequeue(sch);
+	write_seqcount_end(&q->state_seq);
+	return skb;
+}
+
+
+/* ********** Peek ********** */
+
+// Class dscd_dequeue() selects with the given credit bytes per class index, without
+// transferring service credit. Walks the service queue like repeated service_transfer() calls.
+static struct dscd_class *dscd_select_class(struct dscd_sched_data *q, const u64 *credit)
+{
+	u64 need[DSCD_MAX_CLASSES];
+	struct service_chunk *chunk;
+	struct service_run *run;
+	struct dscd_class *cls;
+	bool credited = false;
+	u16 i;
+
+	for_each_class(q, cls) {
+		need[cls->index] = class_need(cls, credit[cls->index]);
+		credited |= need[cls->index] == 0;
+	}
+
+	list_for_each_entry(chunk, &q->service_q, chunkchain) {
+		for (i = chunk->head; i < chunk->tail; i++) {
+			if (credited)
+				goto out;
+
+			run = &chunk->runs[i];
+			if (need[run->cls] != U64_MAX) {
+				need[run->cls] -= min_t(u64, need[run->cls], (u64)run->pkt_len * run->count);
+				credited = need[run->cls] == 0;
+			}
+		}
+	}
+
+out:
+	// ABE classes are checked first, like in dscd_credited_class()
+	for_each_abe_class(q, cls, i)
+		if (need[cls->index] == 0)
+			return cls;
+	if (need[DSCD_BE] == 0)
+		return &q->classes[DSCD_BE];
+	return NULL;
+}
+
+// Side-effect-free peek: the credit is devaluated and transferred on a copy.
+// dscd_dequeue() repeats the selection at the same time and gets the same packet.
+// Falls back to qdisc_peek_dequeued() if the selection would change state
+// beyond credit (T_d drops, staged packets in lockless mode).
+static struct sk_buff *dscd_peek(struct Qdisc *sch)
+{
+	struct dscd_sched_data *q = qdisc_priv(sch);
+	struct sk_buff *skb = skb_peek(&sch->gso_skb);
+	u64 credit[DSCD_MAX_CLASSES];
+	struct dscd_class *cls;
+	u64 abe_credit, now;
+
+	// packet already dequeued by qdisc_peek_dequeued()
+	if (skb)
+		return skb;
+
+	if (q->peek_skb)
+		return q->peek_skb;
+
+	if (q->lockless)
+		return qdisc_peek_dequeued(sch);
+
+	now = dscd_now(q);
+
+	// shaping: nothing to send yet, dscd_dequeue() would return NULL
+	if (q->shaping && now < q->time_next) {
+		qdisc_watchdog_schedule_ns(&q->watchdog, q->time_next);
+		return NULL;
+	}
+
+	if (dscd_classes_empty(q))
+		return NULL;
+
+	if (dscd_drop_pending(q, now))
+		return qdisc_peek_dequeued(sch);
+
+	// same as exp_decay(), devaluate_credit() only decays exponentially while packets are queued
+	for_each_class(q, cls) {
+		credit[cls->index] = class_credit_bytes(cls);
+		if (!cls->abe || q->last_exp_devaluation == 0 ||
+		    now - q->last_exp_devaluation < q->time_granularity)
+			continue;
+
+		abe_credit = n_pow2(cls->CC, credit_decay_exponent(q, now - q->last_exp_devaluation), 20);
+		credit[cls->index] = abe_credit >> ABE_CREDIT_SHIFT;
+	}
+
+	cls = dscd_select_class(q, credit);
+	if (unlikely(!cls))
+		return qdisc_peek_dequeued(sch);
+
+	q->peek_skb = class_head(cls);
+	q->peek_time = now;
+	return q->peek_skb;
+}
+
+
+/* ********** Init/Destroy/QDisc Stats ********** */
+
+// struct for communicating DSCD parameters with userspace
+static const struct nla_policy dscd_policy[TCA_DSCD_MAX + 1] = {
+	[TCA_DSCD_LIMIT]				= {.type = NLA_U32},
+	[TCA_DSCD_RATE]					= {.type = NLA_U64},
+	[TCA_DSCD_CREDIT_HALF_LIFE]		= {.type = NLA_U64},
+	[TCA_DSCD_RATE_MEMORY]			= {.type = NLA_U64},
+	[TCA_DSCD_T_D]					= {.type = NLA_U64},
+	[TCA_DSCD_T_Q]					= {.type = NLA_U64},
+	[TCA_DSCD_LOCKLESS]				= {.type = NLA_U8},
+	[TCA_DSCD_FLOWS]				= NLA_POLICY_MAX(NLA_U32, DSCD_FLOWS_MAX),
+	[TCA_DSCD_QUANTUM]				= NLA_POLICY_MIN(NLA_U32, 1),
+	[TCA_DSCD_ABE_DSCP]				= {.type = NLA_U64},
+	[TCA_DSCD_ABE_PRIO]				= {.type = NLA_U16},
+	[TCA_DSCD_SHAPING]				= {.type = NLA_U8},
+	[TCA_DSCD_SPLIT_GSO]			= {.type = NLA_U8},
+	[TCA_DSCD_TIME_GRANULARITY]		= {.type = NLA_U64},
+	[TCA_DSCD_ECN]					= {.type = NLA_U8},
+	[TCA_DSCD_ESTIMATOR]			= NLA_POLICY_MAX(NLA_U8, TC_DSCD_EST_MAX),
+	[TCA_DSCD_EST_BATCH]			= NLA_POLICY_MIN(NLA_U32, 1),
+	[TCA_DSCD_EST_INTERVAL]			= {.type = NLA_U64},
+	[TCA_DSCD_MEMORY_LIMIT]			= {.type = NLA_U32},
+	[TCA_DSCD_PACKET_LIMIT]			= {.type = NLA_U32},
+	[TCA_DSCD_ABE_LIMIT]			= {.type = NLA_U32},
+	[TCA_DSCD_BE_LIMIT]				= {.type = NLA_U32},
+	[TCA_DSCD_OVERFLOW]				= NLA_POLICY_MAX(NLA_U8, TC_DSCD_OVERFLOW_MAX),
+	[TCA_DSCD_ABE_CLASSES]			= {.type = NLA_NESTED},
+};
+
+static const struct nla_policy dscd_abe_class_policy[TCA_DSCD_ABE_CLASS_MAX + 1] = {
+	[TCA_DSCD_ABE_CLASS_T_D]		= {.type = NLA_U64},
+	[TCA_DSCD_ABE_CLASS_T_Q]		= {.type = NLA_U64},
+	[TCA_DSCD_ABE_CLASS_DSCP]		= {.type = NLA_U64},
+	[TCA_DSCD_ABE_CLASS_PRIO]		= {.type = NLA_U16},
+	[TCA_DSCD_ABE_CLASS_LIMIT]		= {.type = NLA_U32},
+};
+
+// The dequeue side of a lockless qdisc runs under sch->seqlock instead of
+// the qdisc lock, take both when the DSCD state is modified from outside.
+// The seqlock comes first like in dev_reset_queue(). Returns whether it was
+// taken, TCQ_F_NOLOCK may be set in between.
+static inline bool dscd_lock(struct Qdisc *sch)
+{
+	bool nolock = sch->flags & TCQ_F_NOLOCK;
+
+	if (nolock)
+		spin_lock_bh(&sch->seqlock);
+	sch_tree_lock(sch);
+	return nolock;
+}
+
+static inline void dscd_unlock(struct Qdisc *sch, bool nolock)
+{
+	sch_tree_unlock(sch);
+	if (nolock) {
+		spin_unlock_bh(&sch->seqlock);
+		// enqueuers may have given up running the qdisc while we held the seqlock
+		__netif_schedule(sch);
+	}
+}
+
+static struct dscd_fq_flow *dscd_fq_flows_alloc(u32 flows_cnt)
+{
+	struct dscd_fq_flow *flows;
+	u32 i;
+
+	if (!flows_cnt)
+		return NULL;
+
+	flows = kvcalloc(flows_cnt, sizeof(*flows), GFP_KERNEL);
+	if (!flows)
+		return NULL;
+
+	for (i = 0; i < flows_cnt; i++)
+		INIT_LIST_HEAD(&flows[i].flowchain);
+
+	return flows;
+}
+
+// refresh the reciprocals of the configuration, zero values are treated as 1 ns
+static void dscd_update_reciprocals(struct dscd_sched_data *q)
+{
+	q->credit_half_life_recip = div64_u64(1ULL << (20 + RECIP_SHIFT),
+					      max_t(u64, q->credit_half_life, 1));
+	// 5909 << 8 ~= 2^20 / ln(2)
+	q->rate_memory_recip = div64_u64((u64)(5909 << 8) << RECIP_SHIFT,
+					 max_t(u64, q->rate_memory, 1));
+}
+
+// start the rate estimators of a class, rates are its per CPU counters
+static int dscd_new_estimators(struct dscd_class *cls,
+			       struct gnet_stats_basic_sync __percpu *rates)
+{
+	struct {
+		struct nlattr nla;
+		struct gnet_estimator opt;
+	} est = {
+		.nla = {
+			.nla_len	= nla_attr_size(sizeof(est.opt)),
+			.nla_type	= TCA_RATE,
+		},
+		.opt = {
+			.interval	= 0,	// 1 sec
+			.ewma_log	= 3,	// 8 sec
+		},
+	};
+	int i, err;
+
+	for (i = 0; i < DSCD_RATES; i++) {
+		// per CPU counters don't need a lock
+		err = gen_new_estimator(NULL, rates + i, &cls->rate_est[i], NULL, false, &est.nla);
+		if (err)
+			return err;
+	}
+
+	return 0;
+}
+
+static void dscd_kill_estimators(struct dscd_class *cls)
+{
+	int i;
+
+	for (i = 0; i < DSCD_RATES; i++)
+		gen_kill_estimator(&cls->rate_est[i]);
+}
+
+// sort the ABE classes by T_d for dscd_dequeue(), the class with the smaller index first on ties,
+// published entry by entry for lockless enqueuers, see dscd_map_class()
+static void dscd_update_order(struct dscd_sched_data *q)
+{
+	u8 order[DSCD_MAX_CLASSES - 1];
+	u8 i, j, idx, num_abe = 0;
+
+	for (idx = 0; idx < q->num_classes; idx++) {
+		if (!q->classes[idx].abe)
+			continue;
+
+		for (i = num_abe; i > 0; i--) {
+			j = order[i - 1];
+			if (q->classes[j].T_d <= q->classes[idx].T_d)
+				break;
+			order[i] = j;
+		}
+		order[i] = idx;
+		num_abe++;
+	}
+
+	for (i = 0; i < num_abe; i++)
+		WRITE_ONCE(q->abe_order[i], order[i]);
+	WRITE_ONCE(q->num_abe, num_abe);
+}
+
+// parse the additional ABE classes of TCA_DSCD_ABE_CLASSES into ctb, returns their number
+static int dscd_parse_abe_classes(struct nlattr *list,
+				  struct nlattr *ctb[][TCA_DSCD_ABE_CLASS_MAX + 1],
+				  struct netlink_ext_ack *extack)
+{
+	struct nlattr *entry;
+	int rem, n = 0, err;
+
+	nla_for_each_nested(entry, list, rem) {
+		if (nla_type(entry) != TCA_DSCD_ABE_CLASS) {
+			NL_SET_ERR_MSG_ATTR(extack, entry, "expected an ABE class");
+			return -EINVAL;
+		}
+		if (n == TC_DSCD_MAX_ABE_CLASSES) {
+			NL_SET_ERR_MSG_MOD(extack, "too many ABE classes");
+			return -EINVAL;
+		}
+
+		err = nla_parse_nested(ctb[n], TCA_DSCD_ABE_CLASS_MAX, entry,
+				       dscd_abe_class_policy, extack);
+		if (err < 0)
+			return err;
+		n++;
+	}
+
+	return n;
+}
+
+static void dscd_configure_abe_class(struct dscd_class *cls, struct nlattr **ctb)
+{
+	if (ctb[TCA_DSCD_ABE_CLASS_T_D])
+		cls->T_d = nla_get_u64(ctb[TCA_DSCD_ABE_CLASS_T_D]);
+	if (ctb[TCA_DSCD_ABE_CLASS_T_Q])
+		cls->T_q = nla_get_u64(ctb[TCA_DSCD_ABE_CLASS_T_Q]);
+	if (ctb[TCA_DSCD_ABE_CLASS_DSCP])
+		WRITE_ONCE(cls->dscp, nla_get_u64(ctb[TCA_DSCD_ABE_CLASS_DSCP]));
+	if (ctb[TCA_DSCD_ABE_CLASS_PRIO])
+		WRITE_ONCE(cls->prio, nla_get_u16(ctb[TCA_DSCD_ABE_CLASS_PRIO]));
+	if (ctb[TCA_DSCD_ABE_CLASS_LIMIT])
+		cls->limit = nla_get_u32(ctb[TCA_DSCD_ABE_CLASS_LIMIT]);
+}
+
+static void dscd_remove_classes(struct Qdisc *sch, struct dscd_sched_data *q, u8 num_classes);
+static void dscd_add_class(struct dscd_sched_data *q, u8 idx);
+
+// create is true while the qdisc is set up and not yet visible to the stack,
+// check only validates opt against the current configuration and changes nothing
+static int dscd_configure(struct Qdisc *sch, struct nlattr *opt,
+			 struct netlink_ext_ack *extack, bool create, bool check)
+{
+	struct dscd_sched_data *q = qdisc_priv(sch);
+	struct nlattr *tb[TCA_DSCD_MAX + 1];
+	struct nlattr *ctb[TC_DSCD_MAX_ABE_CLASSES][TCA_DSCD_ABE_CLASS_MAX + 1];
+	struct dscd_fq_flow *flows[DSCD_MAX_CLASSES] = {};
+	bool lockless = q->lockless;
+	bool shaping = q->shaping;
+	bool nolock;
+	u64 rate_config = q->rate_config;
+	u64 time_granularity = q->time_granularity;
+	u32 flows_cnt = q->flows_cnt;
+	u8 num_classes = q->num_classes;
+	u8 estimator = q->estimator;
+	u32 est_batch = q->est_batch;
+	u64 est_interval = q->est_interval;
+	int err, i;
+
+	if (!opt)
+		return -EINVAL;
+
+	err = nla_parse_nested(tb, TCA_DSCD_MAX, opt, dscd_policy, extack);
+	if (err < 0)
+		return err;
+
+	if (tb[TCA_DSCD_ABE_CLASSES]) {
+		err = dscd_parse_abe_classes(tb[TCA_DSCD_ABE_CLASSES], ctb, extack);
+		if (err < 0)
+			return err;
+		num_classes = 2 + err;
+	}
+
+	if (tb[TCA_DSCD_LOCKLESS])
+		lockless = nla_get_u8(tb[TCA_DSCD_LOCKLESS]);
+	if (tb[TCA_DSCD_FLOWS])
+		flows_cnt = nla_get_u32(tb[TCA_DSCD_FLOWS]);
+	if (tb[TCA_DSCD_SHAPING])
+		shaping = nla_get_u8(tb[TCA_DSCD_SHAPING]);
+	if (tb[TCA_DSCD_RATE])
+		rate_config = nla_get_u64(tb[TCA_DSCD_RATE]);
+
+	if (tb[TCA_DSCD_TIME_GRANULARITY])
+		time_granularity = nla_get_u64(tb[TCA_DSCD_TIME_GRANULARITY]);
+	if (tb[TCA_DSCD_ESTIMATOR])
+		estimator = nla_get_u8(tb[TCA_DSCD_ESTIMATOR]);
+	if (tb[TCA_DSCD_EST_BATCH])
+		est_batch = nla_get_u32(tb[TCA_DSCD_EST_BATCH]);
+	if (tb[TCA_DSCD_EST_INTERVAL])
+		est_interval = nla_get_u64(tb[TCA_DSCD_EST_INTERVAL]);
+
+	if (!IS_ENABLED(CONFIG_BQL) && estimator == TC_DSCD_EST_BQL) {
+		NL_SET_ERR_MSG_MOD(extack, "the bql estimator requires CONFIG_BQL");
+		return -EOPNOTSUPP;
+	}
+	// the completions of sch->dev_queue must be those of this qdisc
+	if (estimator == TC_DSCD_EST_BQL &&
+	    ((sch->parent != TC_H_ROOT && !(sch->flags & TCQ_F_NOPARENT)) ||
+	     (!(sch->flags & TCQ_F_ONETXQUEUE) && qdisc_dev(sch)->real_num_tx_queues > 1))) {
+		NL_SET_ERR_MSG_MOD(extack, "the bql estimator needs DSCD as root of a single TX queue or dscd_mq");
+		return -EOPNOTSUPP;
+	}
+	// the max. of single packet samples is the max. burst, not the rate
+	if (estimator == TC_DSCD_EST_WINMAX && !est_interval && est_batch < EST_WINMAX_MIN_BATCH) {
+		NL_SET_ERR_MSG_MOD(extack, "the winmax estimator needs est_batch >= 16 or est_interval");
+		return -EINVAL;
+	}
+
+	if (shaping && rate_config == 0) {
+		NL_SET_ERR_MSG_MOD(extack, "shaping requires a configured rate C");
+		return -EINVAL;
+	}
+	// the cached time is refreshed by the coarse clock, which only advances once per tick
+	if (time_granularity && time_granularity < TICK_NSEC) {
+		NL_SET_ERR_MSG_MOD(extack, "time_granularity must be at least one timer tick");
+		return -EINVAL;
+	}
+	// lockless enqueuers can't share the cached clock, the watchdog needs the precise time
+	if (time_granularity && (lockless || shaping)) {
+		NL_SET_ERR_MSG_MOD(extack, "time_granularity can't be combined with lockless or shaping");
+		return -EINVAL;
+	}
+
+	if (lockless != q->lockless) {
+		// the stack picks the locking scheme of a qdisc per packet,
+		// so it must not change while packets are in flight
+		if (!create || !lockless) {
+			NL_SET_ERR_MSG_MOD(extack, "lockless can only be set when the qdisc is created");
+			return -EOPNOTSUPP;
+		}
+		// qdisc_graft() drops TCQ_F_NOLOCK below a parent with the qdisc lock
+		if (sch->parent != TC_H_ROOT && !(sch->flags & TCQ_F_NOPARENT)) {
+			NL_SET_ERR_MSG_MOD(extack, "lockless needs DSCD as root or dscd_mq qdisc");
+			return -EOPNOTSUPP;
+		}
+	}
+
+	// queued packets are hashed to their flows
+	if (flows_cnt != q->flows_cnt && !create) {
+		NL_SET_ERR_MSG_MOD(extack, "flows can only be set when the qdisc is created");
+		return -EOPNOTSUPP;
+	}
+	// the flows of the additional ABE classes share the minors from DSCD_XABE_FLOWS_MINOR
+	if ((num_classes - 2) * flows_cnt > DSCD_FLOWS_MAX) {
+		NL_SET_ERR_MSG_MOD(extack, "flows times the number of abe_class must not exceed 16384");
+		return -EINVAL;
+	}
+	if (check)
+		return 0;
+
+	// new flow queues for all classes at creation, otherwise only for the added classes
+	for (i = 0; i < num_classes && flows_cnt; i++) {
+		if (flows_cnt == q->flows_cnt && i < q->num_classes)
+			continue;
+		flows[i] = dscd_fq_flows_alloc(flows_cnt);
+		if (!flows[i]) {
+			err = -ENOMEM;
+			goto free_flows;
+		}
+	}
+
+	// added classes get their rate estimators, removed ones keep theirs until unlocked
+	if (class_rate_est) {
+		for (i = q->num_classes; i < num_classes; i++) {
+			err = dscd_new_estimators(&q->classes[i], dscd_rate_counters(q, i));
+			if (err)
+				goto free_flows;
+		}
+	}
+
+	if (lockless != q->lockless) {
+		err = skb_array_init(&q->staging,
+				     max_t(u32, qdisc_dev(sch)->tx_queue_len, STAGING_BATCH),
+				     GFP_KERNEL);
+		if (err)
+			goto free_flows;
+	}
+
+	nolock = dscd_lock(sch);
+
+	// the peeked packet was selected with the old classes and limits
+	q->peek_skb = NULL;
+
+	if (lockless != q->lockless) {
+		q->lockless = true;
+		sch->flags |= TCQ_F_NOLOCK;
+	}
+
+	if (num_classes < q->num_classes)
+		dscd_remove_classes(sch, q, num_classes);
+	for (i = q->num_classes; i < num_classes; i++)
+		dscd_add_class(q, i);
+
+	// flows_cnt only changes at creation, when the old flow queues are empty
+	for (i = 0; i < DSCD_MAX_CLASSES; i++) {
+		if (flows_cnt != q->flows_cnt || i >= min(num_classes, q->num_classes))
+			swap(q->classes[i].flows, flows[i]);
+	}
+	q->flows_cnt = flows_cnt;
+	q->num_classes = num_classes;
+	if (tb[TCA_DSCD_ABE_CLASSES]) {
+		for (i = 2; i < num_classes; i++)
+			dscd_configure_abe_class(&q->classes[i], ctb[i - 2]);
+	}
+	if (tb[TCA_DSCD_QUANTUM]) {
+		q->quantum = nla_get_u32(tb[TCA_DSCD_QUANTUM]);
+	}
+	if (tb[TCA_DSCD_ABE_DSCP]) {
+		WRITE_ONCE(q->classes[DSCD_ABE].dscp, nla_get_u64(tb[TCA_DSCD_ABE_DSCP]));
+	}
+	if (tb[TCA_DSCD_ABE_PRIO]) {
+		WRITE_ONCE(q->classes[DSCD_ABE].prio, nla_get_u16(tb[TCA_DSCD_ABE_PRIO]));
+	}
+	if (tb[TCA_DSCD_SPLIT_GSO]) {
+		q->split_gso = nla_get_u8(tb[TCA_DSCD_SPLIT_GSO]);
+	}
+	if (tb[TCA_DSCD_ECN]) {
+		q->ecn = nla_get_u8(tb[TCA_DSCD_ECN]);
+	}
+	q->est_batch = est_batch;
+	q->est_interval = est_interval;
+	if (estimator != q->estimator) {
+		// the estimators don't share the meaning of S_b / S_t, start over
+		q->estimator = estimator;
+		dscd_reset_estimator(sch, q);
+	}
+	if (time_granularity != q->time_granularity) {
+		// refresh the cached clock with the next packet, it must not go back in time
+		q->time_granularity = time_granularity;
+		q->clock = ktime_get_ns();
+		q->clock_coarse = ktime_get_coarse_ns() - time_granularity;
+	}
+	if (shaping != q->shaping) {
+		q->shaping = shaping;
+		q->time_next = 0;
+		if (!shaping)
+			qdisc_watchdog_cancel(&q->watchdog);
+	}
+
+	if (tb[TCA_DSCD_LIMIT]) {
+		sch->limit = nla_get_u32(tb[TCA_DSCD_LIMIT]);
+	}
+	if (tb[TCA_DSCD_RATE]) {
+		q->rate_config = nla_get_u64(tb[TCA_DSCD_RATE]);
+	}
+	if (tb[TCA_DSCD_CREDIT_HALF_LIFE]) {
+		q->credit_half_life = nla_get_u64(tb[TCA_DSCD_CREDIT_HALF_LIFE]);
+	}
+	if (tb[TCA_DSCD_RATE_MEMORY]) {
+		q->rate_memory = nla_get_u64(tb[TCA_DSCD_RATE_MEMORY]);
+	}
+	if (tb[TCA_DSCD_T_D]) {
+		q->classes[DSCD_ABE].T_d = nla_get_u64(tb[TCA_DSCD_T_D]);
+	}
+	if (tb[TCA_DSCD_T_Q]) {
+		q->classes[DSCD_ABE].T_q = nla_get_u64(tb[TCA_DSCD_T_Q]);
+	}
+	if (tb[TCA_DSCD_MEMORY_LIMIT]) {
+		q->memory_limit = nla_get_u32(tb[TCA_DSCD_MEMORY_LIMIT]);
+	}
+	if (tb[TCA_DSCD_PACKET_LIMIT]) {
+		q->packet_limit = nla_get_u32(tb[TCA_DSCD_PACKET_LIMIT]);
+	}
+	if (tb[TCA_DSCD_ABE_LIMIT]) {
+		q->classes[DSCD_ABE].limit = nla_get_u32(tb[TCA_DSCD_ABE_LIMIT]);
+	}
+	if (tb[TCA_DSCD_BE_LIMIT]) {
+		q->classes[DSCD_BE].limit = nla_get_u32(tb[TCA_DSCD_BE_LIMIT]);
+	}
+	if (tb[TCA_DSCD_OVERFLOW]) {
+		q->overflow = nla_get_u8(tb[TCA_DSCD_OVERFLOW]);
+	}
+
+	if (q->rate_config != 0) {
+		dscd_set_rate(q, dscd_configured_rate(q));
+	} else {
+		// derive the cached estimate again
+		q->C_ns_expires = 0;
+	}
+	dscd_update_reciprocals(q);
+	dscd_update_order(q);
+
+	dscd_unlock(sch, nolock);
+
+	// the flow queues replaced at creation or of the removed classes, which are unreachable now
+	for (i = 0; i < DSCD_MAX_CLASSES; i++) {
+		kvfree(flows[i]);
+		if (i >= num_classes)
+			dscd_kill_estimators(&q->classes[i]);
+	}
+	return 0;
+
+free_flows:
+	for (i = 0; i < DSCD_MAX_CLASSES; i++) {
+		kvfree(flows[i]);
+		if (i >= q->num_classes)
+			dscd_kill_estimators(&q->classes[i]);
+	}
+	return err;
+}
+
+static int dscd_change(struct Qdisc *sch, struct nlattr *opt,
+			 struct netlink_ext_ack *extack)
+{
+	return dscd_configure(sch, opt, extack, false, false);
+}
+
+// dump the additional ABE classes, an empty list if there are none, so that the dump
+// configures the same classes again, see dscd_mq_change()
+static int dscd_dump_abe_classes(struct dscd_sched_data *q, struct sk_buff *skb)
+{
+	struct nlattr *list, *entry;
+	struct dscd_class *cls;
+	int i;
+
+	list = nla_nest_start(skb, TCA_DSCD_ABE_CLASSES);
+	if (!list)
+		return -EMSGSIZE;
+
+	for (i = 2; i < q->num_classes; i++) {
+		cls = &q->classes[i];
+
+		entry = nla_nest_start(skb, TCA_DSCD_ABE_CLASS);
+		if (!entry ||
+		    nla_put_u64_64bit(skb, TCA_DSCD_ABE_CLASS_T_D, cls->T_d, TCA_DSCD_ABE_CLASS_PAD) ||
+		    nla_put_u64_64bit(skb, TCA_DSCD_ABE_CLASS_T_Q, cls->T_q, TCA_DSCD_ABE_CLASS_PAD) ||
+		    nla_put_u64_64bit(skb, TCA_DSCD_ABE_CLASS_DSCP, cls->dscp, TCA_DSCD_ABE_CLASS_PAD) ||
+		    nla_put_u16(skb, TCA_DSCD_ABE_CLASS_PRIO, cls->prio) ||
+		    nla_put_u32(skb, TCA_DSCD_ABE_CLASS_LIMIT, cls->limit)) {
+			nla_nest_cancel(skb, list);
+			return -EMSGSIZE;
+		}
+		nla_nest_end(skb, entry);
+	}
+
+	nla_nest_end(skb, list);
+	return 0;
+}
+
+static int dscd_dump(struct Qdisc *sch, struct sk_buff *skb)
+{
+	struct dscd_sched_data *q = qdisc_priv(sch);
+	struct dscd_class *abe = &q->classes[DSCD_ABE];
+	struct nlattr *opts;
+
+	opts = nla_nest_start(skb, TCA_OPTIONS);
+	if (!opts)
+		return -EMSGSIZE;
+
+	if (nla_put_u32(skb, TCA_DSCD_LIMIT, sch->limit) ||
+		nla_put_u64_64bit(skb, TCA_DSCD_RATE, q->rate_config, TCA_DSCD_PAD) ||
+		nla_put_u64_64bit(skb, TCA_DSCD_CREDIT_HALF_LIFE, q->credit_half_life, TCA_DSCD_PAD) ||
+		nla_put_u64_64bit(skb, TCA_DSCD_RATE_MEMORY, q->rate_memory, TCA_DSCD_PAD) ||
+	    nla_put_u64_64bit(skb, TCA_DSCD_T_D, abe->T_d, TCA_DSCD_PAD) ||
+	    nla_put_u64_64bit(skb, TCA_DSCD_T_Q, abe->T_q, TCA_DSCD_PAD) ||
+	    nla_put_u8(skb, TCA_DSCD_LOCKLESS, q->lockless) ||
+	    nla_put_u32(skb, TCA_DSCD_FLOWS, q->flows_cnt) ||
+	    nla_put_u32(skb, TCA_DSCD_QUANTUM, q->quantum) ||
+	    nla_put_u64_64bit(skb, TCA_DSCD_ABE_DSCP, abe->dscp, TCA_DSCD_PAD) ||
+	    nla_put_u16(skb, TCA_DSCD_ABE_PRIO, abe->prio) ||
+	    nla_put_u8(skb, TCA_DSCD_SHAPING, q->shaping) ||
+	    nla_put_u8(skb, TCA_DSCD_SPLIT_GSO, q->split_gso) ||
+	    nla_put_u64_64bit(skb, TCA_DSCD_TIME_GRANULARITY, q->time_granularity, TCA_DSCD_PAD) ||
+	    nla_put_u8(skb, TCA_DSCD_ECN, q->ecn) ||
+	    nla_put_u8(skb, TCA_DSCD_ESTIMATOR, q->estimator) ||
+	    nla_put_u32(skb, TCA_DSCD_EST_BATCH, q->est_batch) ||
+	    nla_put_u64_64bit(skb, TCA_DSCD_EST_INTERVAL, q->est_interval, TCA_DSCD_PAD) ||
+	    nla_put_u32(skb, TCA_DSCD_MEMORY_LIMIT, q->memory_limit) ||
+	    nla_put_u32(skb, TCA_DSCD_PACKET_LIMIT, q->packet_limit) ||
+	    nla_put_u32(skb, TCA_DSCD_ABE_LIMIT, abe->limit) ||
+	    nla_put_u32(skb, TCA_DSCD_BE_LIMIT, q->classes[DSCD_BE].limit) ||
+	    nla_put_u8(skb, TCA_DSCD_OVERFLOW, q->overflow) ||
+	    dscd_dump_abe_classes(q, skb))
+		goto nla_put_failure;
+
+	return nla_nest_end(skb, opts);
+
+nla_put_failure:
+	nla_nest_cancel(skb, opts);
+	return -EMSGSIZE;
+}
+
+
+// add a consistent snapshot of per CPU stats to stats
+static void dscd_fetch_class_stats(const struct dscd_pcpu_class_stats *pcpu,
+				   const struct u64_stats_sync *syncp,
+				   struct dscd_stats *stats)
+{
+	struct dscd_stats tmp;
+	unsigned int start;
+
+	do {
+		start = u64_stats_fetch_begin(syncp);
+		tmp.sum_delay_ns = u64_stats_read(&pcpu->sum_delay_ns);
+		tmp.received_pkts = u64_stats_read(&pcpu->received_pkts);
+		tmp.sent_pkts = u64_stats_read(&pcpu->sent_pkts);
+		tmp.sent_bytes = u64_stats_read(&pcpu->sent_bytes);
+		tmp.enqueue_drops = u64_stats_read(&pcpu->enqueue_drops);
+		tmp.dequeue_drops = u64_stats_read(&pcpu->dequeue_drops);
+		tmp.ecn_marks = u64_stats_read(&pcpu->ecn_marks);
+		tmp.pushout_drops = u64_stats_read(&pcpu->pushout_drops);
+	} while (u64_stats_fetch_retry(syncp, start));
+
+	stats->sum_delay_ns += tmp.sum_delay_ns;
+	stats->received_pkts += tmp.received_pkts;
+	stats->sent_pkts += tmp.sent_pkts;
+	stats->sent_bytes += tmp.sent_bytes;
+	stats->enqueue_drops += tmp.enqueue_drops;
+	stats->dequeue_drops += tmp.dequeue_drops;
+	stats->ecn_marks += tmp.ecn_marks;
+	stats->pushout_drops += tmp.pushout_drops;
+}
+
+// add a per CPU histogram to buckets, buckets are read one by one to keep the stack small
+static void dscd_fetch_hist(const u64_stats_t *pcpu, const struct u64_stats_sync *syncp,
+			    u64 *buckets)
+{
+	unsigned int start;
+	u64 val;
+	int i;
+
+	for (i = 0; i < TC_DSCD_HIST_BUCKETS; i++) {
+		do {
+			start = u64_stats_fetch_begin(syncp);
+			val = u64_stats_read(&pcpu[i]);
+		} while (u64_stats_fetch_retry(syncp, start));
+
+		buckets[i] += val;
+	}
+}
+
+// add the per CPU delay histograms of a class to buckets, including those before the last reset
+static void dscd_sum_raw_class_hist(struct dscd_sched_data *q, u8 idx, u64 *buckets)
+{
+	struct dscd_pcpu_stats *pcpu;
+	int cpu;
+
+	for_each_possible_cpu(cpu) {
+		pcpu = per_cpu_ptr(q->stats, cpu);
+		dscd_fetch_hist(pcpu->hist[idx], &pcpu->syncp, buckets);
+	}
+}
+
+// sum up the per CPU delay histograms of a class since the last reset
+static void dscd_sum_class_hist(struct dscd_sched_data *q, u8 idx, struct tc_dscd_delay_hist *hist)
+{
+	int i;
+
+	// the counters only grow, the difference can't underflow
+	for (i = 0; i < TC_DSCD_HIST_BUCKETS; i++)
+		hist->buckets[i] -= q->stats_base->hist[idx][i];
+	dscd_sum_raw_class_hist(q, idx, hist->buckets);
+}
+
+// sum up per CPU delay histograms, the ABE histogram is derived from all ABE classes,
+// the histogram of all packets from both
+static void dscd_sum_hist(struct dscd_sched_data *q, struct tc_dscd_xstats *st)
+{
+	struct dscd_class *cls;
+	int i;
+
+	for_each_class(q, cls)
+		dscd_sum_class_hist(q, cls->index, cls->abe ? &st->abe_hist : &st->be_hist);
+
+	for (i = 0; i < TC_DSCD_HIST_BUCKETS; i++)
+		st->all_hist.buckets[i] = st->abe_hist.buckets[i] + st->be_hist.buckets[i];
+}
+
+// add the per CPU stats of a class to stats, including those before the last reset
+static void dscd_sum_raw_class_stats(struct dscd_sched_data *q, u8 idx, struct dscd_stats *stats)
+{
+	struct dscd_pcpu_stats *st;
+	int cpu;
+
+	for_each_possible_cpu(cpu) {
+		st = per_cpu_ptr(q->stats, cpu);
+		dscd_fetch_class_stats(&st->cls_stats[idx], &st->syncp, stats);
+	}
+}
+
+static void dscd_add_stats(struct dscd_stats *sum, const struct dscd_stats *stats)
+{
+	sum->sum_delay_ns += stats->sum_delay_ns;
+	sum->received_pkts += stats->received_pkts;
+	sum->sent_pkts += stats->sent_pkts;
+	sum->sent_bytes += stats->sent_bytes;
+	sum->enqueue_drops += stats->enqueue_drops;
+	sum->dequeue_drops += stats->dequeue_drops;
+	sum->ecn_marks += stats->ecn_marks;
+	sum->pushout_drops += stats->pushout_drops;
+}
+
+static void dscd_sub_stats(struct dscd_stats *sum, const struct dscd_stats *stats)
+{
+	sum->sum_delay_ns -= stats->sum_delay_ns;
+	sum->received_pkts -= stats->received_pkts;
+	sum->sent_pkts -= stats->sent_pkts;
+	sum->sent_bytes -= stats->sent_bytes;
+	sum->enqueue_drops -= stats->enqueue_drops;
+	sum->dequeue_drops -= stats->dequeue_drops;
+	sum->ecn_marks -= stats->ecn_marks;
+	sum->pushout_drops -= stats->pushout_drops;
+}
+
+// sum up the per CPU stats of a class since the last reset
+static void dscd_sum_class_stats(struct dscd_sched_data *q, u8 idx, struct dscd_stats *stats)
+{
+	// the counters only grow, the difference can't underflow
+	dscd_sub_stats(stats, &q->stats_base->cls_stats[idx]);
+	dscd_sum_raw_class_stats(q, idx, stats);
+}
+
+// Start the stats of a class over. Lockless enqueuers may update their per CPU
+// stats concurrently, only the owning CPU writes them, so snapshot them instead.
+static void dscd_reset_class_stats(struct dscd_sched_data *q, u8 idx)
+{
+	struct dscd_stats_base *base = q->stats_base;
+
+	base->cls_stats[idx] = (struct dscd_stats) {};
+	memset(base->hist[idx], 0, sizeof(base->hist[idx]));
+	dscd_sum_raw_class_stats(q, idx, &base->cls_stats[idx]);
+	dscd_sum_raw_class_hist(q, idx, base->hist[idx]);
+}
+
+static void dscd_reset_stats(struct dscd_sched_data *q)
+{
+	int c;
+
+	for (c = 0; c < DSCD_MAX_CLASSES; c++)
+		dscd_reset_class_stats(q, c);
+}
+
+// sum up per CPU stats, abe_stats is derived from all ABE classes, all_stats from both
+static void dscd_sum_stats(struct dscd_sched_data *q, struct dscd_stats *abe_stats,
+			   struct dscd_stats *be_stats, struct dscd_stats *all_stats)
+{
+	struct dscd_class *cls;
+
+	*abe_stats = (struct dscd_stats) {};
+	*be_stats = (struct dscd_stats) {};
+	*all_stats = (struct dscd_stats) {};
+
+	for_each_class(q, cls)
+		dscd_sum_class_stats(q, cls->index, cls->abe ? abe_stats : be_stats);
+
+	dscd_add_stats(all_stats, abe_stats);
+	dscd_add_stats(all_stats, be_stats);
+}
+
+
+static void dscd_init_flow(struct dscd_flow *flow)
+{
+	flow->head = NULL;
+	flow->tail = NULL;
+	flow->len = 0;
+	flow->size = 0;
+}
+
+static void dscd_init_class(struct dscd_class *cls, u8 index)
+{
+	dscd_init_flow(&cls->fifo);
+	cls->flows = NULL;
+	INIT_LIST_HEAD(&cls->new_flows);
+	INIT_LIST_HEAD(&cls->old_flows);
+	cls->len = 0;
+	cls->size = 0;
+	cls->truesize = 0;
+	cls->index = index;
+	cls->abe = index != DSCD_BE;
+
+	cls->T_d = 10 * 1000 * 1000;	// 10 ms
+	cls->T_q = 1;
+	cls->limit = 0;
+	WRITE_ONCE(cls->dscp, 0);
+	WRITE_ONCE(cls->prio, 0);
+
+	cls->CC = 0;
+	cls->service_bytes = 0;
+}
+
+
+static int dscd_init(struct Qdisc *sch, struct nlattr *opt,
+		     struct netlink_ext_ack *extack)
+{
+	struct dscd_sched_data *q = qdisc_priv(sch);
+	int cpu, err, i;
+
+	qdisc_watchdog_init(&q->watchdog, sch);
+
+	q->credit_half_life = 100 * 1000 * 1000; 	// 100 ms
+	q->rate_memory = 100 * 1000 * 1000;			// 100 ms
+	q->rate_config = 0; 						// 0 = use bandwidth estimation
+	
+	dscd_set_rate(q, 0);
+	dscd_update_reciprocals(q);
+
+	q->shaping = false;
+	q->time_next = 0;
+	q->split_gso = false;
+	q->ecn = false;
+	q->memory_limit = 0;
+	q->packet_limit = 0;
+	q->overflow = TC_DSCD_OVERFLOW_TAIL;
+	q->skb_memory = 0;
+	q->limit_drops = 0;
+	q->time_granularity = 0;
+	q->clock = 0;
+	q->clock_coarse = 0;
+
+	for (i = 0; i < DSCD_MAX_CLASSES; i++)
+		dscd_init_class(&q->classes[i], i);
+	q->classes[DSCD_ABE].prio = BIT(TC_PRIO_INTERACTIVE);
+	q->num_classes = 2;
+	dscd_update_order(q);
+	q->flows_cnt = 0;
+	q->quantum = psched_mtu(qdisc_dev(sch));
+
+	q->block = NULL;
+
+	INIT_LIST_HEAD(&q->service_q);
+	INIT_LIST_HEAD(&q->service_spare);
+	q->service_len = 0;
+	q->service_runs = 0;
+	q->service_spare_chunks = 0;
+	q->service_chunks = 0;
+	q->service_alloc_fails = 0;
+
+	q->CC_cq = 0;
+
+	q->last_devaluation = 0;
+	q->last_exp_devaluation = 0;
+
+	q->estimator = TC_DSCD_EST_EWMA;
+	q->est_batch = 1;
+	q->est_interval = 0;
+	q->last_packet_dequeue = 0;
+	q->rate_updates = 0;
+	dscd_reset_estimator(sch, q);
+
+	q->lockless = false;
+	atomic64_set(&q->staging_drops, 0);
+	seqcount_spinlock_init(&q->state_seq, &sch->seqlock);
+
+	q->peek_skb = NULL;
+	q->peek_time = 0;
+
+	q->shared = NULL;
+	q->shared_slot = 0;
+
+	// the per CPU stats start at zero
+	q->stats = alloc_percpu(struct dscd_pcpu_stats);
+	q->stats_base = kzalloc(sizeof(*q->stats_base), GFP_KERNEL);
+	q->rates = __alloc_percpu(sizeof(*q->rates) * DSCD_MAX_CLASSES * DSCD_RATES,
+				  __alignof__(*q->rates));
+	if (!q->stats || !q->stats_base || !q->rates)
+		return -ENOMEM;
+
+	for_each_possible_cpu(cpu) {
+		u64_stats_init(&per_cpu_ptr(q->stats, cpu)->syncp);
+		for (i = 0; i < DSCD_MAX_CLASSES * DSCD_RATES; i++)
+			gnet_stats_basic_sync_init(per_cpu_ptr(q->rates + i, cpu));
+	}
+
+	// estimators of additional ABE classes are started by dscd_configure()
+	if (class_rate_est) {
+		for (i = 0; i < q->num_classes; i++) {
+			err = dscd_new_estimators(&q->classes[i], dscd_rate_counters(q, i));
+			if (err)
+				return err;
+		}
+	}
+
+	err = tcf_block_get(&q->block, &q->filter_list, sch, extack);
+	if (err)
+		return err;
+
+	sch->limit = qdisc_dev(sch)->tx_queue_len * psched_mtu(qdisc_dev(sch));
+
+	if (opt) {
+		err = dscd_configure(sch, opt, extack, true, false);
+
+		if (err)
+			return err;
+	}
+
+	return 0;
+}
+
+
+static void dscd_flow_purge(struct dscd_flow *flow)
+{
+	rtnl_kfree_skbs(flow->head, flow->tail);
+	dscd_init_flow(flow);
+}
+
+static void dscd_class_purge(struct dscd_sched_data *q, struct dscd_class *cls)
+{
+	u32 i;
+
+	dscd_flow_purge(&cls->fifo);
+
+	if (cls->flows) {
+		for (i = 0; i < q->flows_cnt; i++) {
+			dscd_flow_purge(&cls->flows[i].q);
+			list_del_init(&cls->flows[i].flowchain);
+			cls->flows[i].deficit = 0;
+		}
+	}
+
+	cls->len = 0;
+	cls->size = 0;
+	cls->truesize = 0;
+}
+
+// Drop the classes from index num_classes on, under the qdisc lock. Their service
+// entries are emptied in place, like by service_revoke(), and their credit is lost.
+static void dscd_remove_classes(struct Qdisc *sch, struct dscd_sched_data *q, u8 num_classes)
+{
+	unsigned int pkts = 0, bytes = 0;
+	struct service_chunk *chunk;
+	struct service_run *run;
+	struct dscd_class *cls;
+	u16 i;
+
+	list_for_each_entry(chunk, &q->service_q, chunkchain) {
+		for (i = chunk->head; i < chunk->tail; i++) {
+			run = &chunk->runs[i];
+			if (run->cls < num_classes)
+				continue;
+
+			q->service_len -= run->count;
+			q->CC_cq -= (u64)run->pkt_len * run->count;
+			run->count = 0;
+		}
+	}
+
+	// the packets of the removed classes count as dropped, like T_d drops, see dscd_drop_batch()
+	for (cls = q->classes + num_classes; cls < q->classes + q->num_classes; cls++) {
+		if (cls->len) {
+			DSCD_STAT_ADD(dequeue_drops, cls->index, cls->len);
+			DSCD_RATE_ADD(DSCD_RATE_DROPPED, cls->index, cls->size, cls->len);
+		}
+		pkts += cls->len;
+		bytes += cls->size;
+		q->skb_memory -= cls->truesize;
+		dscd_class_purge(q, cls);
+		cls->CC = 0;
+		cls->service_bytes = 0;
+	}
+
+	__qdisc_qstats_drop(sch, pkts);
+	sch->q.qlen -= pkts;
+	sch->qstats.backlog -= bytes;
+	qdisc_tree_reduce_backlog(sch, pkts, bytes);
+}
+
+// set up the class at index idx with the defaults, its stats start over
+static void dscd_add_class(struct dscd_sched_data *q, u8 idx)
+{
+	dscd_init_class(&q->classes[idx], idx);
+	dscd_reset_class_stats(q, idx);
+}
+
+
+// Reset - will be called before destroy or ip link set DEV down
+static inline void dscd_reset(struct Qdisc *sch)
+{
+	struct dscd_sched_data *q = qdisc_priv(sch);
+	struct dscd_class *cls;
+
+	for_each_class(q, cls) {
+		dscd_class_purge(q, cls);
+		cls->CC = 0;
+	}
+
+	if (q->lockless)
+		dscd_staging_purge(q);
+
+	service_queue_purge(q);
+
+	q->peek_skb = NULL;
+	q->time_next = 0;
+	qdisc_watchdog_cancel(&q->watchdog);
+	q->service_alloc_fails = 0;
+	q->skb_memory = 0;
+	q->limit_drops = 0;
+	q->last_devaluation = 0;
+	q->last_exp_devaluation = 0;
+
+	dscd_reset_estimator(sch, q);
+	if (q->rate_config == 0)
+		dscd_set_rate(q, 0);
+	q->rate_updates = 0;
+
+	dscd_reset_stats(q);
+}
+
+
+static void dscd_destroy(struct Qdisc *sch)
+{
+	struct dscd_sched_data *q = qdisc_priv(sch);
+	int i;
+
+	qdisc_watchdog_cancel(&q->watchdog);
+	tcf_block_put(q->block);
+	for (i = 0; i < DSCD_MAX_CLASSES; i++)
+		dscd_kill_estimators(&q->classes[i]);
+
+	service_queue_purge(q);
+
+	for (i = 0; i < DSCD_MAX_CLASSES; i++)
+		kvfree(q->classes[i].flows);
+
+	if (q->lockless)
+		skb_array_cleanup(&q->staging);
+
+	if (q->shared)
+		dscd_mq_detach(q);
+
+	free_percpu(q->stats);
+	free_percpu(q->rates);
+	kfree(q->stats_base);
+}
+
+
+// add the current rates of a class to rates, zero without estimators
+static void dscd_read_rates(struct dscd_class *cls, struct tc_dscd_class_rates *rates)
+{
+	struct tc_dscd_rate_est *dst[DSCD_RATES] = {
+		[DSCD_RATE_RECEIVED]	= &rates->received,
+		[DSCD_RATE_SENT]		= &rates->sent,
+		[DSCD_RATE_DROPPED]		= &rates->dropped,
+	};
+	struct gnet_stats_rate_est64 sample;
+	int i;
+
+	for (i = 0; i < DSCD_RATES; i++) {
+		if (!gen_estimator_read(&cls->rate_est[i], &sample))
+			continue;
+		dst[i]->bps += sample.bps;
+		dst[i]->pps += sample.pps;
+	}
+}
+
+// Fill the queue and estimator state of the DSCD stats, which the dequeue side changes
+static void dscd_fill_state(struct dscd_sched_data *q, struct tc_dscd_xstats *st)
+{
+	struct tc_dscd_q_stats *qst;
+	struct dscd_class *cls;
+
+	st->C = dscd_rate(q);
+	st->S_b = q->S_b;
+	st->S_t = q->S_t;
+	st->est_stats = (struct tc_dscd_est_stats) {
+		.estimator		= dscd_estimator(q),
+		.updates		= q->rate_updates,
+		.sample_packets	= q->sample_pkts,
+		.sample_bytes	= q->sample_bytes,
+		.sample_time	= q->sample_time,
+		.window_max		= (u64)minmax_get(&q->rate_max) << EST_WINMAX_SHIFT,
+	};
+	st->pool_stats = (struct tc_dscd_pool_stats) {
+		.allocated		= q->service_chunks,
+		.alloc_fails	= q->service_alloc_fails,
+		.runs			= q->service_runs,
+		.spare			= q->service_spare_chunks,
+		.chunk_size		= sizeof(struct service_chunk),
+	};
+	st->memory_stats = (struct tc_dscd_memory_stats) {
+		.used			= dscd_memory_usage(q),
+		.limit_drops	= q->limit_drops,
+	};
+
+	st->abe_q_stats = (struct tc_dscd_q_stats) {};
+	st->be_q_stats = (struct tc_dscd_q_stats) {};
+	for_each_class(q, cls) {
+		qst = cls->abe ? &st->abe_q_stats : &st->be_q_stats;
+		qst->length += cls->len;
+		qst->credit += class_credit_bytes(cls);
+	}
+	st->service_q_stats.length = q->service_len;
+	st->service_q_stats.credit = service_credit_bytes(q);
+}
+
+// Fill the per CPU counters of the DSCD stats, the state is left zero
+static void dscd_fill_xstats(struct dscd_sched_data *q, struct tc_dscd_xstats *st)
+{
+	struct dscd_stats abe_stats, be_stats, all_stats;
+	struct tc_dscd_class_stats *cst;
+	struct dscd_stats *cl;
+	struct dscd_class *cls;
+	int i;
+
+	*st = (struct tc_dscd_xstats) {};
+
+#define PUT_STAT(field, val) do { \
+		cst->field = cl->val; \
+} while (0)
+
+#define PUT_CLASS_STATS(block, field) do { \
+		cst = &st->field; \
+		cl = &field; \
+		block \
+} while (0)
+
+	dscd_sum_stats(q, &abe_stats, &be_stats, &all_stats);
+	dscd_sum_hist(q, st);
+
+	for_each_class(q, cls)
+		dscd_read_rates(cls, cls->abe ? &st->abe_rates : &st->be_rates);
+	// tc_dscd_class_rates only consists of __u64 rates
+	for (i = 0; i < sizeof(st->all_rates) / sizeof(__u64); i++)
+		((__u64 *)&st->all_rates)[i] = ((__u64 *)&st->abe_rates)[i] +
+					       ((__u64 *)&st->be_rates)[i];
+
+#define PUT_ALL_CLASS_STATS(block) do { \
+		PUT_CLASS_STATS(block, abe_stats); \
+		PUT_CLASS_STATS(block, be_stats); \
+		PUT_CLASS_STATS(block, all_stats); \
+} while (0)
+
+	PUT_ALL_CLASS_STATS({
+		PUT_STAT(sum_delay, sum_delay_ns);
+		PUT_STAT(received_packets, received_pkts);
+		PUT_STAT(sent_packets, sent_pkts);
+		PUT_STAT(enqueue_drops, enqueue_drops);
+		PUT_STAT(dequeue_drops, dequeue_drops);
+		PUT_STAT(ecn_marks, ecn_marks);
+		PUT_STAT(pushout_drops, pushout_drops);
+	});
+
+#undef PUT_STAT
+#undef PUT_CLASS_STATS
+#undef PUT_ALL_CLASS_STATS
+}
+
+// Fill the class xstats of cls, but the queue state, see dscd_read_class_state()
+static void dscd_fill_class_xstats(struct dscd_sched_data *q, struct dscd_class *cls,
+				   struct tc_dscd_class_xstats *st)
+{
+	struct dscd_stats stats = {};
+
+	*st = (struct tc_dscd_class_xstats) {
+		.abe	= cls->abe,
+		.T_d	= cls->abe ? cls->T_d : 0,
+		.T_q	= cls->abe ? cls->T_q : 0,
+	};
+
+	dscd_sum_class_stats(q, cls->index, &stats);
+	st->stats = (struct tc_dscd_class_stats) {
+		.sum_delay			= stats.sum_delay_ns,
+		.received_packets	= stats.received_pkts,
+		.sent_packets		= stats.sent_pkts,
+		.enqueue_drops		= stats.enqueue_drops,
+		.dequeue_drops		= stats.dequeue_drops,
+		.ecn_marks			= stats.ecn_marks,
+		.pushout_drops		= stats.pushout_drops,
+	};
+
+	dscd_read_rates(cls, &st->rates);
+	dscd_sum_class_hist(q, cls->index, &st->hist);
+}
+
+// Fill DSCD stats, the qdisc lock must be held. A lockless dequeue only holds
+// the seqlock, which must not be taken inside the qdisc lock, so the state is
+// read again until no dequeue ran in between, see dscd_dequeue().
+static void dscd_read_xstats(struct Qdisc *sch, struct tc_dscd_xstats *st)
+{
+	struct dscd_sched_data *q = qdisc_priv(sch);
+	unsigned int seq;
+
+	dscd_fill_xstats(q, st);
+	do {
+		seq = read_seqcount_begin(&q->state_seq);
+		dscd_fill_state(q, st);
+	} while (read_seqcount_retry(&q->state_seq, seq));
+}
+
+// the queue state of cls or flow for dscd_dump_class_stats(), like dscd_read_xstats()
+static void dscd_read_class_state(struct dscd_sched_data *q, struct dscd_class *cls,
+				  struct dscd_fq_flow *flow, struct gnet_stats_queue *qs,
+				  struct tc_dscd_q_stats *q_stats)
+{
+	unsigned int seq;
+
+	do {
+		seq = read_seqcount_begin(&q->state_seq);
+		if (cls) {
+			qs->qlen = cls->len;
+			qs->backlog = cls->size;
+			q_stats->length = cls->len;
+			q_stats->credit = class_credit_bytes(cls);
+		} else if (flow) {
+			qs->qlen = flow->q.len;
+			qs->backlog = flow->q.size;
+		}
+	} while (read_seqcount_retry(&q->state_seq, seq));
+}
+
+// Dump Qdisc/DSCD stats
+static int dscd_dump_stats(struct Qdisc *sch, struct gnet_dump *d)
+{
+	struct tc_dscd_xstats *st;
+	int err;
+
+	// too large for the stack with the delay histograms, called under the root lock
+	st = kmalloc(sizeof(*st), GFP_ATOMIC);
+	if (!st)
+		return -ENOMEM;
+
+	dscd_read_xstats(sch, st);
+	err = gnet_stats_copy_app(d, st, sizeof(*st));
+
+	kfree(st);
+	return err;
+}
+
+
+/* ********** Class Ops ********** */
+
+// the ABE and BE class have the minors DSCD_ABE_MINOR and DSCD_BE_MINOR, the additional
+// ABE classes follow, tc filters and skb->priority select them by these class ids
+static struct dscd_class *dscd_class_find(struct dscd_sched_data *q, unsigned long cl)
+{
+	if (cl == 0 || cl > q->num_classes)
+		return NULL;
+	return &q->classes[cl - 1];
+}
+
+// in flow queuing mode every flow queue is a class as well, so that its backlog can be dumped,
+// ABE flow i has minor DSCD_ABE_FLOWS_MINOR + i, BE flow i has minor DSCD_BE_FLOWS_MINOR + i,
+// flow i of the additional ABE class with index c has DSCD_XABE_FLOWS_MINOR + (c - 2) * flows + i
+static unsigned long dscd_fq_flow_minor(struct dscd_sched_data *q, struct dscd_class *cls, u32 idx)
+{
+	switch (cls->index) {
+	case DSCD_ABE:
+		return DSCD_ABE_FLOWS_MINOR + idx;
+	case DSCD_BE:
+		return DSCD_BE_FLOWS_MINOR + idx;
+	default:
+		return DSCD_XABE_FLOWS_MINOR + (cls->index - 2) * q->flows_cnt + idx;
+	}
+}
+
+// class of the flow queue with minor cl and the index of the flow in *idx, NULL for other minors
+static struct dscd_class *dscd_fq_flow_class(struct dscd_sched_data *q, unsigned long cl, u32 *idx)
+{
+	struct dscd_class *cls;
+
+	*idx = cl & (DSCD_FLOWS_MAX - 1);
+
+	switch (cl & ~(unsigned long)(DSCD_FLOWS_MAX - 1)) {
+	case DSCD_ABE_FLOWS_MINOR:
+		cls = &q->classes[DSCD_ABE];
+		break;
+	case DSCD_BE_FLOWS_MINOR:
+		cls = &q->classes[DSCD_BE];
+		break;
+	case DSCD_XABE_FLOWS_MINOR:
+		if (!q->flows_cnt || 2 + *idx / q->flows_cnt >= q->num_classes)
+			return NULL;
+		cls = &q->classes[2 + *idx / q->flows_cnt];
+		*idx %= q->flows_cnt;
+		break;
+	default:
+		return NULL;
+	}
+
+	if (!cls->flows || *idx >= q->flows_cnt)
+		return NULL;
+
+	return cls;
+}
+
+static struct dscd_fq_flow *dscd_fq_flow_find(struct dscd_sched_data *q, unsigned long cl)
+{
+	struct dscd_class *cls;
+	u32 idx;
+
+	cls = dscd_fq_flow_class(q, cl, &idx);
+	return cls ? &cls->flows[idx] : NULL;
+}
+
+static struct Qdisc *dscd_leaf(struct Qdisc *sch, unsigned long arg)
+{
+	return NULL;
+}
+
+static unsigned long dscd_find(struct Qdisc *sch, u32 classid)
+{
+	struct dscd_sched_data *q = qdisc_priv(sch);
+	unsigned long cl = TC_H_MIN(classid);
+
+	if (dscd_class_find(q, cl) || dscd_fq_flow_find(q, cl))
+		return cl;
+	return 0;
+}
+
+static unsigned long dscd_bind(struct Qdisc *sch, unsigned long parent,
+			       u32 classid)
 {
-	struct dscd_sched_data *q = qdisc_priv(sch);
-	struct nlattr *tb[TCA_DSCD_MAX + 1];
-	int err;
+	return dscd_find(sch, classid);
+}
 
-	if (!opt)
-		return -EINVAL;
+static void dscd_unbind(struct Qdisc *sch, unsigned long cl)
+{
+}
 
-	err = nla_parse_nested(tb, TCA_DSCD_MAX, opt, dscd_policy, extack);
-	if (err < 0)
-		return err;
+// filters can only be attached to the qdisc itself
+static struct tcf_block *dscd_tcf_block(struct Qdisc *sch, unsigned long cl,
+					struct netlink_ext_ack *extack)
+{
+	struct dscd_sched_data *q = qdisc_priv(sch);
 
-	sch_tree_lock(sch);
+	if (cl)
+		return NULL;
+	return q->block;
+}
 
-	if (tb[TCA_DSCD_LIMIT]) {
-		sch->limit = nla_get_u32(tb[TCA_DSCD_LIMIT]);
-	}
-	if (tb[TCA_DSCD_RATE]) {
-		q->rate_config = nla_get_u64(tb[TCA_DSCD_RATE]);
-	}
-	if (tb[TCA_DSCD_CREDIT_HALF_LIFE]) {
-		q->credit_half_life = nla_get_u64(tb[TCA_DSCD_CREDIT_HALF_LIFE]);
-	}
-	if (tb[TCA_DSCD_RATE_MEMORY]) {
-		q->rate_memory = nla_get_u64(tb[TCA_DSCD_RATE_MEMORY]);
-	}
-	if (tb[TCA_DSCD_T_D]) {
-		q->T_d = nla_get_u64(tb[TCA_DSCD_T_D]);
-	}
-	if (tb[TCA_DSCD_T_Q]) {
-		q->T_q = nla_get_u64(tb[TCA_DSCD_T_Q]);
-	}
+static int dscd_dump_class(struct Qdisc *sch, unsigned long cl,
+			   struct sk_buff *skb, struct tcmsg *tcm)
+{
+	struct dscd_sched_data *q = qdisc_priv(sch);
+	struct dscd_class *cls;
+	u32 idx;
 
-	if (q->rate_config != 0) {
-		q->C = q->rate_config;
-	}
+	// flow queues are children of their class
+	cls = dscd_fq_flow_class(q, cl, &idx);
+	if (cls)
+		tcm->tcm_parent = TC_H_MAKE(sch->handle, class_minor(cls));
 
-	sch_tree_unlock(sch);
+	tcm->tcm_handle |= TC_H_MIN(cl);
 	return 0;
 }
 
-static int dscd_dump(struct Qdisc *sch, struct sk_buff *skb)
+static int dscd_dump_class_stats(struct Qdisc *sch, unsigned long cl,
+				 struct gnet_dump *d)
 {
 	struct dscd_sched_data *q = qdisc_priv(sch);
-	struct nlattr *opts;
+	struct dscd_class *cls = dscd_class_find(q, cl);
+	struct dscd_fq_flow *flow = dscd_fq_flow_find(q, cl);
+	struct tc_dscd_class_xstats *xstats = NULL;
+	struct gnet_stats_basic_sync bstats;
+	struct gnet_stats_queue qs = { 0 };
+	struct tc_dscd_q_stats q_stats = {};
+	struct dscd_stats stats = {};
+	int err = -1;
+
+	gnet_stats_basic_sync_init(&bstats);
+	dscd_read_class_state(q, cls, flow, &qs, &q_stats);
+
+	if (cls) {
+		dscd_sum_class_stats(q, cls->index, &stats);
+
+		u64_stats_set(&bstats.bytes, stats.sent_bytes);
+		u64_stats_set(&bstats.packets, stats.sent_pkts);
+		qs.drops = stats.enqueue_drops + stats.dequeue_drops + stats.pushout_drops;
+	}
 
-	opts = nla_nest_start(skb, TCA_OPTIONS);
-	if (!opts)
-		return -EMSGSIZE;
+	if (gnet_stats_copy_basic(d, NULL, &bstats, true) < 0 ||
+	    (cls && gnet_stats_copy_rate_est(d, &cls->rate_est[DSCD_RATE_SENT]) < 0) ||
+	    gnet_stats_copy_queue(d, NULL, &qs, qs.qlen) < 0)
+		return -1;
 
-	if (nla_put_u32(skb, TCA_DSCD_LIMIT, sch->limit) ||
-		nla_put_u64_64bit(skb, TCA_DSCD_RATE, q->rate_config, TCA_DSCD_PAD) ||
-		nla_put_u64_64bit(skb, TCA_DSCD_CREDIT_HALF_LIFE, q->credit_half_life, TCA_DSCD_PAD) ||
-		nla_put_u64_64bit(skb, TCA_DSCD_RATE_MEMORY, q->rate_memory, TCA_DSCD_PAD) ||
-	    nla_put_u64_64bit(skb, TCA_DSCD_T_D, q->T_d, TCA_DSCD_PAD) ||
-	    nla_put_u64_64bit(skb, TCA_DSCD_T_Q, q->T_q, TCA_DSCD_PAD))
-		goto nla_put_failure;
+	if (!cls)
+		return 0;
 
-	return nla_nest_end(skb, opts);
+	// too large for the stack with the delay histogram, called under the root lock
+	xstats = kmalloc(sizeof(*xstats), GFP_ATOMIC);
+	if (!xstats)
+		return -1;
 
-nla_put_failure:
-	nla_nest_cancel(skb, opts);
-	return -EMSGSIZE;
-}
+	dscd_fill_class_xstats(q, cls, xstats);
+	xstats->q_stats = q_stats;
+
+	if (gnet_stats_copy_app(d, xstats, sizeof(*xstats)) >= 0)
+		err = 0;
 
+	kfree(xstats);
+	return err;
+}
 
-static void dscd_init_stats(struct dscd_stats *stats)
+// the classes, then the active flows like in fq_codel
+static void dscd_walk(struct Qdisc *sch, struct qdisc_walker *arg)
 {
-	stats->sum_delay_ns = 0;
-	stats->received_pkts = 0;
-	stats->sent_pkts = 0;
-	stats->enqueue_drops = 0;
-	stats->dequeue_drops = 0;
+	struct dscd_sched_data *q = qdisc_priv(sch);
+	struct dscd_class *cls;
+	u32 i;
+
+	if (arg->stop)
+		return;
+
+	for (i = 0; i < q->num_classes; i++)
+		if (!tc_qdisc_stats_dump(sch, i + 1, arg))
+			return;
+
+	for_each_class(q, cls) {
+		for (i = 0; i < q->flows_cnt; i++) {
+			if (list_empty(&cls->flows[i].flowchain)) {
+				arg->count++;
+				continue;
+			}
+			if (!tc_qdisc_stats_dump(sch, dscd_fq_flow_minor(q, cls, i), arg))
+				return;
+		}
+	}
 }
 
+static const struct Qdisc_class_ops dscd_class_ops = {
+	.leaf		= dscd_leaf,
+	.find		= dscd_find,
+	.walk		= dscd_walk,
+	.tcf_block	= dscd_tcf_block,
+	.bind_tcf	= dscd_bind,
+	.unbind_tcf	= dscd_unbind,
+	.dump		= dscd_dump_class,
+	.dump_stats	= dscd_dump_class_stats,
+};
+
 
-static void dscd_init_flow(struct dscd_flow *flow)
+struct Qdisc_ops qdisc_ops __read_mostly = {
+	.cl_ops		= &dscd_class_ops,
+	.id			= "dscd",
+	.priv_size	= sizeof(struct dscd_sched_data),
+	.enqueue	= dscd_enqueue,
+	.dequeue	= dscd_dequeue,
+	.peek		= dscd_peek,
+	.init		= dscd_init,
+	.reset		= dscd_reset,
+	.change		= dscd_change,
+	.destroy	= dscd_destroy,
+	.dump		= dscd_dump,
+	.dump_stats	= dscd_dump_stats,
+	.owner		= THIS_MODULE,
+};
+
+
+/* ********** Multiqueue DSCD (dscd_mq) ********** */
+
+// dscd_mq works like mq: it creates one DSCD instance per TX queue, which
+// runs under the lock of its own TX queue. The instances only share their
+// rate estimates through struct dscd_mq_shared, every instance writes its
+// own cache line and reads the others only for the linear credit decay while
+// it is idle, see dscd_mq_rate(). Credit stays per instance, it is tied to
+// the service queue of that TX queue.
+
+struct dscd_mq_sched_data {
+	struct Qdisc **qdiscs;			// instances until attach, then owned by the TX queues
+	struct dscd_mq_shared *shared;
+};
+
+static struct netdev_queue *dscd_mq_queue_get(struct Qdisc *sch, unsigned long cl)
 {
-	flow->head = NULL;
-	flow->tail = NULL;
-	flow->len = 0;
-	flow->size = 0;
+	struct net_device *dev = qdisc_dev(sch);
+	unsigned long ntx = cl - 1;
+
+	if (ntx >= dev->num_tx_queues)
+		return NULL;
+	return netdev_get_tx_queue(dev, ntx);
 }
 
+static inline struct Qdisc *dscd_mq_child(struct Qdisc *sch, unsigned int ntx)
+{
+	return rtnl_dereference(netdev_get_tx_queue(qdisc_dev(sch), ntx)->qdisc_sleeping);
+}
 
-static int dscd_init(struct Qdisc *sch, struct nlattr *opt,
-		     struct netlink_ext_ack *extack)
+static void dscd_mq_destroy(struct Qdisc *sch)
 {
-	struct dscd_sched_data *q = qdisc_priv(sch);
-	int err;
+	struct net_device *dev = qdisc_dev(sch);
+	struct dscd_mq_sched_data *priv = qdisc_priv(sch);
+	unsigned int ntx;
+
+	if (priv->qdiscs) {
+		for (ntx = 0; ntx < dev->num_tx_queues && priv->qdiscs[ntx]; ntx++)
+			qdisc_put(priv->qdiscs[ntx]);
+		kfree(priv->qdiscs);
+		priv->qdiscs = NULL;
+	}
 
-	q->T_d = 10 * 1000 * 1000;  				// 10 ms
-	q->credit_half_life = 100 * 1000 * 1000; 	// 100 ms
-	q->rate_memory = 100 * 1000 * 1000;			// 100 ms
-	q->rate_config = 0; 						// 0 = use bandwidth estimation
-	q->T_q = 1;
-	
-	q->C = 0;
+	if (priv->shared) {
+		dscd_mq_shared_put(priv->shared);
+		priv->shared = NULL;
+	}
+}
 
-	dscd_init_flow(&q->abe_flow);
-	dscd_init_flow(&q->be_flow);
+static int dscd_mq_init(struct Qdisc *sch, struct nlattr *opt,
+			struct netlink_ext_ack *extack)
+{
+	struct net_device *dev = qdisc_dev(sch);
+	struct dscd_mq_sched_data *priv = qdisc_priv(sch);
+	struct netdev_queue *dev_queue;
+	struct Qdisc *qdisc;
+	unsigned int ntx;
+	int err;
 
-	INIT_LIST_HEAD(&q->service_q);
-	q->service_len = 0;
+	if (sch->parent != TC_H_ROOT)
+		return -EOPNOTSUPP;
 
-	q->CC_cq = 0;
-	q->CC_abe = 0;
-	q->CC_be = 0;
+	if (!netif_is_multiqueue(dev))
+		return -EOPNOTSUPP;
 
-	q->last_devaluation = 0;
-	q->last_exp_devaluation = 0;
+	priv->shared = dscd_mq_shared_new(dev->num_tx_queues, dev->real_num_tx_queues);
+	if (!priv->shared)
+		return -ENOMEM;
 
-	q->S_b = 0;
-	q->S_t = 0;
-	q->last_rate_update = 0;
-	q->last_packet_size = 0;
-	q->last_packet_dequeue = 0;
-	q->backlogged = false;
+	priv->qdiscs = kcalloc(dev->num_tx_queues, sizeof(priv->qdiscs[0]), GFP_KERNEL);
+	if (!priv->qdiscs)
+		return -ENOMEM;
 
-	sch->limit = qdisc_dev(sch)->tx_queue_len * psched_mtu(qdisc_dev(sch));
+	for (ntx = 0; ntx < dev->num_tx_queues; ntx++) {
+		dev_queue = netdev_get_tx_queue(dev, ntx);
+		qdisc = qdisc_create_dflt(dev_queue, &qdisc_ops,
+					  TC_H_MAKE(TC_H_MAJ(sch->handle), TC_H_MIN(ntx + 1)),
+					  extack);
+		if (!qdisc)
+			return -ENOMEM;
 
-	if (opt) {
-		err = dscd_change(sch, opt, extack);
+		priv->qdiscs[ntx] = qdisc;
+		qdisc->flags |= TCQ_F_ONETXQUEUE | TCQ_F_NOPARENT;
 
-		if (err)
-			return err;
-	}
+		dscd_mq_attach_instance(qdisc, priv->shared, ntx);
 
-	dscd_init_stats(&q->abe_stats);
-	dscd_init_stats(&q->be_stats);
-	dscd_init_stats(&q->all_stats);
+		if (opt) {
+			err = dscd_configure(qdisc, opt, extack, true, false);
+			if (err)
+				return err;
+		}
+	}
 
+	sch->flags |= TCQ_F_MQROOT;
 	return 0;
 }
 
+static void dscd_mq_attach(struct Qdisc *sch)
+{
+	struct net_device *dev = qdisc_dev(sch);
+	struct dscd_mq_sched_data *priv = qdisc_priv(sch);
+	struct Qdisc *qdisc, *old;
+	unsigned int ntx;
+
+	for (ntx = 0; ntx < dev->num_tx_queues; ntx++) {
+		qdisc = priv->qdiscs[ntx];
+		old = dev_graft_qdisc(qdisc->dev_queue, qdisc);
+		if (old)
+			qdisc_put(old);
+		if (ntx < dev->real_num_tx_queues)
+			qdisc_hash_add(qdisc, false);
+	}
+
+	kfree(priv->qdiscs);
+	priv->qdiscs = NULL;
+}
 
-static void dscd_flow_purge(struct dscd_flow *flow)
+// the configured rate is split between the active TX queues, see dscd_configured_rate()
+static void dscd_mq_change_real_num_tx(struct Qdisc *sch, unsigned int new_real_tx)
 {
-	rtnl_kfree_skbs(flow->head, flow->tail);
-	flow->head = NULL;
+	struct dscd_mq_sched_data *priv = qdisc_priv(sch);
+	struct net_device *dev = qdisc_dev(sch);
+	struct dscd_sched_data *q;
+	struct Qdisc *qdisc;
+	unsigned int ntx;
+	bool nolock;
+
+	WRITE_ONCE(priv->shared->real_num_tx, new_real_tx);
+
+	for (ntx = 0; ntx < dev->num_tx_queues; ntx++) {
+		qdisc = dscd_mq_child(sch, ntx);
+		if (qdisc->ops != &qdisc_ops)
+			continue;
+
+		q = qdisc_priv(qdisc);
+		if (q->rate_config == 0)
+			continue;
+
+		nolock = dscd_lock(qdisc);
+		dscd_set_rate(q, dscd_configured_rate(q));
+		dscd_unlock(qdisc, nolock);
+	}
 }
 
+// reconfigure the TX queues from ntx on with the options dumped from old
+static void dscd_mq_restore(struct Qdisc *sch, struct Qdisc *old, unsigned int ntx)
+{
+	struct Qdisc *qdisc;
+	struct sk_buff *skb;
+
+	skb = alloc_skb(NLMSG_GOODSIZE, GFP_KERNEL);
+	if (!skb || dscd_dump(old, skb) < 0)
+		goto fail;
+
+	while (ntx-- > 0) {
+		qdisc = dscd_mq_child(sch, ntx);
+		if (qdisc->ops == &qdisc_ops &&
+		    dscd_configure(qdisc, (struct nlattr *)skb->data, NULL, false, false))
+			goto fail;
+	}
+
+	kfree_skb(skb);
+	return;
 
-// Reset - will be called before destroy or ip link set DEV down
-static inline void dscd_reset(struct Qdisc *sch)
+fail:
+	kfree_skb(skb);
+	net_warn_ratelimited("dscd_mq: TX queues of %s left with different configurations\n",
+			     qdisc_dev(sch)->name);
+}
+
+// all instances share the configuration, so the options are checked against every one of
+// them first, only failed allocations can still stop the change in between
+static int dscd_mq_change(struct Qdisc *sch, struct nlattr *opt,
+			  struct netlink_ext_ack *extack)
 {
-	struct dscd_sched_data *q = qdisc_priv(sch);
-	struct service_element *service_element, *service_next;
+	struct net_device *dev = qdisc_dev(sch);
+	struct Qdisc *qdisc;
+	unsigned int ntx;
+	int err;
 
-	dscd_flow_purge(&q->abe_flow);
-	dscd_flow_purge(&q->be_flow);
+	for (ntx = 0; ntx < dev->num_tx_queues; ntx++) {
+		qdisc = dscd_mq_child(sch, ntx);
+		if (qdisc->ops != &qdisc_ops)
+			continue;
 
-	list_for_each_entry_safe(service_element, service_next, &q->service_q, servicechain) {
-		__list_del_entry(&service_element->servicechain);
-		service_element_free(service_element);
+		err = dscd_configure(qdisc, opt, extack, false, true);
+		if (err)
+			return err;
 	}
 
-	q->service_len = 0;
-	q->CC_abe = 0;
-	q->CC_be = 0;
-	q->CC_cq = 0;
-	q->last_devaluation = 0;
-	q->last_exp_devaluation = 0;
-
-	q->S_t = 0;
-	q->S_b = 0;
-	if (q->rate_config == 0)
-		q->C = 0;
+	for (ntx = 0; ntx < dev->num_tx_queues; ntx++) {
+		qdisc = dscd_mq_child(sch, ntx);
+		if (qdisc->ops != &qdisc_ops)
+			continue;
 
-	q->last_rate_update = 0;
-	q->backlogged = false;
-	q->last_packet_size = 0;
+		// the failed instance is unchanged, it has the old options of all
+		err = dscd_change(qdisc, opt, extack);
+		if (err) {
+			dscd_mq_restore(sch, qdisc, ntx);
+			return err;
+		}
+	}
 
-	dscd_init_stats(&q->abe_stats);
-	dscd_init_stats(&q->be_stats);
-	dscd_init_stats(&q->all_stats);
+	return 0;
 }
 
+static int dscd_mq_dump(struct Qdisc *sch, struct sk_buff *skb)
+{
+	struct net_device *dev = qdisc_dev(sch);
+	struct Qdisc *qdisc, *config = NULL;
+	unsigned int ntx;
 
-static void dscd_destroy(struct Qdisc *sch)
+	sch->q.qlen = 0;
+	gnet_stats_basic_sync_init(&sch->bstats);
+	memset(&sch->qstats, 0, sizeof(sch->qstats));
+
+	for (ntx = 0; ntx < dev->num_tx_queues; ntx++) {
+		qdisc = dscd_mq_child(sch, ntx);
+
+		spin_lock_bh(qdisc_lock(qdisc));
+		gnet_stats_add_basic(&sch->bstats, qdisc->cpu_bstats, &qdisc->bstats, false);
+		gnet_stats_add_queue(&sch->qstats, qdisc->cpu_qstats, &qdisc->qstats);
+		sch->q.qlen += qdisc_qlen(qdisc);
+		spin_unlock_bh(qdisc_lock(qdisc));
+
+		if (!config && qdisc->ops == &qdisc_ops)
+			config = qdisc;
+	}
+
+	// all instances are configured together, report the first one
+	if (config)
+		return dscd_dump(config, skb);
+
+	return 0;
+}
+
+// Dump the sum of the DSCD stats of all TX queues
+static int dscd_mq_dump_stats(struct Qdisc *sch, struct gnet_dump *d)
 {
-	struct dscd_sched_data *q = qdisc_priv(sch);
-	struct service_element *service_element, *service_next;
+	struct net_device *dev = qdisc_dev(sch);
+	struct tc_dscd_xstats *st, *qst;
+	struct Qdisc *qdisc;
+	unsigned int ntx, i;
+	__u64 *sum, *add;
+	int err;
+
+	// tc_dscd_xstats only consists of __u64 counters
+	BUILD_BUG_ON(sizeof(*st) % sizeof(__u64));
+
+	st = kcalloc(2, sizeof(*st), GFP_ATOMIC);
+	if (!st)
+		return -ENOMEM;
+	qst = st + 1;
+	sum = (__u64 *)st;
+	add = (__u64 *)qst;
+
+	for (ntx = 0; ntx < dev->num_tx_queues; ntx++) {
+		qdisc = dscd_mq_child(sch, ntx);
+		if (qdisc->ops != &qdisc_ops)
+			continue;
 
-	// empty service queue, without credit accounting
-	list_for_each_entry_safe(service_element, service_next, &q->service_q, servicechain) {
-		__list_del_entry(&service_element->servicechain);
-		service_element_free(service_element);
+		spin_lock_bh(qdisc_lock(qdisc));
+		dscd_read_xstats(qdisc, qst);
+		spin_unlock_bh(qdisc_lock(qdisc));
+
+		for (i = 0; i < sizeof(*st) / sizeof(__u64); i++)
+			sum[i] += add[i];
 	}
+
+	// S_b / S_t are the EWMA state of each instance, their sums are no rate,
+	// report the sum of the rates over one second, like winmax does
+	st->S_b = st->C;
+	st->S_t = st->C ? NSEC_PER_SEC : 0;
+
+	// not counters, all instances share the configuration
+	st->pool_stats.chunk_size = sizeof(struct service_chunk);
+	st->est_stats.estimator = qst->est_stats.estimator;
+	err = gnet_stats_copy_app(d, st, sizeof(*st));
+
+	kfree(st);
+	return err;
 }
 
+static struct netdev_queue *dscd_mq_select_queue(struct Qdisc *sch,
+						 struct tcmsg *tcm)
+{
+	return dscd_mq_queue_get(sch, TC_H_MIN(tcm->tcm_parent));
+}
 
-// Dump Qdisc/DSCD stats
-static int dscd_dump_stats(struct Qdisc *sch, struct gnet_dump *d)
+static int dscd_mq_graft(struct Qdisc *sch, unsigned long cl, struct Qdisc *new,
+			 struct Qdisc **old, struct netlink_ext_ack *extack)
 {
-	struct dscd_sched_data *q = qdisc_priv(sch);
-	struct tc_dscd_xstats st = {
-		.C		= q->C,
-		.S_b	= q->S_b,
-		.S_t	= q->S_t,
-	};
+	struct dscd_mq_sched_data *priv = qdisc_priv(sch);
+	struct netdev_queue *dev_queue = dscd_mq_queue_get(sch, cl);
+	struct net_device *dev = qdisc_dev(sch);
 
-	struct tc_dscd_class_stats *cst;
-	struct tc_dscd_q_stats *qst;
-	struct dscd_stats *cl;
-	struct dscd_flow *flow;
-	u64 credit;
+	if (dev->flags & IFF_UP)
+		dev_deactivate(dev);
 
-#define PUT_STAT(field, val) do { \
-		cst->field = cl->val; \
-} while (0)
+	*old = dev_graft_qdisc(dev_queue, new);
+	if (new) {
+		new->flags |= TCQ_F_ONETXQUEUE | TCQ_F_NOPARENT;
 
-#define PUT_CLASS_STATS(block, field) do { \
-		cst = &st.field; \
-		cl = &q->field; \
-		block \
-} while (0)
+		if (new->ops == &qdisc_ops)
+			dscd_mq_attach_instance(new, priv->shared, cl - 1);
+	}
 
-#define PUT_ALL_CLASS_STATS(block) do { \
-		PUT_CLASS_STATS(block, abe_stats); \
-		PUT_CLASS_STATS(block, be_stats); \
-		PUT_CLASS_STATS(block, all_stats); \
-} while (0)
+	if (dev->flags & IFF_UP)
+		dev_activate(dev);
 
-	PUT_ALL_CLASS_STATS({
-		PUT_STAT(sum_delay, sum_delay_ns);
-		PUT_STAT(received_packets, received_pkts);
-		PUT_STAT(sent_packets, sent_pkts);
-		PUT_STAT(enqueue_drops, enqueue_drops);
-		PUT_STAT(dequeue_drops, dequeue_drops);
-	});
+	return 0;
+}
 
-#undef PUT_STAT
-#undef PUT_CLASS_STATS
-#undef PUT_ALL_CLASS_STATS
+static struct Qdisc *dscd_mq_leaf(struct Qdisc *sch, unsigned long cl)
+{
+	struct netdev_queue *dev_queue = dscd_mq_queue_get(sch, cl);
 
+	return rtnl_dereference(dev_queue->qdisc_sleeping);
+}
 
-#define PUT_QUEUE(field, src) do { \
-		qst->field = src; \
-} while (0)
+static unsigned long dscd_mq_find(struct Qdisc *sch, u32 classid)
+{
+	unsigned int ntx = TC_H_MIN(classid);
 
-#define PUT_QUEUE_LIST(block, target, field, creditfield) do { \
-		qst = &st.target; \
-		credit = q-> creditfield; \
-		block \
-} while (0)
+	if (!dscd_mq_queue_get(sch, ntx))
+		return 0;
+	return ntx;
+}
 
-#define PUT_QUEUE_FLOW(block, target, field, creditexpr) do { \
-		qst = &st.target; \
-		flow = &q-> field; \
-		credit = creditexpr; \
-		block \
-} while (0)
+static int dscd_mq_dump_class(struct Qdisc *sch, unsigned long cl,
+			      struct sk_buff *skb, struct tcmsg *tcm)
+{
+	struct netdev_queue *dev_queue = dscd_mq_queue_get(sch, cl);
 
-#define PUT_QUEUES(block_list, block_flow) do { \
-		PUT_QUEUE_FLOW(block_flow, abe_q_stats, abe_flow, abe_credit_bytes(q)); \
-		PUT_QUEUE_FLOW(block_flow, be_q_stats, be_flow, q->CC_be); \
-		PUT_QUEUE_LIST(block_list, service_q_stats, service_q, CC_cq); \
-} while (0)
+	tcm->tcm_parent = TC_H_ROOT;
+	tcm->tcm_handle |= TC_H_MIN(cl);
+	tcm->tcm_info = rtnl_dereference(dev_queue->qdisc_sleeping)->handle;
+	return 0;
+}
 
-	PUT_QUEUES({
-		PUT_QUEUE(length, q->service_len);
-		PUT_QUEUE(credit, credit);
-	}, {
-		PUT_QUEUE(length, flow->len);
-		PUT_QUEUE(credit, credit);
-	});
+static int dscd_mq_dump_class_stats(struct Qdisc *sch, unsigned long cl,
+				    struct gnet_dump *d)
+{
+	struct netdev_queue *dev_queue = dscd_mq_queue_get(sch, cl);
+
+	sch = rtnl_dereference(dev_queue->qdisc_sleeping);
+	if (gnet_stats_copy_basic(d, sch->cpu_bstats, &sch->bstats, true) < 0 ||
+	    qdisc_qstats_copy(d, sch) < 0)
+		return -1;
+	return 0;
+}
+
+static void dscd_mq_walk(struct Qdisc *sch, struct qdisc_walker *arg)
+{
+	struct net_device *dev = qdisc_dev(sch);
+	unsigned int ntx;
 
-#undef PUT_QUEUE
-#undef PUT_QUEUE_FLOW
-#undef PUT_QUEUE_LIST
-#undef PUT_QUEUES
+	if (arg->stop)
+		return;
 
-	return gnet_stats_copy_app(d, &st, sizeof(st));
+	arg->count = arg->skip;
+	for (ntx = arg->skip; ntx < dev->num_tx_queues; ntx++) {
+		if (!tc_qdisc_stats_dump(sch, ntx + 1, arg))
+			break;
+	}
 }
 
+static const struct Qdisc_class_ops dscd_mq_class_ops = {
+	.select_queue	= dscd_mq_select_queue,
+	.graft			= dscd_mq_graft,
+	.leaf			= dscd_mq_leaf,
+	.find			= dscd_mq_find,
+	.walk			= dscd_mq_walk,
+	.dump			= dscd_mq_dump_class,
+	.dump_stats		= dscd_mq_dump_class_stats,
+};
 
-struct Qdisc_ops qdisc_ops __read_mostly = {
-	.id			= "dscd",
-	.priv_size	= sizeof(struct dscd_sched_data),
-	.enqueue	= dscd_enqueue,
-	.dequeue	= dscd_dequeue,
-	.peek		= qdisc_peek_dequeued,
-	.init		= dscd_init,
-	.reset		= dscd_reset,
-	.change		= dscd_change,
-	.destroy	= dscd_destroy,
-	.dump		= dscd_dump,
-	.dump_stats	= dscd_dump_stats,
+struct Qdisc_ops dscd_mq_qdisc_ops __read_mostly = {
+	.cl_ops		= &dscd_mq_class_ops,
+	.id			= "dscd_mq",
+	.priv_size	= sizeof(struct dscd_mq_sched_data),
+	.init		= dscd_mq_init,
+	.destroy	= dscd_mq_destroy,
+	.attach		= dscd_mq_attach,
+	.change		= dscd_mq_change,
+	.change_real_num_tx	= dscd_mq_change_real_num_tx,
+	.dump		= dscd_mq_dump,
+	.dump_stats	= dscd_mq_dump_stats,
 	.owner		= THIS_MODULE,
 };
 
@@ -797,12 +3847,43 @@ MODULE_DESCRIPTION("DSCD scheduler module");
 MODULE_VERSION("1.0");
 
 static int __init sch_dscd_init(void) {
-    return register_qdisc(&qdisc_ops);
+	int err;
+
+	// one dedicated cache keeps service chunks off the general kmalloc slabs
+	dscd_service_cache = kmem_cache_create("dscd_service_chunk",
+			sizeof(struct service_chunk), 0, SLAB_HWCACHE_ALIGN, NULL);
+	if (!dscd_service_cache)
+		return -ENOMEM;
+
+	// the class index is stored in struct service_run
+	BUILD_BUG_ON(DSCD_MAX_CLASSES > 1 << SERVICE_RUN_CLASS_BITS);
+
+	err = register_qdisc(&qdisc_ops);
+	if (err)
+		goto err_cache;
+
+	err = register_qdisc(&dscd_mq_qdisc_ops);
+	if (err)
+		goto err_qdisc;
+
+	return 0;
+
+err_qdisc:
+	unregister_qdisc(&qdisc_ops);
+err_cache:
+	kmem_cache_destroy(dscd_service_cache);
+	return err;
 }
 
 static void __exit sch_dscd_exit(void) {
-    unregister_qdisc(&qdisc_ops);
+	unregister_qdisc(&dscd_mq_qdisc_ops);
+	unregister_qdisc(&qdisc_ops);
+	kmem_cache_destroy(dscd_service_cache);
 }
 
 module_init(sch_dscd_init);
 module_exit(sch_dscd_exit);
+
+#ifdef DSCD_KUNIT_TEST
+#include "sch_dscd_test.c"
+#endif
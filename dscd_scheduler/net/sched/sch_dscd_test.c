@@ -0,0 +1,801 @@
+// SPDX-License-Identifier: GPL-2.0
+// KUnit tests and microbenchmarks of sch_dscd, built with DSCD_KUNIT=1 (see Makefile).
+// Included at the end of sch_dscd.c to reach its static helpers, the suite runs
+// when the module is loaded into a kernel with CONFIG_KUNIT.
+
+#include <kunit/test.h>
+#include <linux/timex.h>
+#include <linux/etherdevice.h>
+#include <linux/rtnetlink.h>
+#include <linux/tcp.h>
+
+#if !IS_ENABLED(CONFIG_KUNIT)
+#error "DSCD_KUNIT=1 needs a kernel with CONFIG_KUNIT"
+#endif
+
+/* ********** Benchmark Helpers ********** */
+
+// calls per measurement, preemption stays off for a few ms
+#define DSCD_BENCH_CALLS	(1 << 20)
+
+static u64 dscd_bench_sink;
+
+static void dscd_bench_report(struct kunit *test, const char *name, u64 ns, u64 cycles)
+{
+	u64 c = div_u64(cycles * 100, DSCD_BENCH_CALLS);
+
+	// get_cycles() is 0 on architectures without a cycle counter
+	kunit_info(test, "%s: %llu ps, %llu.%02llu cycles per call\n", name,
+		   div_u64(ns * 1000, DSCD_BENCH_CALLS), div_u64(c, 100), c % 100);
+}
+
+// time DSCD_BENCH_CALLS evaluations of expr, which may depend on i
+#define DSCD_BENCH(test, name, expr) do { \
+		u64 __sum = 0, __ns; \
+		cycles_t __cycles; \
+		u32 i; \
+		preempt_disable(); \
+		__cycles = get_cycles(); \
+		__ns = ktime_get_ns(); \
+		for (i = 0; i < DSCD_BENCH_CALLS; i++) \
+			__sum += (expr); \
+		/* the loop must not sink past the clock reads */ \
+		barrier_data(&__sum); \
+		__ns = ktime_get_ns() - __ns; \
+		__cycles = get_cycles() - __cycles; \
+		preempt_enable(); \
+		WRITE_ONCE(dscd_bench_sink, __sum); \
+		dscd_bench_report(test, name, __ns, __cycles); \
+} while (0)
+
+// pseudo random exponent for n_pow2(.., 20) with an integer part below 16
+static inline u64 dscd_bench_y(u32 i)
+{
+	return ((u64)i * 0x9e3779b1U) & ((16ULL << 20) - 1);
+}
+
+
+/* ********** Devaluate Credit ********** */
+
+// ln(2) in Q62
+#define DSCD_TEST_LN2	0x2c5c85fdf473de6aULL
+
+// exact reference: 2^-f in Q62 for f in [0, 1] in Q62, Taylor series of e^(-f ln 2)
+static u64 dscd_test_exp2(u64 f)
+{
+	u64 x = mul_u64_u64_shr(f, DSCD_TEST_LN2, 62);
+	u64 term = 1ULL << 62, pos = term, neg = 0;
+	u32 k;
+
+	// x < 1, the terms fall below 2^-62 after 25 steps
+	for (k = 1; term && k < 32; k++) {
+		term = div_u64(mul_u64_u64_shr(term, x, 62), k);
+		if (k & 1)
+			neg += term;
+		else
+			pos += term;
+	}
+	return pos - neg;
+}
+
+// the reference of n_pow2(2^62, y, 20)
+static u64 dscd_test_n_pow2_ref(u64 y)
+{
+	return dscd_test_exp2((y & ((1ULL << 20) - 1)) << (62 - 20)) >> (y >> 20);
+}
+
+// the n_pow2() of the initial implementation, a piecewise linear approximation
+static u64 n_pow2_baseline(u64 n, u64 y, u64 s)
+{
+	// z ~= 0.44 ~= 4096/9219
+	if (y * 9219 <= (u64)1 << (s + 12)) {
+		return n - div_u64(n * y >> (s - 12), 5909);
+	} else {
+		u64 y_unscaled = y >> s;
+
+		if (y_unscaled >= 20)
+			return 0;
+
+		return (n * (2 + y_unscaled) - ((n * y) >> s)) >> (1 + y_unscaled);
+	}
+}
+
+// every entry is the rounded 2^(-i / 2^EXP2_TAB_BITS) in Q31 within 1 ulp,
+// with the exact difference to the next one, which is 1/2 after the last entry
+static void dscd_test_exp2_tab(struct kunit *test)
+{
+	u64 ref, next;
+	u32 i;
+
+	for (i = 0; i < 1 << EXP2_TAB_BITS; i++) {
+		ref = dscd_test_exp2((u64)i << (62 - EXP2_TAB_BITS));
+		ref = (ref + (1ULL << (61 - EXP2_TAB_SHIFT))) >> (62 - EXP2_TAB_SHIFT);
+		next = i + 1 < 1 << EXP2_TAB_BITS ? exp2_tab[i + 1] >> 32 : 1ULL << (EXP2_TAB_SHIFT - 1);
+
+		KUNIT_EXPECT_LE_MSG(test, abs_diff(exp2_tab[i] >> 32, ref), 1ULL, "exp2_tab[%u]", i);
+		KUNIT_EXPECT_EQ_MSG(test, exp2_tab[i] & U32_MAX, (exp2_tab[i] >> 32) - next,
+				    "exp2_tab[%u]", i);
+	}
+}
+
+// the relative error stays below 1e-6 over the whole range of n_pow2()
+static void dscd_test_n_pow2_error(struct kunit *test)
+{
+	u64 y, ref, err, max_err_ppb = 0;
+
+	for (y = 0; y < (u64)(64 - EXP2_TAB_SHIFT) << 20; y += 997) {
+		ref = dscd_test_n_pow2_ref(y);
+		err = abs_diff(n_pow2(1ULL << 62, y, 20), ref);
+
+		KUNIT_EXPECT_LE_MSG(test, err * 1000000, ref, "y = %llu", y);
+		max_err_ppb = max(max_err_ppb, div64_u64(err * 1000000000, ref));
+	}
+
+	kunit_info(test, "max. relative error: %llu ppb\n", max_err_ppb);
+}
+
+// integer exponents are exact shifts
+static void dscd_test_n_pow2_exact(struct kunit *test)
+{
+	static const u64 n[] = { 1, 1000, (1ULL << 40) + 12345, U64_MAX };
+	u32 i, k;
+
+	for (i = 0; i < ARRAY_SIZE(n); i++)
+		for (k = 0; k < 64 - EXP2_TAB_SHIFT; k++)
+			KUNIT_EXPECT_EQ(test, n_pow2(n[i], (u64)k << 20, 20), n[i] >> k);
+}
+
+// the decay never increases credit with a longer time
+static void dscd_test_n_pow2_monotonic(struct kunit *test)
+{
+	u64 y, prev = U64_MAX, cur;
+
+	for (y = 0; y < (u64)(64 - EXP2_TAB_SHIFT) << 20; y += 61) {
+		cur = n_pow2(1ULL << 40, y, 20);
+		KUNIT_ASSERT_LE_MSG(test, cur, prev, "y = %llu", y);
+		prev = cur;
+	}
+}
+
+// exponents beyond the table shifts decay everything
+static void dscd_test_n_pow2_range(struct kunit *test)
+{
+	KUNIT_EXPECT_EQ(test, n_pow2(U64_MAX, (u64)(64 - EXP2_TAB_SHIFT) << 20, 20), 0ULL);
+	KUNIT_EXPECT_EQ(test, n_pow2(U64_MAX, U64_MAX, 20), 0ULL);
+	KUNIT_EXPECT_EQ(test, n_pow2(0, 12345, 20), 0ULL);
+}
+
+static void dscd_bench_n_pow2(struct kunit *test)
+{
+	DSCD_BENCH(test, "n_pow2", n_pow2(U32_MAX, dscd_bench_y(i), 20));
+	DSCD_BENCH(test, "n_pow2 (baseline)", n_pow2_baseline(U32_MAX, dscd_bench_y(i), 20));
+}
+
+
+/* ********** Timekeeping ********** */
+
+// relative error in ppb of the decayed credit against 2^-(elapsed / half life)
+static u64 dscd_test_decay_error(u64 cc0, u64 cc, u64 elapsed, u64 half_life)
+{
+	u64 y = div64_u64(elapsed << 20, half_life);
+	u64 ref = mul_u64_u64_shr(cc0, dscd_test_exp2((y & ((1ULL << 20) - 1)) << 42), 62) >> (y >> 20);
+
+	return mul_u64_u64_div_u64(abs_diff(cc, ref), 1000000000, max(ref, 1ULL));
+}
+
+// The exponential decay of a busy queue, once per packet 10 us apart or collected
+// over time_granularity. Every decay truncates its exponent to 2^-20 half lives,
+// so many short decays lose more than a few collected ones.
+static void dscd_test_granularity_decay(struct kunit *test)
+{
+	static const u64 granularity[] = { 0, TICK_NSEC, 10 * NSEC_PER_MSEC, 100 * NSEC_PER_MSEC };
+	struct dscd_sched_data *q = kunit_kzalloc(test, sizeof(*q), GFP_KERNEL);
+	const u64 cc0 = 1ULL << 50, start = NSEC_PER_SEC;
+	u64 now, err;
+	u32 i;
+
+	KUNIT_ASSERT_NOT_ERR_OR_NULL(test, q);
+
+	q->num_classes = 2;
+	q->num_abe = 1;
+	q->abe_order[0] = DSCD_ABE;
+	q->credit_half_life = NSEC_PER_SEC;
+	q->rate_memory = 50 * NSEC_PER_MSEC;
+	dscd_update_reciprocals(q);
+
+	for (i = 0; i < ARRAY_SIZE(granularity); i++) {
+		q->time_granularity = granularity[i];
+		q->classes[DSCD_ABE].CC = cc0;
+		q->last_exp_devaluation = 0;
+		exp_decay(q, start);
+
+		for (now = start; now <= start + 3 * NSEC_PER_SEC; now += 10 * NSEC_PER_USEC)
+			exp_decay(q, now);
+
+		err = dscd_test_decay_error(cc0, q->classes[DSCD_ABE].CC,
+					    q->last_exp_devaluation - start, q->credit_half_life);
+		kunit_info(test, "time_granularity %llu ns: relative error %llu ppb after 3 half lives\n",
+			   granularity[i], err);
+		if (granularity[i]) {
+			KUNIT_EXPECT_LE(test, err, 1000000ULL);
+		} else {
+			// per packet, 10 us are 10.49 2^-20 half lives, truncated to 10. 3 half lives
+			// lose 0.139 of a half life, 2^0.139 - 1 = 10.1%. The interpolation adds
+			// about 9 ppb per short decay, 0.27% over the 300000 decays.
+			KUNIT_EXPECT_LE(test, err, 110000000ULL);
+		}
+	}
+}
+
+// the clock reads saved by time_granularity
+static void dscd_bench_dscd_now(struct kunit *test)
+{
+	struct dscd_sched_data *q = kunit_kzalloc(test, sizeof(*q), GFP_KERNEL);
+
+	KUNIT_ASSERT_NOT_ERR_OR_NULL(test, q);
+
+	DSCD_BENCH(test, "dscd_now (time_granularity 0)", dscd_now(q));
+
+	q->time_granularity = TICK_NSEC;
+	DSCD_BENCH(test, "dscd_now (time_granularity 1 tick)", dscd_now(q));
+	DSCD_BENCH(test, "ktime_get_coarse_ns", ktime_get_coarse_ns());
+}
+
+
+/* ********** Reciprocals ********** */
+
+// the reciprocals match the divisions of the DSCD_DIVIDE variant
+static void dscd_test_reciprocals(struct kunit *test)
+{
+	static const u64 half_life[] = { 1000, NSEC_PER_MSEC, 100 * NSEC_PER_MSEC, NSEC_PER_SEC, 60 * NSEC_PER_SEC };
+	struct dscd_sched_data *q = kunit_kzalloc(test, sizeof(*q), GFP_KERNEL);
+	u64 diff, ref, got;
+	u32 i;
+
+	KUNIT_ASSERT_NOT_ERR_OR_NULL(test, q);
+
+	for (i = 0; i < ARRAY_SIZE(half_life); i++) {
+		q->credit_half_life = half_life[i];
+		q->rate_memory = half_life[i];
+		dscd_update_reciprocals(q);
+
+		// up to 32 half lives, n_pow2() decays everything beyond
+		for (diff = 1; diff < 32 * half_life[i]; diff = diff * 3 + 1) {
+			ref = div64_u64(diff << 20, half_life[i]);
+			got = mul_u64_u64_shr(diff, q->credit_half_life_recip, RECIP_SHIFT);
+			// the truncated reciprocal is at most 1 ulp short per 2^RECIP_SHIFT
+			KUNIT_EXPECT_LE_MSG(test, ref - got, (ref >> 20) + 1, "half life %llu, diff %llu", half_life[i], diff);
+			KUNIT_EXPECT_LE(test, got, ref);
+
+			ref = div64_u64(diff * 5909 << 8, half_life[i]);
+			got = mul_u64_u64_shr(diff, q->rate_memory_recip, RECIP_SHIFT);
+			KUNIT_EXPECT_LE_MSG(test, ref - got, (ref >> 20) + 1, "rate memory %llu, diff %llu", half_life[i], diff);
+			KUNIT_EXPECT_LE(test, got, ref);
+		}
+	}
+}
+
+// the cached estimate decays the same credit as the division by the rate
+static void dscd_test_rate_bytes(struct kunit *test)
+{
+	struct dscd_sched_data *q = kunit_kzalloc(test, sizeof(*q), GFP_KERNEL);
+	u64 diff, ref;
+
+	KUNIT_ASSERT_NOT_ERR_OR_NULL(test, q);
+
+	// 12.5 MB/s, estimated
+	q->S_b = 12500000;
+	q->S_t = NSEC_PER_SEC;
+	for (diff = 1; diff < 10 * NSEC_PER_SEC; diff = diff * 3 + 1) {
+		ref = mul_u64_u64_div_u64(diff, 12500000, NSEC_PER_SEC);
+		KUNIT_EXPECT_LE_MSG(test, abs_diff(rate_bytes(q, diff, 1), ref), (ref >> 20) + 1, "diff %llu", diff);
+	}
+
+	// a rate update invalidates the cached estimate
+	q->S_b = 125000000;
+	q->C_ns_expires = 0;
+	KUNIT_EXPECT_LE(test, abs_diff(rate_bytes(q, NSEC_PER_MSEC, 2), 125000ULL), 1ULL);
+
+	// configured rate
+	q->rate_config = 1250000;
+	dscd_set_rate(q, q->rate_config);
+	KUNIT_EXPECT_LE(test, abs_diff(rate_bytes(q, NSEC_PER_SEC, 3), 1250000ULL), 1ULL);
+}
+
+// the hot path helpers of this build, and both forms of them for comparison
+static void dscd_bench_reciprocals(struct kunit *test)
+{
+	struct dscd_sched_data *q = kunit_kzalloc(test, sizeof(*q), GFP_KERNEL);
+
+	KUNIT_ASSERT_NOT_ERR_OR_NULL(test, q);
+
+	q->credit_half_life = NSEC_PER_SEC;
+	q->rate_memory = 50 * NSEC_PER_MSEC;
+	q->S_b = 12500000;
+	q->S_t = NSEC_PER_SEC;
+	dscd_update_reciprocals(q);
+
+#ifdef DSCD_DIVIDE
+	kunit_info(test, "variant: DSCD_DIVIDE\n");
+#else
+	kunit_info(test, "variant: reciprocals\n");
+#endif
+	DSCD_BENCH(test, "credit_decay_exponent", credit_decay_exponent(q, i * 1009ULL));
+	DSCD_BENCH(test, "rate_decay_exponent", rate_decay_exponent(q, i * 1009ULL));
+	DSCD_BENCH(test, "rate_bytes (estimate)", rate_bytes(q, i * 1009ULL, 1));
+
+	q->rate_config = 12500000;
+	dscd_set_rate(q, q->rate_config);
+	DSCD_BENCH(test, "rate_bytes (configured)", rate_bytes(q, i * 1009ULL, 1));
+
+	DSCD_BENCH(test, "div64_u64", div64_u64((i * 1009ULL) << 20, q->credit_half_life));
+	DSCD_BENCH(test, "mul_u64_u64_div_u64", mul_u64_u64_div_u64(i * 1009ULL, q->C, NSEC_PER_SEC));
+	DSCD_BENCH(test, "mul_u64_u64_shr", mul_u64_u64_shr(i * 1009ULL, q->C_ns, RATE_NS_SHIFT));
+}
+
+
+/* ********** T_d Drops ********** */
+
+// ABE packets exceeding T_d at once, the worst case of a single dequeue
+#define DSCD_BENCH_DROPS	(1024)
+#define DSCD_BENCH_ROUNDS	(8)
+
+// a DSCD root qdisc on an unregistered Ethernet device
+static struct Qdisc *dscd_test_qdisc_create(struct kunit *test, struct net_device **dev)
+{
+	struct dscd_sched_data *q;
+	struct Qdisc *sch;
+
+	*dev = alloc_netdev(0, "dscdtest%d", NET_NAME_UNKNOWN, ether_setup);
+	KUNIT_ASSERT_NOT_ERR_OR_NULL(test, *dev);
+
+	rtnl_lock();
+	sch = qdisc_create_dflt(netdev_get_tx_queue(*dev, 0), &qdisc_ops, TC_H_ROOT, NULL);
+	rtnl_unlock();
+	if (!sch)
+		free_netdev(*dev);
+	KUNIT_ASSERT_NOT_ERR_OR_NULL(test, sch);
+
+	// every queued ABE packet exceeds T_d by the next dequeue
+	q = qdisc_priv(sch);
+	sch->limit = U32_MAX;
+	q->classes[DSCD_ABE].T_d = 1;
+	q->classes[DSCD_ABE].T_q = 0;
+	return sch;
+}
+
+static void dscd_test_qdisc_destroy(struct Qdisc *sch, struct net_device *dev)
+{
+	// qdisc_reset() reduces the backlog of the parents, which needs the RTNL
+	rtnl_lock();
+	spin_lock_bh(qdisc_lock(sch));
+	qdisc_reset(sch);
+	spin_unlock_bh(qdisc_lock(sch));
+	qdisc_put(sch);
+	rtnl_unlock();
+	free_netdev(dev);
+}
+
+// enqueue a packet of len bytes, ABE or BE by skb->priority
+static int dscd_test_enqueue(struct kunit *test, struct Qdisc *sch, unsigned int len, bool abe)
+{
+	struct sk_buff *skb, *to_free = NULL;
+	int ret;
+
+	skb = alloc_skb(len, GFP_KERNEL);
+	KUNIT_ASSERT_NOT_NULL(test, skb);
+	skb_put(skb, len);
+	skb->priority = abe ? TC_PRIO_INTERACTIVE : TC_PRIO_BESTEFFORT;
+	qdisc_skb_cb(skb)->pkt_len = skb->len;
+
+	spin_lock_bh(qdisc_lock(sch));
+	ret = sch->enqueue(skb, sch, &to_free);
+	spin_unlock_bh(qdisc_lock(sch));
+
+	kfree_skb_list(to_free);
+	return ret;
+}
+
+// enqueue n ABE packets of 1000 bytes
+static void dscd_test_fill_abe(struct kunit *test, struct Qdisc *sch, u32 n)
+{
+	u32 i;
+
+	for (i = 0; i < n; i++)
+		dscd_test_enqueue(test, sch, 1000, true);
+
+	KUNIT_ASSERT_EQ(test, sch->q.qlen, n);
+}
+
+// the T_d drops before batching, the qdisc tree and the stats are updated per packet
+static void dscd_drop_expired_per_packet(struct Qdisc *sch, struct dscd_sched_data *q,
+					 struct dscd_class *cls, u64 now)
+{
+	struct sk_buff *skb;
+	unsigned int len;
+
+	while (abe_drop_pending(cls, now)) {
+		skb = class_dequeue(q, cls);
+		len = qdisc_pkt_len(skb);
+		trace_dscd_td_drop(sch, skb, class_minor(cls), now - dscd_skb_cb(skb)->q_time, false);
+
+		DSCD_STAT_INC(dequeue_drops, cls->index);
+		DSCD_RATE_INC(DSCD_RATE_DROPPED, cls->index, len);
+		qdisc_tree_reduce_backlog(sch, 1, len);
+		qdisc_qstats_drop(sch);
+		sch->qstats.backlog -= len;
+		sch->q.qlen--;
+		kfree_skb(skb);
+	}
+}
+
+// batched T_d drops, the skbs freed in bulk under the qdisc lock
+static void dscd_drop_expired_bulk_free(struct Qdisc *sch, struct dscd_sched_data *q,
+					struct dscd_class *cls, u64 now)
+{
+	struct sk_buff *skb, *to_free = NULL;
+	unsigned int pkts = 0, bytes = 0;
+
+	while (abe_drop_pending(cls, now)) {
+		skb = class_dequeue(q, cls);
+		trace_dscd_td_drop(sch, skb, class_minor(cls), now - dscd_skb_cb(skb)->q_time, false);
+		pkts++;
+		bytes += qdisc_pkt_len(skb);
+		skb->next = to_free;
+		to_free = skb;
+	}
+	dscd_drop_batch(sch, q, cls, NULL, pkts, bytes);
+	kfree_skb_list_reason(to_free, SKB_DROP_REASON_QDISC_DROP);
+}
+
+// Time a drop of DSCD_BENCH_DROPS expired ABE packets, under the qdisc lock and
+// including the softirq, which runs when the lock is released. Without drop, a
+// BE packet waits behind the ABE overload, and the dequeue that drops the ABE
+// packets returns it. That dequeue is the worst case of the ABE overload.
+static void dscd_bench_drop(struct kunit *test, const char *name,
+			    void (*drop)(struct Qdisc *, struct dscd_sched_data *, struct dscd_class *, u64))
+{
+	u64 start, locked, total, locked_ns = 0, total_ns = 0, locked_max = 0, total_max = 0;
+	struct sk_buff *skb = NULL;
+	struct dscd_sched_data *q;
+	struct net_device *dev;
+	struct Qdisc *sch;
+	u32 round;
+
+	sch = dscd_test_qdisc_create(test, &dev);
+	q = qdisc_priv(sch);
+
+	for (round = 0; round < DSCD_BENCH_ROUNDS; round++) {
+		dscd_test_fill_abe(test, sch, DSCD_BENCH_DROPS);
+		if (!drop)
+			dscd_test_enqueue(test, sch, 1000, false);
+
+		spin_lock_bh(qdisc_lock(sch));
+		start = ktime_get_ns();
+		if (drop)
+			drop(sch, q, &q->classes[DSCD_ABE], start);
+		else
+			skb = sch->dequeue(sch);
+		locked = ktime_get_ns() - start;
+		spin_unlock_bh(qdisc_lock(sch));
+		total = ktime_get_ns() - start;
+
+		locked_ns += locked;
+		total_ns += total;
+		locked_max = max(locked_max, locked);
+		total_max = max(total_max, total);
+
+		KUNIT_EXPECT_EQ(test, q->classes[DSCD_ABE].len, 0ULL);
+		if (!drop) {
+			KUNIT_EXPECT_NOT_NULL(test, skb);
+			kfree_skb(skb);
+		}
+	}
+
+	kunit_info(test, "%s: %llu ns avg., %llu ns max. under the qdisc lock, %llu ns avg., %llu ns max. in total per %u drops\n",
+		   name, div_u64(locked_ns, DSCD_BENCH_ROUNDS), locked_max,
+		   div_u64(total_ns, DSCD_BENCH_ROUNDS), total_max, DSCD_BENCH_DROPS);
+
+	dscd_test_qdisc_destroy(sch, dev);
+}
+
+static void dscd_bench_td_drops(struct kunit *test)
+{
+	dscd_bench_drop(test, "dscd_dequeue, worst case", NULL);
+	dscd_bench_drop(test, "dscd_drop_expired", dscd_drop_expired);
+	dscd_bench_drop(test, "per packet", dscd_drop_expired_per_packet);
+	dscd_bench_drop(test, "batch, kfree_skb_list_reason", dscd_drop_expired_bulk_free);
+}
+
+
+
+/* ********** Service Queue ********** */
+
+// the flush of a long service queue keeps at most SERVICE_SPARE_CHUNKS chunks allocated
+static void dscd_test_flush_spare_cap(struct kunit *test)
+{
+	struct dscd_sched_data *q;
+	struct net_device *dev;
+	struct Qdisc *sch;
+	u32 i;
+
+	sch = dscd_test_qdisc_create(test, &dev);
+	q = qdisc_priv(sch);
+
+	// alternating lengths, every entry is a run of its own
+	spin_lock_bh(qdisc_lock(sch));
+	for (i = 0; i < 4 * SERVICE_SPARE_CHUNKS * SERVICE_CHUNK_RUNS; i++)
+		if (!service_enqueue(q, 1000 + (i & 1), &q->classes[DSCD_BE]))
+			break;
+	spin_unlock_bh(qdisc_lock(sch));
+	KUNIT_ASSERT_GT(test, q->service_chunks, 2ULL * SERVICE_SPARE_CHUNKS);
+
+	spin_lock_bh(qdisc_lock(sch));
+	empty_service_queue(q);
+	spin_unlock_bh(qdisc_lock(sch));
+
+	KUNIT_EXPECT_EQ(test, q->service_len, 0ULL);
+	KUNIT_EXPECT_EQ(test, q->service_spare_chunks, (u64)SERVICE_SPARE_CHUNKS);
+	KUNIT_EXPECT_EQ(test, q->service_chunks, (u64)SERVICE_SPARE_CHUNKS);
+
+	dscd_test_qdisc_destroy(sch, dev);
+}
+
+
+/* ********** Overflow ********** */
+
+// abe_head must not push out ABE packets, if they can't make room for the arriving one
+static void dscd_test_pushout_infeasible(struct kunit *test)
+{
+	struct dscd_sched_data *q;
+	struct net_device *dev;
+	struct Qdisc *sch;
+
+	sch = dscd_test_qdisc_create(test, &dev);
+	q = qdisc_priv(sch);
+	q->overflow = TC_DSCD_OVERFLOW_ABE_HEAD;
+	sch->limit = 3000;
+
+	KUNIT_EXPECT_EQ(test, dscd_test_enqueue(test, sch, 1000, true), NET_XMIT_SUCCESS);
+	KUNIT_EXPECT_EQ(test, dscd_test_enqueue(test, sch, 1500, false), NET_XMIT_SUCCESS);
+
+	// 1500 bytes above B_max, the ABE packet frees at most 1000
+	KUNIT_EXPECT_EQ(test, dscd_test_enqueue(test, sch, 2000, false), NET_XMIT_DROP);
+	KUNIT_EXPECT_EQ(test, q->classes[DSCD_ABE].len, 1ULL);
+	KUNIT_EXPECT_EQ(test, q->classes[DSCD_BE].len, 1ULL);
+
+	// 900 bytes above B_max, pushing out the ABE packet makes room
+	KUNIT_EXPECT_EQ(test, dscd_test_enqueue(test, sch, 1400, false), NET_XMIT_SUCCESS);
+	KUNIT_EXPECT_EQ(test, q->classes[DSCD_ABE].len, 0ULL);
+	KUNIT_EXPECT_EQ(test, q->classes[DSCD_BE].len, 2ULL);
+
+	dscd_test_qdisc_destroy(sch, dev);
+}
+
+
+
+/* ********** GSO ********** */
+
+// TCP GSO packets of DSCD_BENCH_GSO_SEGS full segments each
+#define DSCD_BENCH_GSO_PKTS	(64)
+#define DSCD_BENCH_GSO_SEGS	(44)
+#define DSCD_BENCH_GSO_MSS	(1448)
+#define DSCD_BENCH_GSO_HLEN	(ETH_HLEN + sizeof(struct iphdr) + sizeof(struct tcphdr))
+
+// a BE TCP/IPv4 GSO packet as handed to the root qdisc of dev, which has no TSO
+static struct sk_buff *dscd_test_gso_skb(struct kunit *test, struct net_device *dev)
+{
+	unsigned int len = DSCD_BENCH_GSO_HLEN + DSCD_BENCH_GSO_SEGS * DSCD_BENCH_GSO_MSS;
+	struct sk_buff *skb;
+	struct iphdr *iph;
+	struct tcphdr *th;
+
+	skb = alloc_skb(len, GFP_KERNEL);
+	KUNIT_ASSERT_NOT_NULL(test, skb);
+	skb_put_zero(skb, len);
+
+	skb_reset_mac_header(skb);
+	eth_hdr(skb)->h_proto = htons(ETH_P_IP);
+
+	skb_set_network_header(skb, ETH_HLEN);
+	iph = ip_hdr(skb);
+	iph->version = 4;
+	iph->ihl = 5;
+	iph->tot_len = htons(len - ETH_HLEN);
+	iph->frag_off = htons(IP_DF);
+	iph->ttl = 64;
+	iph->protocol = IPPROTO_TCP;
+
+	skb_set_transport_header(skb, ETH_HLEN + sizeof(*iph));
+	th = tcp_hdr(skb);
+	th->source = htons(5001);
+	th->dest = htons(5001);
+	th->doff = sizeof(*th) / 4;
+	th->ack = 1;
+
+	skb->dev = dev;
+	skb->protocol = htons(ETH_P_IP);
+	skb->priority = TC_PRIO_BESTEFFORT;
+	skb->ip_summed = CHECKSUM_PARTIAL;
+	skb->csum_start = skb_transport_header(skb) - skb->head;
+	skb->csum_offset = offsetof(struct tcphdr, check);
+	skb_shinfo(skb)->gso_size = DSCD_BENCH_GSO_MSS;
+	skb_shinfo(skb)->gso_type = SKB_GSO_TCPV4;
+	skb_shinfo(skb)->gso_segs = DSCD_BENCH_GSO_SEGS;
+
+	// like qdisc_pkt_len_init(), every segment counts its headers
+	qdisc_skb_cb(skb)->pkt_len = skb->len + (DSCD_BENCH_GSO_SEGS - 1) * DSCD_BENCH_GSO_HLEN;
+	return skb;
+}
+
+// Time the enqueue and dequeue of DSCD_BENCH_GSO_PKTS GSO packets. Without split_gso,
+// the packets leave DSCD whole and are segmented after the dequeue, as validate_xmit_skb()
+// does for a device without TSO, so both variants pay for the segmentation once.
+static void dscd_bench_gso_variant(struct kunit *test, const char *name, bool split_gso)
+{
+	struct sk_buff **skbs, *skb, *segs, *to_free = NULL;
+	u64 start, ns = 0, bytes = 0;
+	struct dscd_sched_data *q;
+	struct net_device *dev;
+	struct Qdisc *sch;
+	u32 round, i;
+
+	skbs = kunit_kmalloc_array(test, DSCD_BENCH_GSO_PKTS, sizeof(*skbs), GFP_KERNEL);
+	KUNIT_ASSERT_NOT_NULL(test, skbs);
+
+	sch = dscd_test_qdisc_create(test, &dev);
+	q = qdisc_priv(sch);
+	q->split_gso = split_gso;
+
+	for (round = 0; round < DSCD_BENCH_ROUNDS; round++) {
+		for (i = 0; i < DSCD_BENCH_GSO_PKTS; i++)
+			skbs[i] = dscd_test_gso_skb(test, dev);
+
+		spin_lock_bh(qdisc_lock(sch));
+		start = ktime_get_ns();
+		for (i = 0; i < DSCD_BENCH_GSO_PKTS; i++)
+			sch->enqueue(skbs[i], sch, &to_free);
+
+		while ((skb = sch->dequeue(sch)) != NULL) {
+			if (skb_is_gso(skb)) {
+				segs = skb_gso_segment(skb, netif_skb_features(skb) & ~NETIF_F_GSO_MASK);
+				KUNIT_ASSERT_NOT_ERR_OR_NULL(test, segs);
+				consume_skb(skb);
+				skb = segs;
+			}
+			for (; skb; skb = segs) {
+				segs = skb->next;
+				bytes += skb->len;
+				consume_skb(skb);
+			}
+		}
+		ns += ktime_get_ns() - start;
+		spin_unlock_bh(qdisc_lock(sch));
+
+		kfree_skb_list(to_free);
+		to_free = NULL;
+		KUNIT_EXPECT_EQ(test, sch->q.qlen, 0U);
+	}
+
+	// every segment left DSCD or the segmentation with its own headers
+	KUNIT_EXPECT_EQ(test, bytes, (u64)DSCD_BENCH_ROUNDS * DSCD_BENCH_GSO_PKTS *
+			DSCD_BENCH_GSO_SEGS * (DSCD_BENCH_GSO_HLEN + DSCD_BENCH_GSO_MSS));
+	kunit_info(test, "%s: %llu Mbit/s, %llu ns per GSO packet of %u segments\n", name,
+		   div64_u64(bytes * 8 * 1000, max(ns, 1ULL)),
+		   div_u64(ns, DSCD_BENCH_ROUNDS * DSCD_BENCH_GSO_PKTS), DSCD_BENCH_GSO_SEGS);
+
+	dscd_test_qdisc_destroy(sch, dev);
+}
+
+static void dscd_bench_gso(struct kunit *test)
+{
+	dscd_bench_gso_variant(test, "nosplit_gso", false);
+	dscd_bench_gso_variant(test, "split_gso", true);
+}
+
+
+/* ********** Classes ********** */
+
+// Configure num additional ABE classes through dscd_change(), like tc does. Class :3 + i
+// gets the skb->priority values in the bitmap prio[i], the ABE class :2 gets none.
+static int dscd_test_change_classes(struct kunit *test, struct Qdisc *sch, const u16 *prio, int num)
+{
+	struct nlattr *opts, *list, *entry;
+	struct sk_buff *msg;
+	int err, i;
+
+	msg = alloc_skb(NLMSG_GOODSIZE, GFP_KERNEL);
+	KUNIT_ASSERT_NOT_NULL(test, msg);
+
+	opts = nla_nest_start(msg, TCA_OPTIONS);
+	KUNIT_ASSERT_NOT_NULL(test, opts);
+	KUNIT_ASSERT_EQ(test, nla_put_u16(msg, TCA_DSCD_ABE_PRIO, 0), 0);
+	list = nla_nest_start(msg, TCA_DSCD_ABE_CLASSES);
+	KUNIT_ASSERT_NOT_NULL(test, list);
+	for (i = 0; i < num; i++) {
+		entry = nla_nest_start(msg, TCA_DSCD_ABE_CLASS);
+		KUNIT_ASSERT_NOT_NULL(test, entry);
+		KUNIT_ASSERT_EQ(test, nla_put_u16(msg, TCA_DSCD_ABE_CLASS_PRIO, prio[i]), 0);
+		nla_nest_end(msg, entry);
+	}
+	nla_nest_end(msg, list);
+	nla_nest_end(msg, opts);
+
+	rtnl_lock();
+	err = dscd_change(sch, opts, NULL);
+	rtnl_unlock();
+
+	kfree_skb(msg);
+	return err;
+}
+
+// a removed class takes its packets and service entries along as drops, the others are still served
+static void dscd_test_remove_class(struct kunit *test)
+{
+	static const u16 prio = BIT(TC_PRIO_INTERACTIVE);
+	struct dscd_sched_data *q;
+	struct net_device *dev;
+	struct sk_buff *skb;
+	struct Qdisc *sch;
+
+	sch = dscd_test_qdisc_create(test, &dev);
+	q = qdisc_priv(sch);
+
+	// TC_PRIO_INTERACTIVE maps to the additional class :3
+	KUNIT_ASSERT_EQ(test, dscd_test_change_classes(test, sch, &prio, 1), 0);
+	KUNIT_ASSERT_EQ(test, q->num_classes, 3);
+
+	KUNIT_EXPECT_EQ(test, dscd_test_enqueue(test, sch, 1000, true), NET_XMIT_SUCCESS);
+	KUNIT_EXPECT_EQ(test, dscd_test_enqueue(test, sch, 1500, false), NET_XMIT_SUCCESS);
+	KUNIT_EXPECT_EQ(test, q->classes[2].len, 1ULL);
+
+	// an empty list removes the class again
+	KUNIT_ASSERT_EQ(test, dscd_test_change_classes(test, sch, NULL, 0), 0);
+	KUNIT_ASSERT_EQ(test, q->num_classes, 2);
+
+	KUNIT_EXPECT_EQ(test, sch->q.qlen, 1U);
+	KUNIT_EXPECT_EQ(test, sch->qstats.backlog, 1500U);
+	KUNIT_EXPECT_EQ(test, sch->qstats.drops, 1U);
+	KUNIT_EXPECT_EQ(test, q->service_len, 1ULL);
+	KUNIT_EXPECT_EQ(test, service_credit_bytes(q), 1500ULL);
+	KUNIT_EXPECT_EQ(test, q->skb_memory, q->classes[DSCD_BE].truesize);
+
+	spin_lock_bh(qdisc_lock(sch));
+	skb = sch->dequeue(sch);
+	spin_unlock_bh(qdisc_lock(sch));
+
+	KUNIT_ASSERT_NOT_NULL(test, skb);
+	KUNIT_EXPECT_EQ(test, qdisc_pkt_len(skb), 1500U);
+	KUNIT_EXPECT_EQ(test, sch->q.qlen, 0U);
+	kfree_skb(skb);
+
+	dscd_test_qdisc_destroy(sch, dev);
+}
+
+
+static struct kunit_case dscd_test_cases[] = {
+	KUNIT_CASE(dscd_test_exp2_tab),
+	KUNIT_CASE(dscd_test_n_pow2_error),
+	KUNIT_CASE(dscd_test_n_pow2_exact),
+	KUNIT_CASE(dscd_test_n_pow2_monotonic),
+	KUNIT_CASE(dscd_test_n_pow2_range),
+	KUNIT_CASE(dscd_bench_n_pow2),
+	KUNIT_CASE(dscd_test_reciprocals),
+	KUNIT_CASE(dscd_test_rate_bytes),
+	KUNIT_CASE(dscd_bench_reciprocals),
+	KUNIT_CASE(dscd_test_granularity_decay),
+	KUNIT_CASE(dscd_bench_dscd_now),
+	KUNIT_CASE_SLOW(dscd_bench_td_drops),
+	KUNIT_CASE(dscd_test_flush_spare_cap),
+	KUNIT_CASE(dscd_test_pushout_infeasible),
+	KUNIT_CASE_SLOW(dscd_bench_gso),
+	KUNIT_CASE(dscd_test_remove_class),
+	{}
+};
+
+static struct kunit_suite dscd_test_suite = {
+	.name = "sch_dscd",
+	.test_cases = dscd_test_cases,
+};
+
+kunit_test_suite(dscd_test_suite);
@@ -36,5 +36,7 @@ cp ${sched_dir}/include/uapi/linux/* iproute2/include/uapi/linux/
 # copy dscd tc module
 mkdir $dist_dir || true
 cp iproute2/tc/q_dscd.so $dist_dir
+# dscd_mq is part of the same module
+cp iproute2/tc/q_dscd.so $dist_dir/q_dscd_mq.so
 
 exit 0
@@ -20,7 +20,18 @@ static void explain(void)
 	fprintf(stderr,
 		"Usage: ... dscd [ B_max SIZE ] [ C RATE ]\n"
 		"                [ credit_half_life TIME ] [ rate_memory TIME ]\n"
-		"                [ T_d TIME ] [ T_q NUM ]\n");
+		"                [ T_d TIME ] [ T_q NUM ] [ lockless ]\n"
+		"                [ flows NUMBER ] [ quantum BYTES ]\n"
+		"                [ abe_prio PRIO,... | none ] [ abe_dscp DSCP,... | none ]\n"
+		"                [ shaping | noshaping ] [ split_gso | nosplit_gso ]\n"
+		"                [ time_granularity TIME ] [ ecn | noecn ]\n"
+		"                [ estimator ewma | winmax | bql ]\n"
+		"                [ est_batch PACKETS ] [ est_interval TIME ]\n"
+		"                [ memory_limit BYTES ] [ packet_limit PACKETS ]\n"
+		"                [ abe_limit BYTES ] [ be_limit BYTES ]\n"
+		"                [ overflow tail | abe_head | larger ]\n"
+		"                [ abe_class T_d TIME [ T_q NUM ] [ prio PRIO,... ]\n"
+		"                            [ dscp DSCP,... ] [ limit BYTES ] ]... | noabe_class\n");
 }
 
 static void explain1(const char *arg, const char *val)
@@ -28,10 +39,163 @@ static void explain1(const char *arg, const char *val)
 	fprintf(stderr, "tbf: illegal value for \"%s\": \"%s\"\n", arg, val);
 }
 
+static const char * const dscd_estimators[] = {
+	[TC_DSCD_EST_EWMA]		= "ewma",
+	[TC_DSCD_EST_WINMAX]	= "winmax",
+	[TC_DSCD_EST_BQL]		= "bql",
+};
+
+static const char *dscd_estimator_name(__u64 estimator)
+{
+	if (estimator > TC_DSCD_EST_MAX)
+		return "unknown";
+	return dscd_estimators[estimator];
+}
+
+static const char * const dscd_overflows[] = {
+	[TC_DSCD_OVERFLOW_TAIL]		= "tail",
+	[TC_DSCD_OVERFLOW_ABE_HEAD]	= "abe_head",
+	[TC_DSCD_OVERFLOW_LARGER]	= "larger",
+};
+
+static const char *dscd_overflow_name(__u8 overflow)
+{
+	if (overflow > TC_DSCD_OVERFLOW_MAX)
+		return "unknown";
+	return dscd_overflows[overflow];
+}
+
+// parse a comma separated list of values up to max into a bitmap, "none" is the empty map
+static int dscd_parse_map(char *arg, unsigned int max, __u64 *map)
+{
+	unsigned int value;
+	char *tok;
+
+	*map = 0;
+	if (strcmp(arg, "none") == 0)
+		return 0;
+
+	for (tok = strtok(arg, ","); tok; tok = strtok(NULL, ",")) {
+		if (get_unsigned(&value, tok, 0) || value > max)
+			return -1;
+		*map |= 1ULL << value;
+	}
+
+	return 0;
+}
+
+static void dscd_print_map(const char *key, __u64 map, unsigned int max)
+{
+	bool first = true;
+	unsigned int i;
+
+	print_string(PRINT_FP, NULL, "%s ", key);
+	open_json_array(PRINT_JSON, key);
+	for (i = 0; i <= max; i++) {
+		if (!(map & (1ULL << i)))
+			continue;
+		print_uint(PRINT_ANY, NULL, first ? "%u" : ",%u", i);
+		first = false;
+	}
+	close_json_array(PRINT_JSON, NULL);
+	print_string(PRINT_FP, NULL, "%s ", first ? "none" : "");
+}
+
+// an additional ABE class, see TCA_DSCD_ABE_CLASSES
+struct dscd_abe_class {
+	__u64 T_d;
+	__u64 T_q;
+	__u64 dscp;
+	__u64 prio;
+	unsigned int limit;
+	bool set_T_q, set_dscp, set_prio, set_limit;
+};
+
+// parse the options following "abe_class" until the first unknown keyword,
+// returns the number of arguments consumed or -1
+static int dscd_parse_abe_class(int argc, char **argv, struct dscd_abe_class *cls)
+{
+	int n = 0;
+
+	while (n + 1 < argc) {
+		char *key = argv[n], *val = argv[n + 1];
+
+		if (strcmp(key, "T_d") == 0) {
+			if (get_time64(&cls->T_d, val) || cls->T_d == 0) {
+				explain1("abe_class T_d", val);
+				return -1;
+			}
+		} else if (strcmp(key, "T_q") == 0) {
+			cls->set_T_q = true;
+			if (get_u64(&cls->T_q, val, 0)) {
+				explain1("abe_class T_q", val);
+				return -1;
+			}
+		} else if (strcmp(key, "prio") == 0) {
+			cls->set_prio = true;
+			if (dscd_parse_map(val, TC_PRIO_MAX, &cls->prio)) {
+				explain1("abe_class prio", val);
+				return -1;
+			}
+		} else if (strcmp(key, "dscp") == 0) {
+			cls->set_dscp = true;
+			if (dscd_parse_map(val, 63, &cls->dscp)) {
+				explain1("abe_class dscp", val);
+				return -1;
+			}
+		} else if (strcmp(key, "limit") == 0) {
+			cls->set_limit = true;
+			if (get_u32(&cls->limit, val, 0)) {
+				explain1("abe_class limit", val);
+				return -1;
+			}
+		} else {
+			break;
+		}
+		n += 2;
+	}
+
+	if (cls->T_d == 0) {
+		fprintf(stderr, "dscd: abe_class needs T_d\n");
+		return -1;
+	}
+
+	return n;
+}
+
+static void dscd_add_abe_classes(struct nlmsghdr *n, struct dscd_abe_class *classes,
+				 unsigned int num_classes)
+{
+	struct rtattr *list, *entry;
+	unsigned int i;
+
+	list = addattr_nest(n, 1024, TCA_DSCD_ABE_CLASSES | NLA_F_NESTED);
+	for (i = 0; i < num_classes; i++) {
+		struct dscd_abe_class *cls = &classes[i];
+
+		entry = addattr_nest(n, 1024, TCA_DSCD_ABE_CLASS | NLA_F_NESTED);
+		addattr_l(n, 1024, TCA_DSCD_ABE_CLASS_T_D, &cls->T_d, sizeof(cls->T_d));
+		if (cls->set_T_q)
+			addattr_l(n, 1024, TCA_DSCD_ABE_CLASS_T_Q, &cls->T_q, sizeof(cls->T_q));
+		if (cls->set_dscp)
+			addattr_l(n, 1024, TCA_DSCD_ABE_CLASS_DSCP, &cls->dscp, sizeof(cls->dscp));
+		if (cls->set_prio)
+			addattr16(n, 1024, TCA_DSCD_ABE_CLASS_PRIO, cls->prio);
+		if (cls->set_limit)
+			addattr32(n, 1024, TCA_DSCD_ABE_CLASS_LIMIT, cls->limit);
+		addattr_nest_end(n, entry);
+	}
+	addattr_nest_end(n, list);
+}
+
 static int dscd_parse_opt(struct qdisc_util *qu, int argc, char **argv,
 			  struct nlmsghdr *n, const char *dev)
 {
 	unsigned int B_max = 0;
+	bool set_memory_limit = false, set_packet_limit = false;
+	bool set_abe_limit = false, set_be_limit = false;
+	unsigned int memory_limit = 0, packet_limit = 0;
+	unsigned int abe_limit = 0, be_limit = 0;
 	bool set_rate = false;
 	bool set_abe_drop_threshold = false;
 	__u64 C = 0;
@@ -39,6 +203,27 @@ static int dscd_parse_opt(struct qdisc_util *qu, int argc, char **argv,
 	__u64 rate_memory = 0;
 	__u64 T_d = 0;
 	__u64 T_q = 0;
+	bool lockless = false;
+	bool set_flows = false;
+	unsigned int flows = 0;
+	unsigned int quantum = 0;
+	bool set_abe_prio = false;
+	bool set_abe_dscp = false;
+	__u64 abe_prio = 0;
+	__u64 abe_dscp = 0;
+	int shaping = -1;
+	int split_gso = -1;
+	int ecn = -1;
+	bool set_time_granularity = false;
+	__u64 time_granularity = 0;
+	int estimator = -1;
+	int overflow = -1;
+	unsigned int est_batch = 0;
+	bool set_est_interval = false;
+	__u64 est_interval = 0;
+	struct dscd_abe_class abe_classes[TC_DSCD_MAX_ABE_CLASSES] = {};
+	unsigned int num_abe_classes = 0;
+	bool set_abe_classes = false;
 	struct rtattr *tail;
 
 	while (argc > 0) {
@@ -80,6 +265,132 @@ static int dscd_parse_opt(struct qdisc_util *qu, int argc, char **argv,
 				explain1("T_q", *argv);
 				return -1;
 			}
+		} else if (strcmp(*argv, "lockless") == 0) {
+			lockless = true;
+		} else if (strcmp(*argv, "flows") == 0) {
+			NEXT_ARG();
+			set_flows = true;
+			if (get_u32(&flows, *argv, 0)) {
+				explain1("flows", *argv);
+				return -1;
+			}
+		} else if (strcmp(*argv, "quantum") == 0) {
+			NEXT_ARG();
+			if (get_u32(&quantum, *argv, 0) || quantum == 0) {
+				explain1("quantum", *argv);
+				return -1;
+			}
+		} else if (strcmp(*argv, "abe_prio") == 0) {
+			NEXT_ARG();
+			set_abe_prio = true;
+			if (dscd_parse_map(*argv, TC_PRIO_MAX, &abe_prio)) {
+				explain1("abe_prio", *argv);
+				return -1;
+			}
+		} else if (strcmp(*argv, "abe_dscp") == 0) {
+			NEXT_ARG();
+			set_abe_dscp = true;
+			if (dscd_parse_map(*argv, 63, &abe_dscp)) {
+				explain1("abe_dscp", *argv);
+				return -1;
+			}
+		} else if (strcmp(*argv, "shaping") == 0) {
+			shaping = 1;
+		} else if (strcmp(*argv, "noshaping") == 0) {
+			shaping = 0;
+		} else if (strcmp(*argv, "split_gso") == 0) {
+			split_gso = 1;
+		} else if (strcmp(*argv, "nosplit_gso") == 0) {
+			split_gso = 0;
+		} else if (strcmp(*argv, "ecn") == 0) {
+			ecn = 1;
+		} else if (strcmp(*argv, "noecn") == 0) {
+			ecn = 0;
+		} else if (strcmp(*argv, "time_granularity") == 0) {
+			NEXT_ARG();
+			set_time_granularity = true;
+			if (get_time64(&time_granularity, *argv)) {
+				explain1("time_granularity", *argv);
+				return -1;
+			}
+		} else if (strcmp(*argv, "estimator") == 0) {
+			NEXT_ARG();
+			for (estimator = TC_DSCD_EST_MAX; estimator >= 0; estimator--)
+				if (strcmp(*argv, dscd_estimators[estimator]) == 0)
+					break;
+			if (estimator < 0) {
+				explain1("estimator", *argv);
+				return -1;
+			}
+		} else if (strcmp(*argv, "overflow") == 0) {
+			NEXT_ARG();
+			for (overflow = TC_DSCD_OVERFLOW_MAX; overflow >= 0; overflow--)
+				if (strcmp(*argv, dscd_overflows[overflow]) == 0)
+					break;
+			if (overflow < 0) {
+				explain1("overflow", *argv);
+				return -1;
+			}
+		} else if (strcmp(*argv, "est_batch") == 0) {
+			NEXT_ARG();
+			if (get_u32(&est_batch, *argv, 0) || est_batch == 0) {
+				explain1("est_batch", *argv);
+				return -1;
+			}
+		} else if (strcmp(*argv, "est_interval") == 0) {
+			NEXT_ARG();
+			set_est_interval = true;
+			if (get_time64(&est_interval, *argv)) {
+				explain1("est_interval", *argv);
+				return -1;
+			}
+		} else if (strcmp(*argv, "memory_limit") == 0) {
+			NEXT_ARG();
+			set_memory_limit = true;
+			if (get_u32(&memory_limit, *argv, 0)) {
+				explain1("memory_limit", *argv);
+				return -1;
+			}
+		} else if (strcmp(*argv, "packet_limit") == 0) {
+			NEXT_ARG();
+			set_packet_limit = true;
+			if (get_u32(&packet_limit, *argv, 0)) {
+				explain1("packet_limit", *argv);
+				return -1;
+			}
+		} else if (strcmp(*argv, "abe_limit") == 0) {
+			NEXT_ARG();
+			set_abe_limit = true;
+			if (get_u32(&abe_limit, *argv, 0)) {
+				explain1("abe_limit", *argv);
+				return -1;
+			}
+		} else if (strcmp(*argv, "be_limit") == 0) {
+			NEXT_ARG();
+			set_be_limit = true;
+			if (get_u32(&be_limit, *argv, 0)) {
+				explain1("be_limit", *argv);
+				return -1;
+			}
+		} else if (strcmp(*argv, "abe_class") == 0) {
+			int used;
+
+			if (num_abe_classes == TC_DSCD_MAX_ABE_CLASSES) {
+				fprintf(stderr, "dscd: at most %u abe_class\n",
+					TC_DSCD_MAX_ABE_CLASSES);
+				return -1;
+			}
+			set_abe_classes = true;
+			used = dscd_parse_abe_class(argc - 1, argv + 1,
+						    &abe_classes[num_abe_classes++]);
+			if (used < 0)
+				return -1;
+			argc -= used;
+			argv += used;
+		} else if (strcmp(*argv, "noabe_class") == 0) {
+			// an empty list removes the additional ABE classes
+			set_abe_classes = true;
+			num_abe_classes = 0;
 		} else if (strcmp(*argv, "help") == 0) {
 			explain();
 			return -1;
@@ -96,6 +407,16 @@ static int dscd_parse_opt(struct qdisc_util *qu, int argc, char **argv,
 	tail = addattr_nest(n, 1024, TCA_OPTIONS | NLA_F_NESTED);
 	if (B_max)
 		addattr_l(n, 1024, TCA_DSCD_LIMIT, &B_max, sizeof(B_max));
+	if (set_memory_limit)
+		addattr32(n, 1024, TCA_DSCD_MEMORY_LIMIT, memory_limit);
+	if (set_packet_limit)
+		addattr32(n, 1024, TCA_DSCD_PACKET_LIMIT, packet_limit);
+	if (set_abe_limit)
+		addattr32(n, 1024, TCA_DSCD_ABE_LIMIT, abe_limit);
+	if (set_be_limit)
+		addattr32(n, 1024, TCA_DSCD_BE_LIMIT, be_limit);
+	if (overflow != -1)
+		addattr8(n, 1024, TCA_DSCD_OVERFLOW, overflow);
 	if (set_rate)
 		addattr_l(n, 1024, TCA_DSCD_RATE, &C, sizeof(C));
 	if (credit_half_life)
@@ -106,6 +427,32 @@ static int dscd_parse_opt(struct qdisc_util *qu, int argc, char **argv,
 		addattr_l(n, 1024, TCA_DSCD_T_D, &T_d, sizeof(T_d));
 	if (set_abe_drop_threshold)
 		addattr_l(n, 1024, TCA_DSCD_T_Q, &T_q, sizeof(T_q));
+	if (lockless)
+		addattr8(n, 1024, TCA_DSCD_LOCKLESS, 1);
+	if (set_flows)
+		addattr_l(n, 1024, TCA_DSCD_FLOWS, &flows, sizeof(flows));
+	if (quantum)
+		addattr_l(n, 1024, TCA_DSCD_QUANTUM, &quantum, sizeof(quantum));
+	if (set_abe_prio)
+		addattr16(n, 1024, TCA_DSCD_ABE_PRIO, abe_prio);
+	if (set_abe_dscp)
+		addattr_l(n, 1024, TCA_DSCD_ABE_DSCP, &abe_dscp, sizeof(abe_dscp));
+	if (shaping != -1)
+		addattr8(n, 1024, TCA_DSCD_SHAPING, shaping);
+	if (split_gso != -1)
+		addattr8(n, 1024, TCA_DSCD_SPLIT_GSO, split_gso);
+	if (set_time_granularity)
+		addattr_l(n, 1024, TCA_DSCD_TIME_GRANULARITY, &time_granularity, sizeof(time_granularity));
+	if (ecn != -1)
+		addattr8(n, 1024, TCA_DSCD_ECN, ecn);
+	if (estimator != -1)
+		addattr8(n, 1024, TCA_DSCD_ESTIMATOR, estimator);
+	if (est_batch)
+		addattr32(n, 1024, TCA_DSCD_EST_BATCH, est_batch);
+	if (set_est_interval)
+		addattr_l(n, 1024, TCA_DSCD_EST_INTERVAL, &est_interval, sizeof(est_interval));
+	if (set_abe_classes)
+		dscd_add_abe_classes(n, abe_classes, num_abe_classes);
 	addattr_nest_end(n, tail);
 
 	return 0;
@@ -122,9 +469,51 @@ static void dscd_print_mode(unsigned int value, unsigned int max,
 	}
 }
 
+static void dscd_print_abe_classes(struct rtattr *list)
+{
+	struct rtattr *ctb[TCA_DSCD_ABE_CLASS_MAX + 1];
+	struct rtattr *entry;
+
+	SPRINT_BUF(b1);
+
+	open_json_array(PRINT_JSON, "abe_classes");
+	rtattr_for_each_nested(entry, list) {
+		if ((entry->rta_type & ~NLA_F_NESTED) != TCA_DSCD_ABE_CLASS)
+			continue;
+		parse_rtattr_nested(ctb, TCA_DSCD_ABE_CLASS_MAX, entry);
+
+		open_json_object(NULL);
+		print_string(PRINT_FP, NULL, "abe_class ", NULL);
+		if (ctb[TCA_DSCD_ABE_CLASS_T_D] &&
+		    RTA_PAYLOAD(ctb[TCA_DSCD_ABE_CLASS_T_D]) >= sizeof(__u64)) {
+			__u64 T_d = rta_getattr_u64(ctb[TCA_DSCD_ABE_CLASS_T_D]);
+
+			print_string(PRINT_FP, NULL, "T_d %s ", sprint_time64(T_d, b1));
+			print_u64(PRINT_JSON, "T_d_ns", NULL, T_d);
+		}
+		if (ctb[TCA_DSCD_ABE_CLASS_T_Q] &&
+		    RTA_PAYLOAD(ctb[TCA_DSCD_ABE_CLASS_T_Q]) >= sizeof(__u64))
+			print_u64(PRINT_ANY, "T_q", "T_q %llu ",
+				  rta_getattr_u64(ctb[TCA_DSCD_ABE_CLASS_T_Q]));
+		if (ctb[TCA_DSCD_ABE_CLASS_PRIO] &&
+		    RTA_PAYLOAD(ctb[TCA_DSCD_ABE_CLASS_PRIO]) >= sizeof(__u16))
+			dscd_print_map("prio", rta_getattr_u16(ctb[TCA_DSCD_ABE_CLASS_PRIO]), TC_PRIO_MAX);
+		if (ctb[TCA_DSCD_ABE_CLASS_DSCP] &&
+		    RTA_PAYLOAD(ctb[TCA_DSCD_ABE_CLASS_DSCP]) >= sizeof(__u64))
+			dscd_print_map("dscp", rta_getattr_u64(ctb[TCA_DSCD_ABE_CLASS_DSCP]), 63);
+		if (ctb[TCA_DSCD_ABE_CLASS_LIMIT] &&
+		    RTA_PAYLOAD(ctb[TCA_DSCD_ABE_CLASS_LIMIT]) >= sizeof(__u32) &&
+		    rta_getattr_u32(ctb[TCA_DSCD_ABE_CLASS_LIMIT]))
+			print_uint(PRINT_ANY, "limit", "limit %ub ",
+				   rta_getattr_u32(ctb[TCA_DSCD_ABE_CLASS_LIMIT]));
+		close_json_object();
+	}
+	close_json_array(PRINT_JSON, NULL);
+}
+
 static int dscd_print_opt(struct qdisc_util *qu, FILE *f, struct rtattr *opt)
 {
-	struct rtattr *tb[TCA_FQ_PIE_MAX + 1];
+	struct rtattr *tb[TCA_DSCD_MAX + 1];
 	unsigned int B_max = 0;
 	__u64 C = 0;
 	__u64 credit_half_life = 0;
@@ -145,6 +534,36 @@ static int dscd_print_opt(struct qdisc_util *qu, FILE *f, struct rtattr *opt)
 		B_max = rta_getattr_u32(tb[TCA_DSCD_LIMIT]);
 		print_uint(PRINT_ANY, "B_max", "B_max %ub ", B_max);
 	}
+	if (tb[TCA_DSCD_MEMORY_LIMIT] &&
+	    RTA_PAYLOAD(tb[TCA_DSCD_MEMORY_LIMIT]) >= sizeof(__u32) &&
+	    rta_getattr_u32(tb[TCA_DSCD_MEMORY_LIMIT])) {
+		print_uint(PRINT_ANY, "memory_limit", "memory_limit %ub ",
+			   rta_getattr_u32(tb[TCA_DSCD_MEMORY_LIMIT]));
+	}
+	if (tb[TCA_DSCD_PACKET_LIMIT] &&
+	    RTA_PAYLOAD(tb[TCA_DSCD_PACKET_LIMIT]) >= sizeof(__u32) &&
+	    rta_getattr_u32(tb[TCA_DSCD_PACKET_LIMIT])) {
+		print_uint(PRINT_ANY, "packet_limit", "packet_limit %up ",
+			   rta_getattr_u32(tb[TCA_DSCD_PACKET_LIMIT]));
+	}
+	if (tb[TCA_DSCD_ABE_LIMIT] &&
+	    RTA_PAYLOAD(tb[TCA_DSCD_ABE_LIMIT]) >= sizeof(__u32) &&
+	    rta_getattr_u32(tb[TCA_DSCD_ABE_LIMIT])) {
+		print_uint(PRINT_ANY, "abe_limit", "abe_limit %ub ",
+			   rta_getattr_u32(tb[TCA_DSCD_ABE_LIMIT]));
+	}
+	if (tb[TCA_DSCD_BE_LIMIT] &&
+	    RTA_PAYLOAD(tb[TCA_DSCD_BE_LIMIT]) >= sizeof(__u32) &&
+	    rta_getattr_u32(tb[TCA_DSCD_BE_LIMIT])) {
+		print_uint(PRINT_ANY, "be_limit", "be_limit %ub ",
+			   rta_getattr_u32(tb[TCA_DSCD_BE_LIMIT]));
+	}
+	if (tb[TCA_DSCD_OVERFLOW] &&
+	    RTA_PAYLOAD(tb[TCA_DSCD_OVERFLOW]) >= sizeof(__u8) &&
+	    rta_getattr_u8(tb[TCA_DSCD_OVERFLOW])) {
+		print_string(PRINT_ANY, "overflow", "overflow %s ",
+			     dscd_overflow_name(rta_getattr_u8(tb[TCA_DSCD_OVERFLOW])));
+	}
 	if (tb[TCA_DSCD_RATE] &&
 	    RTA_PAYLOAD(tb[TCA_DSCD_RATE]) >= sizeof(__u64)) {
 		C = rta_getattr_u64(tb[TCA_DSCD_RATE]);
@@ -174,12 +593,126 @@ static int dscd_print_opt(struct qdisc_util *qu, FILE *f, struct rtattr *opt)
 		T_q = rta_getattr_u64(tb[TCA_DSCD_T_Q]);
 		print_u64(PRINT_ANY, "T_q_ns", "T_q %llu ", T_q);
 	}
+	if (tb[TCA_DSCD_LOCKLESS] &&
+	    RTA_PAYLOAD(tb[TCA_DSCD_LOCKLESS]) >= sizeof(__u8) &&
+	    rta_getattr_u8(tb[TCA_DSCD_LOCKLESS])) {
+		print_bool(PRINT_ANY, "lockless", "lockless ", true);
+	}
+	if (tb[TCA_DSCD_FLOWS] &&
+	    RTA_PAYLOAD(tb[TCA_DSCD_FLOWS]) >= sizeof(__u32) &&
+	    rta_getattr_u32(tb[TCA_DSCD_FLOWS])) {
+		print_uint(PRINT_ANY, "flows", "flows %u ",
+			   rta_getattr_u32(tb[TCA_DSCD_FLOWS]));
+		if (tb[TCA_DSCD_QUANTUM] &&
+		    RTA_PAYLOAD(tb[TCA_DSCD_QUANTUM]) >= sizeof(__u32))
+			print_uint(PRINT_ANY, "quantum", "quantum %u ",
+				   rta_getattr_u32(tb[TCA_DSCD_QUANTUM]));
+	}
+	if (tb[TCA_DSCD_ABE_PRIO] &&
+	    RTA_PAYLOAD(tb[TCA_DSCD_ABE_PRIO]) >= sizeof(__u16))
+		dscd_print_map("abe_prio", rta_getattr_u16(tb[TCA_DSCD_ABE_PRIO]), TC_PRIO_MAX);
+	if (tb[TCA_DSCD_ABE_DSCP] &&
+	    RTA_PAYLOAD(tb[TCA_DSCD_ABE_DSCP]) >= sizeof(__u64))
+		dscd_print_map("abe_dscp", rta_getattr_u64(tb[TCA_DSCD_ABE_DSCP]), 63);
+	if (tb[TCA_DSCD_SHAPING] &&
+	    RTA_PAYLOAD(tb[TCA_DSCD_SHAPING]) >= sizeof(__u8) &&
+	    rta_getattr_u8(tb[TCA_DSCD_SHAPING])) {
+		print_bool(PRINT_ANY, "shaping", "shaping ", true);
+	}
+	if (tb[TCA_DSCD_SPLIT_GSO] &&
+	    RTA_PAYLOAD(tb[TCA_DSCD_SPLIT_GSO]) >= sizeof(__u8) &&
+	    rta_getattr_u8(tb[TCA_DSCD_SPLIT_GSO])) {
+		print_bool(PRINT_ANY, "split_gso", "split_gso ", true);
+	}
+	if (tb[TCA_DSCD_TIME_GRANULARITY] &&
+	    RTA_PAYLOAD(tb[TCA_DSCD_TIME_GRANULARITY]) >= sizeof(__u64) &&
+	    rta_getattr_u64(tb[TCA_DSCD_TIME_GRANULARITY])) {
+		__u64 time_granularity = rta_getattr_u64(tb[TCA_DSCD_TIME_GRANULARITY]);
+
+		print_string(PRINT_FP, NULL, "time_granularity %s ", sprint_time64(time_granularity, b1));
+		print_u64(PRINT_JSON, "time_granularity_ns", NULL, time_granularity);
+	}
+	if (tb[TCA_DSCD_ECN] &&
+	    RTA_PAYLOAD(tb[TCA_DSCD_ECN]) >= sizeof(__u8) &&
+	    rta_getattr_u8(tb[TCA_DSCD_ECN])) {
+		print_bool(PRINT_ANY, "ecn", "ecn ", true);
+	}
+	if (tb[TCA_DSCD_ESTIMATOR] &&
+	    RTA_PAYLOAD(tb[TCA_DSCD_ESTIMATOR]) >= sizeof(__u8) &&
+	    rta_getattr_u8(tb[TCA_DSCD_ESTIMATOR])) {
+		print_string(PRINT_ANY, "estimator", "estimator %s ",
+			     dscd_estimator_name(rta_getattr_u8(tb[TCA_DSCD_ESTIMATOR])));
+	}
+	if (tb[TCA_DSCD_EST_BATCH] &&
+	    RTA_PAYLOAD(tb[TCA_DSCD_EST_BATCH]) >= sizeof(__u32) &&
+	    rta_getattr_u32(tb[TCA_DSCD_EST_BATCH]) > 1) {
+		print_uint(PRINT_ANY, "est_batch", "est_batch %u ", rta_getattr_u32(tb[TCA_DSCD_EST_BATCH]));
+	}
+	if (tb[TCA_DSCD_EST_INTERVAL] &&
+	    RTA_PAYLOAD(tb[TCA_DSCD_EST_INTERVAL]) >= sizeof(__u64) &&
+	    rta_getattr_u64(tb[TCA_DSCD_EST_INTERVAL])) {
+		__u64 est_interval = rta_getattr_u64(tb[TCA_DSCD_EST_INTERVAL]);
+
+		print_string(PRINT_FP, NULL, "est_interval %s ", sprint_time64(est_interval, b1));
+		print_u64(PRINT_JSON, "est_interval_ns", NULL, est_interval);
+	}
+	if (tb[TCA_DSCD_ABE_CLASSES])
+		dscd_print_abe_classes(tb[TCA_DSCD_ABE_CLASSES]);
 
 	return 0;
 }
 
-static void dscd_print_json_class(struct tc_dscd_class_stats *stats, const char *key)
+// lower bound of a delay histogram bucket in ns, see struct tc_dscd_delay_hist
+static __u64 dscd_hist_lower_bound(unsigned int bucket)
+{
+	const unsigned int sub = 1 << TC_DSCD_HIST_SUB_BITS;
+	unsigned int exp = bucket >> TC_DSCD_HIST_SUB_BITS;
+	__u64 units;
+
+	if (bucket < sub)
+		units = bucket;
+	else
+		units = (__u64)(sub + (bucket & (sub - 1))) << (exp - 1);
+
+	return units << TC_DSCD_HIST_UNIT_SHIFT;
+}
+
+// upper bound in ns of the bucket holding the given percentile (in 1/100 %)
+static __u64 dscd_hist_percentile(const struct tc_dscd_delay_hist *hist, unsigned int pct)
+{
+	__u64 total = 0, rank, count = 0;
+	unsigned int i;
+
+	for (i = 0; i < TC_DSCD_HIST_BUCKETS; i++)
+		total += hist->buckets[i];
+	if (total == 0)
+		return 0;
+
+	rank = (total * pct + 9999) / 10000;
+	for (i = 0; i < TC_DSCD_HIST_BUCKETS - 1; i++) {
+		count += hist->buckets[i];
+		if (count >= rank)
+			return dscd_hist_lower_bound(i + 1);
+	}
+
+	// everything above the range ends up in the last bucket
+	return dscd_hist_lower_bound(TC_DSCD_HIST_BUCKETS - 1);
+}
+
+static void dscd_print_json_rate(struct tc_dscd_rate_est *rate, const char *key)
+{
+	open_json_object(key);
+	print_u64(PRINT_JSON, "bps", NULL, rate->bps);
+	print_u64(PRINT_JSON, "pps", NULL, rate->pps);
+	close_json_object();
+}
+
+static void dscd_print_json_class(struct tc_dscd_class_stats *stats,
+				  struct tc_dscd_delay_hist *hist,
+				  struct tc_dscd_class_rates *rates, const char *key)
 {
+	unsigned int i;
+
 #define PRINT_CLASS_STAT_JSON(name, attr) \
 		print_u64(PRINT_JSON, name, NULL, stats->attr)
 
@@ -189,6 +722,21 @@ static void dscd_print_json_class(struct tc_dscd_class_stats *stats, const char
 	PRINT_CLASS_STAT_JSON("sent", sent_packets);
 	PRINT_CLASS_STAT_JSON("enqueue_drops", enqueue_drops);
 	PRINT_CLASS_STAT_JSON("dequeue_drops", dequeue_drops);
+	PRINT_CLASS_STAT_JSON("ecn_marks", ecn_marks);
+	PRINT_CLASS_STAT_JSON("pushout_drops", pushout_drops);
+	print_u64(PRINT_JSON, "p50_delay", NULL, dscd_hist_percentile(hist, 5000));
+	print_u64(PRINT_JSON, "p90_delay", NULL, dscd_hist_percentile(hist, 9000));
+	print_u64(PRINT_JSON, "p99_delay", NULL, dscd_hist_percentile(hist, 9900));
+	print_u64(PRINT_JSON, "p999_delay", NULL, dscd_hist_percentile(hist, 9990));
+	open_json_array(PRINT_JSON, "delay_hist");
+	for (i = 0; i < TC_DSCD_HIST_BUCKETS; i++)
+		print_u64(PRINT_JSON, NULL, NULL, hist->buckets[i]);
+	close_json_array(PRINT_JSON, NULL);
+	open_json_object("rates");
+	dscd_print_json_rate(&rates->received, "received");
+	dscd_print_json_rate(&rates->sent, "sent");
+	dscd_print_json_rate(&rates->dropped, "dropped");
+	close_json_object();
 	close_json_object();
 
 #undef PRINT_CLASS_STAT_JSON
@@ -207,6 +755,51 @@ static void dscd_print_json_q(struct tc_dscd_q_stats *stats, const char *key)
 #undef PRINT_QUEUE_JSON
 }
 
+// xstats of a single class, from tc -s class show
+static void dscd_print_class_xstats(FILE *f, struct tc_dscd_class_xstats *st)
+{
+	struct tc_dscd_class_stats *stat = &st->stats;
+	struct tc_dscd_delay_hist *hist = &st->hist;
+	struct tc_dscd_class_rates *rates = &st->rates;
+
+	SPRINT_BUF(b1);
+
+	if (is_json_context()) {
+		print_bool(PRINT_JSON, "abe", NULL, st->abe);
+		if (st->abe) {
+			print_u64(PRINT_JSON, "T_d_ns", NULL, st->T_d);
+			print_u64(PRINT_JSON, "T_q", NULL, st->T_q);
+		}
+		dscd_print_json_class(stat, hist, rates, "stats");
+		dscd_print_json_q(&st->q_stats, "queue");
+		return;
+	}
+
+	fprintf(f, "%s", _SL_);
+	fprintf(f, " %s", st->abe ? "ABE" : "BE");
+	if (st->abe)
+		fprintf(f, " T_d %s T_q %llu", sprint_time64(st->T_d, b1), st->T_q);
+	fprintf(f, "%s", _SL_);
+	fprintf(f, "  queue length    %12llu%s", st->q_stats.length, _SL_);
+	fprintf(f, "  credit          %12llu%s", st->q_stats.credit, _SL_);
+	fprintf(f, "  sum delay       %12s%s", sprint_time64(stat->sum_delay, b1), _SL_);
+	fprintf(f, "  recv packets    %12llu%s", stat->received_packets, _SL_);
+	fprintf(f, "  sent packets    %12llu%s", stat->sent_packets, _SL_);
+	fprintf(f, "  enqueue drops   %12llu%s", stat->enqueue_drops, _SL_);
+	fprintf(f, "  dequeue drops   %12llu%s", stat->dequeue_drops, _SL_);
+	fprintf(f, "  ecn marks       %12llu%s", stat->ecn_marks, _SL_);
+	fprintf(f, "  pushout drops   %12llu%s", stat->pushout_drops, _SL_);
+	fprintf(f, "  avg delay       %12s%s", sprint_time64(stat->sent_packets != 0 ?
+		stat->sum_delay / stat->sent_packets : 0, b1), _SL_);
+	fprintf(f, "  p50 delay       %12s%s", sprint_time64(dscd_hist_percentile(hist, 5000), b1), _SL_);
+	fprintf(f, "  p90 delay       %12s%s", sprint_time64(dscd_hist_percentile(hist, 9000), b1), _SL_);
+	fprintf(f, "  p99 delay       %12s%s", sprint_time64(dscd_hist_percentile(hist, 9900), b1), _SL_);
+	fprintf(f, "  p99.9 delay     %12s%s", sprint_time64(dscd_hist_percentile(hist, 9990), b1), _SL_);
+	fprintf(f, "  recv rate       %12s%s", sprint_rate(rates->received.bps, b1), _SL_);
+	fprintf(f, "  sent rate       %12s%s", sprint_rate(rates->sent.bps, b1), _SL_);
+	fprintf(f, "  drop rate       %12s%s", sprint_rate(rates->dropped.bps, b1), _SL_);
+}
+
 static int dscd_print_xstats(struct qdisc_util *qu, FILE *f,
 			     struct rtattr *xstats)
 {
@@ -217,6 +810,11 @@ static int dscd_print_xstats(struct qdisc_util *qu, FILE *f,
 	if (xstats == NULL)
 		return 0;
 
+	if (RTA_PAYLOAD(xstats) == sizeof(struct tc_dscd_class_xstats)) {
+		dscd_print_class_xstats(f, RTA_DATA(xstats));
+		return 0;
+	}
+
 	st = RTA_DATA(xstats);
 	if (RTA_PAYLOAD(xstats) < sizeof(*st)) {
 		memcpy(&_st, st, RTA_PAYLOAD(xstats));
@@ -242,14 +840,94 @@ static int dscd_print_xstats(struct qdisc_util *qu, FILE *f,
 			  "weighted rate count %llu\n",
 			  st->S_t);
 
+	open_json_object("estimator");
+	print_string(PRINT_ANY,
+			  "mode",
+			  "estimator %s",
+			  dscd_estimator_name(st->est_stats.estimator));
+	print_u64(PRINT_ANY,
+			  "updates",
+			  " updates %llu",
+			  st->est_stats.updates);
+	print_u64(PRINT_ANY,
+			  "sample_packets",
+			  " sample %llup",
+			  st->est_stats.sample_packets);
+	print_u64(PRINT_ANY,
+			  "sample_bytes",
+			  " %llub",
+			  st->est_stats.sample_bytes);
+	print_string(PRINT_FP,
+			  NULL,
+			  " %s",
+			  sprint_time64(st->est_stats.sample_time, b1));
+	print_u64(PRINT_JSON,
+			  "sample_time",
+			  NULL,
+			  st->est_stats.sample_time);
+	if (st->est_stats.estimator == TC_DSCD_EST_WINMAX) {
+		print_string(PRINT_FP,
+				  NULL,
+				  " window max %s",
+				  sprint_rate(st->est_stats.window_max, b1));
+		print_u64(PRINT_JSON,
+				  "window_max",
+				  NULL,
+				  st->est_stats.window_max);
+	}
+	print_string(PRINT_FP, NULL, "\n", NULL);
+	close_json_object();
+
+	open_json_object("service_pool");
+	print_u64(PRINT_ANY,
+			  "allocated",
+			  "service pool chunks %llu",
+			  st->pool_stats.allocated);
+	print_string(PRINT_FP,
+			  NULL,
+			  " (%s)",
+			  sprint_size(st->pool_stats.allocated * st->pool_stats.chunk_size, b1));
+	print_u64(PRINT_JSON,
+			  "chunk_size",
+			  NULL,
+			  st->pool_stats.chunk_size);
+	print_u64(PRINT_ANY,
+			  "spare",
+			  " spare %llu",
+			  st->pool_stats.spare);
+	print_u64(PRINT_ANY,
+			  "runs",
+			  " runs %llu",
+			  st->pool_stats.runs);
+	print_u64(PRINT_ANY,
+			  "alloc_fails",
+			  " alloc fails %llu\n",
+			  st->pool_stats.alloc_fails);
+	close_json_object();
+
+	open_json_object("memory");
+	print_u64(PRINT_JSON,
+			  "used",
+			  NULL,
+			  st->memory_stats.used);
+	print_string(PRINT_FP,
+			  NULL,
+			  "memory used %s",
+			  sprint_size(st->memory_stats.used, b1));
+	print_u64(PRINT_ANY,
+			  "limit_drops",
+			  " limit drops %llu\n",
+			  st->memory_stats.limit_drops);
+	close_json_object();
+
 	if (is_json_context()) {
 		dscd_print_json_q(&st->abe_q_stats, "abe_q");
 		dscd_print_json_q(&st->be_q_stats, "be_q");
 		dscd_print_json_q(&st->service_q_stats, "service_q");
 
-		dscd_print_json_class(&st->abe_stats, "abe");
-		dscd_print_json_class(&st->be_stats, "be");
-		dscd_print_json_class(&st->all_stats, "all");
+		dscd_print_json_class(&st->abe_stats, &st->abe_hist, &st->abe_rates, "abe");
+		dscd_print_json_class(&st->be_stats, &st->be_hist, &st->be_rates, "be");
+		dscd_print_json_class(&st->all_stats, &st->all_hist, &st->all_rates, "all");
 
 		return 0;
 	}
@@ -291,12 +969,21 @@ static int dscd_print_xstats(struct qdisc_util *qu, FILE *f,
 			fprintf(f, name); \
 			{ \
 				struct tc_dscd_class_stats *stat; \
+				struct tc_dscd_delay_hist *hist; \
+				struct tc_dscd_class_rates *rates; \
 				stat = &st->abe_stats; \
+				hist = &st->abe_hist; \
+				rates = &st->abe_rates; \
 				fprintf(f, " %12" fmts,	val); \
 				stat = &st->be_stats; \
+				hist = &st->be_hist; \
+				rates = &st->be_rates; \
 				fprintf(f, " %12" fmts,	val); \
 				stat = &st->all_stats; \
+				hist = &st->all_hist; \
+				rates = &st->all_rates; \
 				fprintf(f, " %12" fmts,	val); \
+				(void)stat; (void)hist; (void)rates; \
 			} \
 			fprintf(f, "%s", _SL_); \
 		} while (0)
@@ -314,8 +1001,27 @@ static int dscd_print_xstats(struct qdisc_util *qu, FILE *f,
 	PRINT_CLASS_STAT_U64(          "  sent packets    ", sent_packets);
 	PRINT_CLASS_STAT_U64(          "  enqueue drops   ", enqueue_drops);
 	PRINT_CLASS_STAT_U64(          "  dequeue drops   ", dequeue_drops);
+	PRINT_CLASS_STAT_U64(          "  ecn marks       ", ecn_marks);
+	PRINT_CLASS_STAT_U64(          "  pushout drops   ", pushout_drops);
 	PRINT_CLASS_STAT(              "  avg delay       ", "s", 
 		sprint_time64(stat->sent_packets != 0 ? stat->sum_delay / stat->sent_packets : 0, b1));
+	PRINT_CLASS_STAT(              "  p50 delay       ", "s",
+		sprint_time64(dscd_hist_percentile(hist, 5000), b1));
+	PRINT_CLASS_STAT(              "  p90 delay       ", "s",
+		sprint_time64(dscd_hist_percentile(hist, 9000), b1));
+	PRINT_CLASS_STAT(              "  p99 delay       ", "s",
+		sprint_time64(dscd_hist_percentile(hist, 9900), b1));
+	PRINT_CLASS_STAT(              "  p99.9 delay     ", "s",
+		sprint_time64(dscd_hist_percentile(hist, 9990), b1));
+	PRINT_CLASS_STAT(              "  recv rate       ", "s",
+		sprint_rate(rates->received.bps, b1));
+	PRINT_CLASS_STAT(              "  recv pps        ", "llu", rates->received.pps);
+	PRINT_CLASS_STAT(              "  sent rate       ", "s",
+		sprint_rate(rates->sent.bps, b1));
+	PRINT_CLASS_STAT(              "  sent pps        ", "llu", rates->sent.pps);
+	PRINT_CLASS_STAT(              "  drop rate       ", "s",
+		sprint_rate(rates->dropped.bps, b1));
+	PRINT_CLASS_STAT(              "  drop pps        ", "llu", rates->dropped.pps);
 
 #undef PRINT_CLASS_STAT
 #undef SPRINT_CLASS_STAT
@@ -330,3 +1036,12 @@ struct qdisc_util dscd_qdisc_util = {
 	.print_qopt	= dscd_print_opt,
 	.print_xstats	= dscd_print_xstats,
 };
+
+// dscd_mq takes the same options and reports the sum over all TX queues,
+// tc loads it from q_dscd_mq.so (see build.sh)
+struct qdisc_util dscd_mq_qdisc_util = {
+	.id		= "dscd_mq",
+	.parse_qopt	= dscd_parse_opt,
+	.print_qopt	= dscd_print_opt,
+	.print_xstats	= dscd_print_xstats,
+};